@@ -83,6 +83,8 @@
 #  - USFSTL_CONTEXT_BACKEND = Context backend implementation, can be
 #                              - pthread (available on Windows* and Linux)
 #                              - ucontext (available on Linux*)
+#                              - asm (available on x86-64/i386 Linux, faster
+#                                than ucontext as it doesn't need syscalls)
 #                              - fiber (available on Windows)
 #                             Defaults are marked with * above.
 #  - USFSTL_FUZZING         = set to "1" to enable fuzzing, or "repro" to build only
@@ -408,10 +410,12 @@ DWARF_OBJS += dwarf/pecoff.o dwarf/nounwind.o dwarf/alloc.o
 DWARF_READ_OBJS += dwarf/read.o
 USFSTL_TEST_LINK_OPT += -lws2_32
 else
-OBJS += watchdog-posix.o rpc-posix.o multi-posix.o wallclock.o
+OBJS += watchdog-posix.o ctx-stack-posix.o rpc-posix.o rpc-shm.o multi-posix.o wallclock.o
 ifneq ($(USFSTL_VHOST_USER),)
 # include PCI since it just requires vhost, no point separating
 OBJS += vhost.o uds.o pci.o
+# vhost-user virtqueue workers use threads
+USFSTL_TEST_LINK_OPT += -pthread
 endif # USFSTL_VHOST_USER
 ifneq ($(USFSTL_SCHED_CTRL),)
 OBJS += uds.o schedctrl.o ctrluds.o
@@ -9,11 +9,31 @@
 #ifndef _USFSTL_CTX_H_
 #define _USFSTL_CTX_H_
 #include <stdbool.h>
+#include <stddef.h>
 
 struct usfstl_ctx;
 
 /**
- * usfstl_ctx_add - add a ctx to the scheduler
+ * usfstl_ctx_create_sized - create a ctx with a given stack size
+ * @name: ctx name
+ * @stack_size: stack size for the ctx, or 0 for the default (128 KiB,
+ *	or the thread default with the pthread backend); with the ucontext
+ *	and asm backends the stack is only committed as it's used, so a
+ *	large size is cheap, and overflowing it crashes on a guard page
+ * @fn: function to run
+ * @free: function to run on freeing the ctx, be it due to
+ *	ending it or due to test complete/abort
+ * @data: data to pass to the function
+ */
+struct usfstl_ctx *usfstl_ctx_create_sized(const char *name, size_t stack_size,
+					   void (*fn)(struct usfstl_ctx *ctx,
+						      void *data),
+					   void (*free)(struct usfstl_ctx *ctx,
+							void *data),
+					   void *data);
+
+/**
+ * usfstl_ctx_create - create a ctx with the default stack size
  * @name: ctx name
  * @fn: function to run
  * @free: function to run on freeing the ctx, be it due to
@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include "list.h"
 
 #ifdef _WIN32
@@ -25,6 +26,9 @@ typedef int usfstl_fd_t;
  * struct usfstl_loop_entry - main loop entry
  * @list: private
  * @handler: handler to call when fd is readable
+ * @pending: optional, called (in priority order) before waiting; if it
+ *	returns %true the handler is called without waiting for the fd,
+ *	e.g. for data that arrived through shared memory
  * @fd: file descriptor
  * @priority: priority, higher is handled earlier;
  *	must not change while the entry is registered
@@ -33,6 +37,7 @@ typedef int usfstl_fd_t;
 struct usfstl_loop_entry {
 	struct usfstl_list_entry list;
 	void (*handler)(struct usfstl_loop_entry *);
+	bool (*pending)(struct usfstl_loop_entry *);
 	usfstl_fd_t fd;
 	int priority;
 	void *data;
@@ -14,6 +14,38 @@
  * In a controlled process, the test cases will be invoked with RPC, and will
  * simply handle RPC messages in a loop; however, the pre/post functions can
  * still be used by assigning the global variables declared below.
+ *
+ * Participants can be arranged hierarchically: a participant that declares
+ * participants of its own (with USFSTL_MULTI_PARTICIPANT()) starts them and
+ * acts as their controller. Its multi-scheduler contains the jobs of its own
+ * participants, so towards its controller it only requests runtime for the
+ * earliest of them, and it runs them among itself up to the sync time it got
+ * from its controller. That way, a controller only negotiates time with its
+ * direct participants, no matter how many there are further down. Nested
+ * participants are named by their path from the top, e.g. "group1/dev2".
+ * Note that this changes their names compared to before such setups were
+ * supported, including g_usfstl_multi_local_participant.name as seen by
+ * the participant itself, so code deriving anything from its own name has
+ * to deal with the path (e.g. by using the last component).
+ *
+ * Normally, only one participant runs at a time. A participant can declare a
+ * lookahead, the minimum simulation time it takes for anything it does to
+ * affect any other participant. If the participant that's due to run next
+ * has a lookahead, the controller computes a horizon as the earliest time
+ * any other participant (or the controller itself) could affect anyone,
+ * i.e. the earliest next job time plus that job owner's lookahead (which is
+ * zero for anyone not declaring one). All participants with jobs before the
+ * horizon then run in parallel up to it, which is conservative parallel
+ * discrete event simulation. The results don't depend on host timing, but
+ * only as long as participants running in parallel honour their lookahead:
+ * they must not call each other or the controller, and must not write the
+ * same bytes of shared memory. Their changes are merged byte by byte against
+ * what they all started from as each of them stops, so they may well write
+ * different variables next to each other, but the test fails if two of them
+ * changed the same byte. Mapped shared memory (see --multi-shared-mem-map)
+ * is visible immediately and can't be merged like that, so participants run
+ * one at a time while any of it is mapped. Pass the option --multi-sequential
+ * to the controller to run them one at a time anyway.
  */
 #ifndef _USFSTL_MULTI_H
 #define _USFSTL_MULTI_H
@@ -26,6 +58,8 @@ enum usfstl_multi_participant_flags {
 	USFSTL_MULTI_PARTICIPANT_WAITING		= 1 << 0,
 	/* indicates that the (local/remote) participant's view of the shared mem is outdated */
 	USFSTL_MULTI_PARTICIPANT_SHARED_MEM_OUTDATED	= 1 << 1,
+	/* participant is running in parallel with others, up to a common horizon */
+	USFSTL_MULTI_PARTICIPANT_PARALLEL		= 1 << 2,
 };
 
 /**
@@ -43,6 +77,13 @@ enum usfstl_multi_participant_flags {
  * @flags: see &enum usfstl_multi_participant_flags
  * @sync_set: indicates @sync was set (and participant notified)
  * @sync: next sync time for this participant
+ * @shared_mem_gen: (internal) generation of the shared memory changes
+ *	the participant has seen
+ * @lookahead: minimum simulation time it takes for anything this
+ *	participant does to affect any other participant, if nonzero it
+ *	may run in parallel with others (see above)
+ * @parallel_time: (internal) time of the participant while it's running
+ *	in parallel with others
  * @data: arbitrary data pointer for use by the application
  */
 struct usfstl_multi_participant {
@@ -55,6 +96,9 @@ struct usfstl_multi_participant {
 	uint32_t flags;
 	uint64_t sync;
 	unsigned int pid;
+	uint32_t shared_mem_gen;
+	uint64_t lookahead;
+	uint64_t parallel_time;
 	void *data;
 };
 
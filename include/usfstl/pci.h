@@ -32,6 +32,78 @@
  * and then start that normally, i.e. usfstl_vhost_user_server_start().
  */
 
+#define USFSTL_PCI_NUM_BARS	6
+
+struct usfstl_pci_device;
+struct usfstl_pci_device_ops;
+struct usfstl_pci_regmap;
+struct usfstl_pci_irq_vector;
+struct virtio_pcidev_msg;
+
+/**
+ * struct usfstl_pci_reg - MMIO register description
+ * @offset: offset of the register in the BAR, must be aligned to @width
+ * @width: width of the register in bytes (1, 2, 4 or 8)
+ * @reset: reset value of the register
+ * @write_mask: bits the driver can write, the others keep their value
+ * @read: optional read hook, called with the stored value and returns
+ *	the value the driver reads, e.g. for registers with side effects
+ *	or live state
+ * @write: optional write hook, called after the masked value was stored
+ *	with the old and the new (stored) value
+ * @name: optional register name
+ *
+ * Note that the hooks may use usfstl_pci_reg_get() and usfstl_pci_reg_set()
+ * to access other registers, or this register (e.g. to clear it on write).
+ */
+struct usfstl_pci_reg {
+	uint32_t offset;
+	uint8_t width;
+	uint64_t reset;
+	uint64_t write_mask;
+	uint64_t (*read)(struct usfstl_pci_device *dev,
+			 const struct usfstl_pci_reg *reg, uint64_t value);
+	void (*write)(struct usfstl_pci_device *dev,
+		      const struct usfstl_pci_reg *reg,
+		      uint64_t old, uint64_t value);
+	const char *name;
+};
+
+/**
+ * struct usfstl_pci_bar_regs - MMIO register table for a BAR
+ * @regs: the registers, in any order but they must not overlap
+ * @n_regs: number of registers in @regs
+ * @size: size of the register window, starting at offset 0 in the BAR,
+ *	all registers must be within it
+ *
+ * Accesses to a register with its exact offset and width are handled
+ * entirely by the generic code (calling only the register's hooks, if
+ * any), all other accesses (partial, unaligned, outside of registers
+ * or of the window, and memset) are passed to the MMIO ops.
+ */
+struct usfstl_pci_bar_regs {
+	const struct usfstl_pci_reg *regs;
+	unsigned int n_regs;
+	size_t size;
+};
+
+/**
+ * struct usfstl_pci_irq_moderation - interrupt moderation settings
+ * @min_interval: minimum interval between two interrupts on the same
+ *	vector (MSI address/data or INTx line), in scheduler ticks. An
+ *	interrupt sent earlier than this after the previous one is held
+ *	back and then sent once the interval expires, coalescing any
+ *	further interrupts on the vector. Zero disables moderation.
+ * @max_count: if non-zero, a held interrupt is sent immediately once
+ *	this many interrupts were coalesced on the vector
+ *
+ * Moderation requires the vhost-user server to have a scheduler.
+ */
+struct usfstl_pci_irq_moderation {
+	uint64_t min_interval;
+	unsigned int max_count;
+};
+
 /**
  * struct usfstl_pci_device - PCI device structure
  * @config_space: configuration space data, if callbacks aren't used
@@ -41,12 +113,31 @@
  * @dev: vhost user device, will be filled in by the generic code,
  *	you may use e.g. usfstl_vhost_user_to_va() with this (but must be
  *	careful to not do that for MSI(-X) interrupt writes)
+ * @bar_regs: optional MMIO register table per BAR, must be set up when
+ *	returned from the @connected callback (see &struct usfstl_pci_bar_regs)
+ * @irq_moderation: interrupt moderation settings, may be changed at any
+ *	time but changes only affect interrupts sent afterwards
  */
 struct usfstl_pci_device {
 	void *config_space;
 	const void *config_space_mask;
 	unsigned int config_space_size;
 	struct usfstl_vhost_user_dev *dev;
+	const struct usfstl_pci_bar_regs *bar_regs[USFSTL_PCI_NUM_BARS];
+	struct usfstl_pci_irq_moderation irq_moderation;
+
+	/* private: */
+	struct usfstl_pci_irq_vector **irq_vectors;
+	unsigned int n_irq_vectors;
+	struct usfstl_pci_regmap *regmap[USFSTL_PCI_NUM_BARS];
+	void (*cfg_read)(struct usfstl_pci_device_ops *ops,
+			 struct usfstl_pci_device *pcidev,
+			 struct virtio_pcidev_msg *msg,
+			 struct usfstl_vhost_user_buf *buf);
+	void (*cfg_write)(struct usfstl_pci_device_ops *ops,
+			  struct usfstl_pci_device *pcidev,
+			  struct virtio_pcidev_msg *msg,
+			  struct usfstl_vhost_user_buf *buf);
 };
 
 /**
@@ -70,8 +161,11 @@ struct usfstl_pci_device {
  *	user must call usfstl_pci_send_response() with the given vubuf.
  *	Note that the input pointer points to the correct byte-order
  *	(little endian) value of the appropriate size.
- * @mmio_read: read MMIO space at the given BAR/offset
- * @mmio_write: write MMIO space at the given BAR/offset
+ * @mmio_read: read MMIO space at the given BAR/offset, this (or the
+ *	deferred version) is optional only if all MMIO reads are covered
+ *	by the device's register tables
+ * @mmio_write: write MMIO space at the given BAR/offset, similarly
+ *	optional if covered by the register tables
  * @mmio_set: memset MMIO space at the given BAR/offset
  * @mmio_read_deferred: like @mmio_read, but deferred, and the user must
  *	call usfstl_pci_send_response() with the given vubuf
@@ -131,6 +225,8 @@ extern const struct usfstl_vhost_user_ops usfstl_vhost_user_ops_pci;
  * usfstl_pci_send_interrupt - send an interrupt
  * @pcidev: the device to send for
  * @number: the interrupt number to send (1-4 for INTA-INTD)
+ *
+ * Note that this is subject to the device's @irq_moderation.
  */
 void usfstl_pci_send_int(struct usfstl_pci_device *pcidev, int number);
 
@@ -140,6 +236,8 @@ void usfstl_pci_send_int(struct usfstl_pci_device *pcidev, int number);
  * @addr: the (physical) address to send to
  * @msix: indicates MSI-X (32-bit write)
  * @data: the message to send (16 bits only for MSI)
+ *
+ * Note that this is subject to the device's @irq_moderation.
  */
 void usfstl_pci_send_msi(struct usfstl_pci_device *pcidev,
 			 uint64_t addr, bool msix, uint32_t data);
@@ -156,6 +254,37 @@ static inline void usfstl_pci_send_response(struct usfstl_pci_device *pcidev,
 	usfstl_vhost_user_send_response(pcidev->dev, vubuf);
 }
 
+/**
+ * usfstl_pci_reg_get - get the stored value of a register
+ * @pcidev: the device
+ * @bar: the BAR the register is in
+ * @offset: the register offset, must be the offset of a register
+ *	in the BAR's register table
+ *
+ * Note that this doesn't call the register's read hook.
+ */
+uint64_t usfstl_pci_reg_get(struct usfstl_pci_device *pcidev, int bar,
+			    uint32_t offset);
+
+/**
+ * usfstl_pci_reg_set - set the stored value of a register
+ * @pcidev: the device
+ * @bar: the BAR the register is in
+ * @offset: the register offset, must be the offset of a register
+ *	in the BAR's register table
+ * @value: the new value, not subject to the write mask
+ *
+ * Note that this doesn't call the register's write hook.
+ */
+void usfstl_pci_reg_set(struct usfstl_pci_device *pcidev, int bar,
+			uint32_t offset, uint64_t value);
+
+/**
+ * usfstl_pci_regs_reset - reset all registers to their reset values
+ * @pcidev: the device
+ */
+void usfstl_pci_regs_reset(struct usfstl_pci_device *pcidev);
+
 /**
  * usfstl_pci_pa_to_va - translate physical address to virtual
  * @pcidev: device to translate address for
@@ -195,4 +324,77 @@ static inline void usfstl_pci_dma_write(struct usfstl_pci_device *pcidev,
 	memcpy(usfstl_pci_pa_to_va(pcidev, physaddr), buf, size);
 }
 
+/**
+ * struct usfstl_pci_dma_sg - guest physical memory range for DMA
+ * @addr: physical address
+ * @len: length in bytes
+ */
+struct usfstl_pci_dma_sg {
+	uint64_t addr;
+	size_t len;
+};
+
+/**
+ * usfstl_pci_dma_map - get direct access to a physical memory range
+ * @pcidev: device that does the DMA access
+ * @physaddr: physical address of the range
+ * @size: size of the range
+ *
+ * Returns: a pointer that can be used for zero-copy access to the
+ *	whole range, or %NULL if the range isn't contained within a
+ *	single mapped memory region (use the scatter-gather functions
+ *	in that case)
+ */
+void *usfstl_pci_dma_map(struct usfstl_pci_device *pcidev,
+			 uint64_t physaddr, size_t size);
+
+/**
+ * usfstl_pci_dma_map_sg - translate a scatter-gather list
+ * @pcidev: device that does the DMA access
+ * @sg: the physical ranges
+ * @n_sg: number of entries in @sg
+ * @iov: output vector, receives the mapped ranges; ranges crossing
+ *	memory regions are split, so this may need more entries than @sg
+ * @max_iov: number of entries available in @iov
+ *
+ * The resulting @iov can be used directly for zero-copy access, e.g.
+ * with iov_read()/iov_fill() or readv()/writev().
+ *
+ * Returns: the number of @iov entries used
+ */
+unsigned int usfstl_pci_dma_map_sg(struct usfstl_pci_device *pcidev,
+				   const struct usfstl_pci_dma_sg *sg,
+				   unsigned int n_sg,
+				   struct iovec *iov, unsigned int max_iov);
+
+/**
+ * usfstl_pci_dma_read_sg - DMA read from a scatter-gather list
+ * @pcidev: device that does the DMA access
+ * @buf: output buffer
+ * @size: size of the output buffer
+ * @sg: the physical ranges to copy from, in order
+ * @n_sg: number of entries in @sg
+ *
+ * Returns: the number of bytes copied
+ */
+size_t usfstl_pci_dma_read_sg(struct usfstl_pci_device *pcidev,
+			      void *buf, size_t size,
+			      const struct usfstl_pci_dma_sg *sg,
+			      unsigned int n_sg);
+
+/**
+ * usfstl_pci_dma_write_sg - DMA write to a scatter-gather list
+ * @pcidev: device that does the DMA access
+ * @sg: the physical ranges to copy to, in order
+ * @n_sg: number of entries in @sg
+ * @buf: input buffer
+ * @size: size of the input buffer
+ *
+ * Returns: the number of bytes copied
+ */
+size_t usfstl_pci_dma_write_sg(struct usfstl_pci_device *pcidev,
+			       const struct usfstl_pci_dma_sg *sg,
+			       unsigned int n_sg,
+			       const void *buf, size_t size);
+
 #endif // _USFSTL_PCI_H_
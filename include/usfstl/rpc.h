@@ -35,6 +35,11 @@
  *	- USFSTL_RPC_VAR_METHOD_P()	- input passed by reference,
  *					  variable output
  *	- USFSTL_RPC_VAR_METHOD_VAR()	- variable input & output
+ *	- USFSTL_RPC_ONEWAY_METHOD()	- like USFSTL_RPC_VOID_METHOD(), but
+ *					  the caller doesn't wait for the
+ *					  call to complete, see below
+ *	- USFSTL_RPC_ONEWAY_METHOD_P()	- same, input passed by reference
+ *	- USFSTL_RPC_ONEWAY_METHOD_VAR() - same, variable-length input
  *
  * You must keep this file empty except for includes (which must have a double
  * include guard or #pragma once) and the USFSTL_RPC_METHOD (and variants) usage,
@@ -119,6 +124,45 @@
  *
  * For the callee, you must pass the connection to the usfstl_rpc_handle() when
  * it becomes readable.
+ *
+ *
+ * One-way methods (USFSTL_RPC_ONEWAY_METHOD and its _P and _VAR variants)
+ * are implemented on the callee just like void methods, but the caller
+ * only queues the request (including the extra data) on the connection
+ * and returns immediately, no response is ever sent. Queued requests are
+ * written out, in order, before any other RPC traffic is sent by this
+ * process (a regular call or a response) and before waiting for RPC
+ * traffic, so as far as the callee can observe they're executed in the
+ * same order relative to other calls as if they were synchronous. If you
+ * block in some other way (e.g. in usfstl_loop_wait_and_handle() outside
+ * of the RPC code) call usfstl_rpc_flush() first. Since nothing is sent
+ * back, a one-way call to a method the callee doesn't implement fails on
+ * the callee.
+ *
+ *
+ * Calls to a connection can also be batched, e.g. for a long sequence of
+ * register writes:
+ *
+ *	usfstl_rpc_batch_start(conn);
+ *	write_reg_conn(conn, &w1);
+ *	write_reg_conn(conn, &w2);
+ *	val = read_reg_conn(conn, 0x100);
+ *	write_reg_conn(conn, &w3);
+ *	usfstl_rpc_batch_end(conn);
+ *
+ * Within the batch, calls to methods without a return value (including
+ * one-way methods) are only queued. The queue is sent as a single message
+ * along with the next call that does have a return value (since that's
+ * needed right away) or when the batch ends; the callee executes the calls
+ * in order and sends back one response for all of them. Errors are handled
+ * just like for individual calls: the callee stops at the first call that
+ * fails and the caller asserts, reporting that call, after the results of
+ * the calls before it were returned. Batches may be nested, only the end
+ * of the outermost one sends the queue. Calls made while handling nested
+ * calls from the peer aren't batched, and neither are calls to any other
+ * connection, so these may overtake the queued calls. As with the _conn()
+ * functions, %NULL means the default connection; batching is a no-op for
+ * %USFSTL_RPC_LOCAL.
  */
 #if !defined(_USFSTL_RPC_H_) || \
     defined(USFSTL_RPC_CALLER_STUB) || \
@@ -132,14 +176,33 @@
 
 #ifndef _USFSTL_RPC_H_
 
+struct usfstl_rpc_shm;
+
 struct usfstl_rpc_connection {
 	struct usfstl_list_entry entry;
 	void *data;
 	struct usfstl_loop_entry conn;
 	uint32_t initialized:1,
-	         broken:1;
+	         broken:1,
+	         shm_accept:1;
 	const char *name;
 
+	/*
+	 * shared memory transport
+	 *
+	 * If shm_size is set when the connection is initialized, the
+	 * peer is asked to switch to exchanging data through a pair of
+	 * shared memory rings of (at least) this size instead of through
+	 * the socket. This requires conn.fd to be a unix domain socket
+	 * (to pass the memory fd) and isn't supported on Windows.
+	 *
+	 * Additionally, shm_bulk_size can be set to have a separate area of
+	 * this size for each direction, through which large arguments and
+	 * return values are passed without copying them through the rings.
+	 */
+	uint32_t shm_size, shm_bulk_size;
+	struct usfstl_rpc_shm *shm;
+
 	/*
 	 * extra data
 	 *
@@ -152,11 +215,24 @@ struct usfstl_rpc_connection {
 	void (*extra_received)(struct usfstl_rpc_connection *, const void *);
 
 	void (*disconnected)(struct usfstl_rpc_connection *);
+
+	/* internal: queued one-way requests */
+	struct usfstl_list_entry oneway_entry;
+	unsigned char *oneway_buf;
+	uint32_t oneway_len, oneway_size;
+
+	/* internal: batched requests */
+	unsigned char *batch_buf;
+	uint32_t batch_len, batch_size, batch_calls;
+	uint32_t batch_depth, batch_level;
 };
 
 #define USFSTL_RPC_TAG_REQUEST	0x7573323e
+#define USFSTL_RPC_TAG_ONEWAY	0x7573323d
 #define USFSTL_RPC_TAG_RESPONSE	0x7573323c
+#define USFSTL_RPC_TAG_BATCH	0x7573323b
 #define USFSTL_VAR_DATA_SIZE	0x80000000
+#define USFSTL_SHARED_DATA	0x40000000
 
 struct usfstl_rpc_request {
 	char name[128];
@@ -169,6 +245,23 @@ struct usfstl_rpc_response {
 	uint32_t error;
 };
 
+struct usfstl_rpc_batch {
+	uint32_t calls, len;
+	/* followed by extra data */
+	/*
+	 * followed by the calls, each a struct usfstl_rpc_request
+	 * and the argument data padded to a multiple of 8 bytes
+	 */
+};
+
+struct usfstl_rpc_batch_response {
+	uint32_t done, len;
+	/*
+	 * followed by the return data of the calls that were done,
+	 * each padded to a multiple of 8 bytes
+	 */
+};
+
 struct usfstl_rpc_stub {
 	struct usfstl_rpc_request req;
 	void *fn;
@@ -178,9 +271,16 @@ void usfstl_rpc_call(struct usfstl_rpc_connection *conn, const char *name,
 		     const void *arg, uint32_t argmin, uint32_t argsize,
 		     void *ret, uint32_t retmin, uint32_t retsize);
 
+void usfstl_rpc_call_oneway(struct usfstl_rpc_connection *conn,
+			    const char *name, const void *arg,
+			    uint32_t argsize);
+
 void usfstl_rpc_add_connection(struct usfstl_rpc_connection *conn);
 void usfstl_rpc_del_connection(struct usfstl_rpc_connection *conn);
 void usfstl_rpc_handle(void);
+void usfstl_rpc_flush(void);
+void usfstl_rpc_batch_start(struct usfstl_rpc_connection *conn);
+void usfstl_rpc_batch_end(struct usfstl_rpc_connection *conn);
 
 extern struct usfstl_rpc_connection *g_usfstl_rpc_default_connection;
 
@@ -194,6 +294,8 @@ extern struct usfstl_rpc_connection g_usfstl_rpc_local;
 #undef _USFSTL_RPC_METHOD_VAR
 #undef _USFSTL_RPC_VAR_METHOD
 #undef _USFSTL_RPC_VAR_METHOD_VAR
+#undef _USFSTL_RPC_ONEWAY_METHOD
+#undef _USFSTL_RPC_ONEWAY_METHOD_VAR
 #if defined(USFSTL_RPC_CALLEE_STUB)
 /*
  * Define the callee stub, i.e. something that plugs into the RPC
@@ -290,6 +392,26 @@ __attribute__((section("usfstl_rpcstub"))) = {				\
 * const _usfstl_rpc_stub_##_name __attribute__((section("usfstl_rpc"),	\
 					 used)) =			\
 	&usfstl_rpc_stub_##_name
+#define _USFSTL_RPC_ONEWAY_METHOD(_name, _in, _p, _np, _d)		\
+	_USFSTL_RPC_VOID_METHOD(_name, _in, _p, _np, _d)
+#define _USFSTL_RPC_ONEWAY_METHOD_VAR(_name, _in)			\
+static void								\
+_usfstl_rpc_stubfn_##_name(struct usfstl_rpc_connection *conn,		\
+			   const _in *arg,				\
+			   const uint32_t argsz,			\
+			   void *ret)					\
+{									\
+	ret = ret; /* it is intentionally unused */			\
+	_impl_ ## _name(conn, arg, argsz);				\
+}									\
+static const struct usfstl_rpc_stub usfstl_rpc_stub_##_name		\
+__attribute__((section("usfstl_rpcstub"))) = {				\
+	.req.name = #_name "--" #_in "*",				\
+	.req.argsize = USFSTL_VAR_DATA_SIZE | sizeof(_in),		\
+	.fn = (void *)_usfstl_rpc_stubfn_##_name,			\
+},									\
+* const _usfstl_rpc_stub_##_name					\
+__attribute__((section("usfstl_rpc"), used)) = &usfstl_rpc_stub_##_name
 #elif defined(USFSTL_RPC_CALLER_STUB)
 #define _USFSTL_RPC_METHOD(_out, _name, _in, _p, _np, _d)		\
 _out _name(const _in _p arg)						\
@@ -407,6 +529,42 @@ void _name ## _conn(struct usfstl_rpc_connection *conn,			\
 		      arg, sizeof(_in), argsz | USFSTL_VAR_DATA_SIZE,	\
 		      ret, sizeof(_out), retsz);			\
 }
+#define _USFSTL_RPC_ONEWAY_METHOD(_name, _in, _p, _np, _d)		\
+void _name(const _in _p arg)						\
+{									\
+	const _in _p _arg = arg;					\
+									\
+	usfstl_rpc_call_oneway(g_usfstl_rpc_default_connection,		\
+			       #_name "--" #_in #_p,			\
+			       _d _arg, sizeof(_in));			\
+}									\
+void _name ## _conn(struct usfstl_rpc_connection *conn,			\
+		    const _in _p arg)					\
+{									\
+	const _in _p _arg = arg;					\
+									\
+	if (!conn)							\
+		conn = g_usfstl_rpc_default_connection;			\
+									\
+	usfstl_rpc_call_oneway(conn, #_name "--" #_in #_p,		\
+			       _d _arg, sizeof(_in));			\
+}
+#define _USFSTL_RPC_ONEWAY_METHOD_VAR(_name, _in)			\
+void _name(const _in *arg, const uint32_t argsz)			\
+{									\
+	usfstl_rpc_call_oneway(g_usfstl_rpc_default_connection,		\
+			       #_name "--" #_in "*",			\
+			       arg, argsz | USFSTL_VAR_DATA_SIZE);	\
+}									\
+void _name ## _conn(struct usfstl_rpc_connection *conn,			\
+		    const _in *arg, const uint32_t argsz)		\
+{									\
+	if (!conn)							\
+		conn = g_usfstl_rpc_default_connection;			\
+									\
+	usfstl_rpc_call_oneway(conn, #_name "--" #_in "*",		\
+			       arg, argsz | USFSTL_VAR_DATA_SIZE);	\
+}
 #elif defined(USFSTL_RPC_IMPLEMENTATION)
 #define _USFSTL_RPC_METHOD(_out, _name, _in, _p, _np, _d)		\
 _out _impl_ ## _name(struct usfstl_rpc_connection *conn, const _in _p in)
@@ -423,6 +581,11 @@ void _impl_ ## _name(struct usfstl_rpc_connection *conn,		\
 void _impl_ ## _name(struct usfstl_rpc_connection *conn,		\
 		     const _in *in, const uint32_t insize,		\
 		     _out *out, const uint32_t outsize)
+#define _USFSTL_RPC_ONEWAY_METHOD(_name, _in, _p, _np, _d)		\
+	_USFSTL_RPC_VOID_METHOD(_name, _in, _p, _np, _d)
+#define _USFSTL_RPC_ONEWAY_METHOD_VAR(_name, _in)			\
+void _impl_ ## _name(struct usfstl_rpc_connection *conn,		\
+		     const _in *in, const uint32_t insize)
 #else // normal include for just the prototypes
 #define _USFSTL_RPC_METHOD(_out, _name, _in, _p, _np, _d)		\
 _out _name ## _conn(struct usfstl_rpc_connection *, const _in _p in);	\
@@ -455,6 +618,14 @@ void _name(const _in *in, const uint32_t insize,			\
 void _impl_ ## _name(struct usfstl_rpc_connection *,			\
 		     const _in *in, const uint32_t insize,		\
 		     _out *out, const uint32_t outsize)
+#define _USFSTL_RPC_ONEWAY_METHOD(_name, _in, _p, _np, _d)		\
+	_USFSTL_RPC_VOID_METHOD(_name, _in, _p, _np, _d)
+#define _USFSTL_RPC_ONEWAY_METHOD_VAR(_name, _in)			\
+void _name ## _conn(struct usfstl_rpc_connection *,			\
+		    const _in *in, const uint32_t insize);		\
+void _name(const _in *in, const uint32_t insize);			\
+void _impl_ ## _name(struct usfstl_rpc_connection *,			\
+		     const _in *in, const uint32_t insize)
 
 #define USFSTL_RPC_METHOD(_out, _name, _in)				\
 	_USFSTL_RPC_METHOD(_out, _name, _in,,*,&)
@@ -472,6 +643,12 @@ void _impl_ ## _name(struct usfstl_rpc_connection *,			\
 	_USFSTL_RPC_VAR_METHOD(_out, _name, _in,*,,)
 #define USFSTL_RPC_VAR_METHOD_VAR(_out, _name, _in)			\
 	_USFSTL_RPC_VAR_METHOD_VAR(_out, _name, _in)
+#define USFSTL_RPC_ONEWAY_METHOD(_name, _in)				\
+	_USFSTL_RPC_ONEWAY_METHOD(_name, _in,,*,&)
+#define USFSTL_RPC_ONEWAY_METHOD_P(_name, _in)				\
+	_USFSTL_RPC_ONEWAY_METHOD(_name, _in,*,,)
+#define USFSTL_RPC_ONEWAY_METHOD_VAR(_name, _in)			\
+	_USFSTL_RPC_ONEWAY_METHOD_VAR(_name, _in)
 #endif // variants of prototype/code generation
 
 #ifndef USFSTL_RPC_METHOD
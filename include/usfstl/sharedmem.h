@@ -29,6 +29,19 @@
 
 typedef char usfstl_shared_mem_section_name_t[32];
 
+// Sections are page aligned so that their full pages can be mapped
+// shared between all participants instead of copying them around,
+// see the --multi-shared-mem-map option.
+#define USFSTL_SHARED_MEM_PAGE_SIZE	4096
+#ifndef _WIN32
+#define _USFSTL_SHARED_MEM_ALIGN(_name)					\
+static char _name ## _PAGE_ALIGN[0]					\
+	__attribute__((used, aligned(USFSTL_SHARED_MEM_PAGE_SIZE),	\
+		       section("usfstl_shared_mem_" #_name)));
+#else
+#define _USFSTL_SHARED_MEM_ALIGN(_name)
+#endif
+
 /**
  * struct usfstl_shared_mem_section - simulation shared memory section
  * @name: name of the section - must be unique for each section
@@ -48,6 +61,7 @@ struct usfstl_shared_mem_section {
 // Note: the section pointer below is not static because it is referred by
 // SHARED_MEM_DUMMY_REF. This also ensures that section names are unique
 #define USFSTL_SHARED_MEM_SECTION(_name, ...)				\
+_USFSTL_SHARED_MEM_ALIGN(_name)						\
 extern char USFSTL_SHARED_MEM_START(_name)[];				\
 extern char USFSTL_SHARED_MEM_STOP(_name)[];				\
 static const struct usfstl_shared_mem_section _name ## _SECTION = {	\
@@ -6,6 +6,7 @@
 #ifndef _USFSTL_TASK_H_
 #define _USFSTL_TASK_H_
 #include <stdint.h>
+#include <stddef.h>
 #include "sched.h"
 #include "list.h"
 
@@ -56,6 +57,30 @@ struct usfstl_task;
  */
 struct usfstl_task *usfstl_task_main(void);
 
+/**
+ * usfstl_task_create_sized - create a new task with a given stack size
+ *
+ * @name: name for the task
+ * @group: scheduler group for this new task
+ * @stack_size: stack size, or 0 for the default, see
+ *	usfstl_ctx_create_sized()
+ * @fn: function to call when the task runs
+ * @free: function to call when the task is freed, whether by
+ *	usfstl_task_end_self(), usfstl_task_end() or the test
+ *	having ended/being aborted
+ * @data: data passed to the task function
+ *
+ * Like usfstl_task_create(), but for tasks that need a larger
+ * (or smaller) stack than the default.
+ */
+struct usfstl_task *usfstl_task_create_sized(const char *name, uint8_t group,
+					     size_t stack_size,
+					     void (*fn)(struct usfstl_task *task,
+							void *data),
+					     void (*free)(struct usfstl_task *task,
+							  void *data),
+					     void *data);
+
 /**
  * usfstl_task_create - create a new task
  *
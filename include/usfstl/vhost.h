@@ -18,6 +18,7 @@ struct usfstl_vhost_user_buf {
 	unsigned int virtq_idx;
 	unsigned int idx;
 	bool allocated;
+	uint64_t dequeued;
 };
 
 struct usfstl_vhost_user_dev {
@@ -26,12 +27,55 @@ struct usfstl_vhost_user_dev {
 	void *data;
 };
 
+/**
+ * struct usfstl_vhost_user_virtq_stats - per-virtqueue statistics
+ * @kicks: number of kicks (notifications from the driver) received
+ * @notifications: number of buffers returned to the driver, each of
+ *	which results in a notification (call) to the driver
+ * @buffers: number of buffers taken from the virtqueue
+ * @descriptors: total number of descriptors in those buffers, divide
+ *	by @buffers for the average chain length
+ * @max_chain_len: longest descriptor chain seen
+ * @queued_time: total time buffers spent between the last kick and
+ *	being taken from the virtqueue (in scheduler ticks, only if the
+ *	server has a scheduler), i.e. including the interrupt latency
+ * @max_queued_time: maximum of the above for a single buffer
+ * @busy_time: total time between taking buffers from the virtqueue and
+ *	returning them, this is only non-zero with deferred handling or
+ *	worker queues (again only with a scheduler)
+ * @max_busy_time: maximum of the above for a single buffer
+ */
+struct usfstl_vhost_user_virtq_stats {
+	uint64_t kicks;
+	uint64_t notifications;
+	uint64_t buffers;
+	uint64_t descriptors;
+	unsigned int max_chain_len;
+	uint64_t queued_time, max_queued_time;
+	uint64_t busy_time, max_busy_time;
+};
+
+/**
+ * struct usfstl_vhost_user_ops - vhost-user device operations
+ * @connected: a new device connected
+ * @handle: handle a buffer on the given vring; note that for queues
+ *	listed in the server's @worker_queues this is called on a worker
+ *	thread and must not fail assertions (see there)
+ * @disconnected: the device disconnected
+ * @set_config: the driver wrote @len bytes of @data at @offset into
+ *	the config space; @data is only valid during the call. If this
+ *	isn't set, config space writes are dropped and, if the driver asked
+ *	for a reply, acknowledged with a failure status.
+ */
 struct usfstl_vhost_user_ops {
 	void (*connected)(struct usfstl_vhost_user_dev *dev);
 	void (*handle)(struct usfstl_vhost_user_dev *dev,
 		       struct usfstl_vhost_user_buf *buf,
 		       unsigned int vring);
 	void (*disconnected)(struct usfstl_vhost_user_dev *dev);
+	void (*set_config)(struct usfstl_vhost_user_dev *dev,
+			   unsigned int offset, const void *data,
+			   size_t len);
 };
 
 /**
@@ -75,6 +119,35 @@ struct usfstl_vhost_user_server {
 	 */
 	uint64_t input_queues;
 
+	/**
+	 * @worker_queues: bitmap of input queues whose buffers are handled
+	 *	on a separate worker thread (one per device and queue) instead
+	 *	of the simulation thread. When such a queue is kicked, all the
+	 *	available buffers are handed to the worker as a batch, and the
+	 *	handle() method is called for each of them on the worker thread,
+	 *	so it must not interact with the scheduler or other simulation
+	 *	state that isn't protected appropriately. The buffers are always
+	 *	returned automatically (regardless of @deferred_handling) once
+	 *	the whole batch is done, and this happens on the simulation
+	 *	thread @worker_latency after the batch was started; if that
+	 *	point in simulation time is reached before the worker finishes,
+	 *	the simulation waits for it. Without a @scheduler, the buffers
+	 *	are returned as soon as the worker finishes.
+	 *	Failing a test unwinds the simulation thread's stack, so for
+	 *	these queues handle() must not use USFSTL_ASSERT() and friends;
+	 *	it has to record any problem and leave it to code running on
+	 *	the simulation thread to fail the test.
+	 *	The queues must also be set in @input_queues (which is checked
+	 *	when the server is started).
+	 */
+	uint64_t worker_queues;
+
+	/**
+	 * @worker_latency: simulated processing time for a batch of buffers
+	 *	handed to a worker (see @worker_queues), in scheduler ticks
+	 */
+	unsigned int worker_latency;
+
 	/**
 	 * @scheduler: the scheduler to integrate with,
 	 *	may be %NULL
@@ -98,12 +171,15 @@ struct usfstl_vhost_user_server {
 	uint64_t protocol_features;
 
 	/**
-	 * @config: config data, if supported
+	 * @config: config data, if supported; reads are served directly
+	 *	from here (for the requested range only), so the device can
+	 *	update it in place and then call
+	 *	usfstl_vhost_user_config_changed().
 	 */
 	const void *config;
 
 	/**
-	 * @config_len: length of config data
+	 * @config_len: length of config data, there's no upper limit
 	 */
 	size_t config_len;
 
@@ -141,6 +217,10 @@ void usfstl_vhost_user_dev_notify(struct usfstl_vhost_user_dev *dev,
 /**
  * usfstl_vhost_user_config_changed - notify host of a config change event
  * @dev: device to send to
+ *
+ * The host will read back the config space (or the parts of it it's
+ * interested in), so the device should update the server's @config
+ * data in place before calling this.
  */
 void usfstl_vhost_user_config_changed(struct usfstl_vhost_user_dev *dev);
 
@@ -152,6 +232,36 @@ void usfstl_vhost_user_config_changed(struct usfstl_vhost_user_dev *dev);
 void usfstl_vhost_user_send_response(struct usfstl_vhost_user_dev *dev,
 				     struct usfstl_vhost_user_buf *buf);
 
+/**
+ * usfstl_vhost_user_get_virtq_stats - get virtqueue statistics
+ * @dev: device to get the statistics for
+ * @virtq_idx: virtqueue index
+ * @stats: filled with the statistics
+ *
+ * The statistics are collected from the time the device connected or
+ * they were last reset with usfstl_vhost_user_reset_virtq_stats().
+ * Use the "--vhost-user-stats" argument to print them for all devices
+ * when they disconnect or the program exits.
+ */
+void usfstl_vhost_user_get_virtq_stats(struct usfstl_vhost_user_dev *dev,
+					unsigned int virtq_idx,
+					struct usfstl_vhost_user_virtq_stats *stats);
+
+/**
+ * usfstl_vhost_user_reset_virtq_stats - reset virtqueue statistics
+ * @dev: device to reset the statistics for
+ * @virtq_idx: virtqueue index
+ */
+void usfstl_vhost_user_reset_virtq_stats(struct usfstl_vhost_user_dev *dev,
+					  unsigned int virtq_idx);
+
+/**
+ * usfstl_vhost_user_dump_stats - print statistics for all virtqueues
+ * @dev: device to print the statistics for
+ * @f: file to print to
+ */
+void usfstl_vhost_user_dump_stats(struct usfstl_vhost_user_dev *dev, FILE *f);
+
 /**
  * usfstl_vhost_user_to_va - translate address
  * @dev: device to translate address for
@@ -159,6 +269,18 @@ void usfstl_vhost_user_send_response(struct usfstl_vhost_user_dev *dev,
  */
 void *usfstl_vhost_user_to_va(struct usfstl_vhost_user_dev *dev, uint64_t addr);
 
+/**
+ * usfstl_vhost_user_to_va_len - translate address range
+ * @dev: device to translate address for
+ * @addr: guest-side virtual addr
+ * @len: length of the range, updated to the length that is contiguous
+ *	at the returned address (i.e. up to the end of the memory region)
+ *
+ * Returns: the translated address, or %NULL if @addr isn't mapped
+ */
+void *usfstl_vhost_user_to_va_len(struct usfstl_vhost_user_dev *dev,
+				  uint64_t addr, size_t *len);
+
 /* also some IOV helpers */
 size_t iov_len(struct iovec *sg, unsigned int nsg);
 size_t iov_fill(struct iovec *sg, unsigned int nsg,
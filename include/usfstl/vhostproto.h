@@ -80,6 +80,7 @@ struct vhost_user_msg {
 #define VHOST_USER_SET_PROTOCOL_FEATURES	16
 #define VHOST_USER_SET_SLAVE_REQ_FD		21
 #define VHOST_USER_GET_CONFIG			24
+#define VHOST_USER_SET_CONFIG			25
 #define VHOST_USER_VRING_KICK			35
 
 #define VHOST_USER_SLAVE_CONFIG_CHANGE_MSG	 2
@@ -194,7 +194,7 @@ usfstl_ctrl_uds_server_init(char *name, struct usfstl_sched_ctrl *ctrl,
 
 	USFSTL_ASSERT(ctrl);
 
-	ctrl_uds = malloc(sizeof(*ctrl_uds));
+	ctrl_uds = calloc(1, sizeof(*ctrl_uds));
 	USFSTL_ASSERT(ctrl_uds);
 
 	ctrl_uds->loop_entry.handler = loop_handle_message;
@@ -221,7 +221,7 @@ usfstl_ctrl_uds_client_init(char *name, struct usfstl_sched_ctrl *ctrl,
 
 	fd = usfstl_uds_connect_raw(name);
 
-	ctrl_uds = malloc(sizeof(*ctrl_uds));
+	ctrl_uds = calloc(1, sizeof(*ctrl_uds));
 	USFSTL_ASSERT(ctrl_uds);
 
 	ctrl_uds->loop_entry.fd = fd;
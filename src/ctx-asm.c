@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Context backend switching stacks with a few lines of assembly.
+ *
+ * This works like the ucontext backend, but only saves and restores the
+ * callee-saved registers (and the floating point control words) on a
+ * switch, since the switch is an ordinary function call to the compiler.
+ * Unlike swapcontext(), it doesn't save/restore the signal mask, which
+ * would require a syscall on every switch; the mask only needs to be
+ * restored when aborting to the main context, since that might be done
+ * from a signal handler.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <usfstl/test.h>
+#include <usfstl/ctx.h>
+#include <sanitizer/asan_interface.h>
+#include <stdbool.h>
+#include "internal.h"
+
+#if !defined(__linux__) || !(defined(__x86_64__) || defined(__i386__))
+#error "The asm context backend is only supported on x86-64 and i386 Linux"
+#endif
+
+#ifndef __has_feature
+#define __has_feature(x) 0
+#endif
+
+#if !__has_feature(address_sanitizer) && !defined(__SANITIZE_ADDRESS__)
+#define __sanitizer_start_switch_fiber __noasan__sanitizer_start_switch_fiber
+#define __sanitizer_finish_switch_fiber __noasan__sanitizer_finish_switch_fiber
+static void __sanitizer_start_switch_fiber(void **fake_stack_save,
+					   const void *bottom, size_t size)
+{
+}
+static void __sanitizer_finish_switch_fiber(void *fake_stack_save,
+					    const void **bottom_old,
+					    size_t *size_old)
+{
+}
+#endif
+
+/*
+ * usfstl_ctx_asm_switch(&prev->sp, &next->sp) pushes the callee-saved registers
+ * and the control words onto the current stack, saves the stack pointer to
+ * prev->sp, and then pops the same from next->sp and returns there. The next
+ * stack pointer is only loaded after saving the current one, so that, like
+ * with swapcontext(), switching to the current context just returns.
+ *
+ * A new context's stack is set up to look like that, with the return going
+ * to usfstl_ctx_asm_start, which calls the function from the first register
+ * with the argument from the second register (see struct usfstl_ctx_asm_frame
+ * for the order).
+ */
+#if defined(__x86_64__)
+__asm__(
+	".pushsection .text\n"
+	".type usfstl_ctx_asm_switch, @function\n"
+	"usfstl_ctx_asm_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size usfstl_ctx_asm_switch, .-usfstl_ctx_asm_switch\n"
+	".type usfstl_ctx_asm_start, @function\n"
+	"usfstl_ctx_asm_start:\n"
+	"	.cfi_startproc\n"
+	"	.cfi_undefined rip\n"
+	"	movq %r14, %rdi\n"
+	"	callq *%r15\n"
+	"	ud2\n"
+	"	.cfi_endproc\n"
+	".size usfstl_ctx_asm_start, .-usfstl_ctx_asm_start\n"
+	".popsection\n"
+);
+
+#define USFSTL_CTX_ASM_REGS	6	/* r15, r14, r13, r12, rbx, rbp */
+// the stack is left 16-byte aligned for the call in usfstl_ctx_asm_start
+#define USFSTL_CTX_ASM_FRAME_END(top)	(top)
+#else
+__asm__(
+	".pushsection .text\n"
+	".type usfstl_ctx_asm_switch, @function\n"
+	"usfstl_ctx_asm_switch:\n"
+	"	movl 4(%esp), %eax\n"
+	"	movl 8(%esp), %edx\n"
+	"	pushl %ebp\n"
+	"	pushl %ebx\n"
+	"	pushl %esi\n"
+	"	pushl %edi\n"
+	"	subl $8, %esp\n"
+	"	stmxcsr (%esp)\n"
+	"	fnstcw 4(%esp)\n"
+	"	movl %esp, (%eax)\n"
+	"	movl (%edx), %esp\n"
+	"	ldmxcsr (%esp)\n"
+	"	fldcw 4(%esp)\n"
+	"	addl $8, %esp\n"
+	"	popl %edi\n"
+	"	popl %esi\n"
+	"	popl %ebx\n"
+	"	popl %ebp\n"
+	"	ret\n"
+	".size usfstl_ctx_asm_switch, .-usfstl_ctx_asm_switch\n"
+	".type usfstl_ctx_asm_start, @function\n"
+	"usfstl_ctx_asm_start:\n"
+	"	.cfi_startproc\n"
+	"	.cfi_undefined eip\n"
+	"	pushl %esi\n"
+	"	call *%edi\n"
+	"	ud2\n"
+	"	.cfi_endproc\n"
+	".size usfstl_ctx_asm_start, .-usfstl_ctx_asm_start\n"
+	".popsection\n"
+);
+
+#define USFSTL_CTX_ASM_REGS	4	/* edi, esi, ebx, ebp */
+// usfstl_ctx_asm_start pushes the argument, which then is 16-byte aligned
+#define USFSTL_CTX_ASM_FRAME_END(top)	((top) - 12)
+#endif
+
+void usfstl_ctx_asm_switch(void **prev_sp, void **next_sp);
+void usfstl_ctx_asm_start(void);
+
+struct usfstl_ctx_asm_frame {
+	uint32_t mxcsr;
+	uint16_t fpucw, pad;
+	// the first two are the function to call and its argument
+	uintptr_t regs[USFSTL_CTX_ASM_REGS];
+	void (*ret)(void);
+};
+
+static struct usfstl_ctx *g_usfstl_current_ctx;
+static struct usfstl_ctx *g_usfstl_destroy_ctx;
+static struct usfstl_ctx *g_usfstl_destroy_caller;
+static struct usfstl_ctx *g_usfstl_main_ctx;
+static sigset_t g_usfstl_main_sigmask;
+
+struct usfstl_ctx {
+	/* must be first */
+	struct usfstl_ctx_common common;
+
+	void *sp;
+	void *stack;
+	size_t stack_size;
+
+	struct {
+		const void *bottom;
+		size_t size;
+	} asan;
+};
+
+void usfstl_free_ctx_specific(struct usfstl_ctx *ctx)
+{
+	usfstl_ctx_stack_free(ctx->stack, ctx->stack_size);
+	free(ctx);
+}
+
+static void _usfstl_complete_ctx_switch(struct usfstl_ctx *ctx, void *prev_stack)
+{
+	__sanitizer_finish_switch_fiber(prev_stack,
+					&g_usfstl_current_ctx->asan.bottom,
+					&g_usfstl_current_ctx->asan.size);
+
+	g_usfstl_current_ctx = ctx;
+
+	if (g_usfstl_destroy_caller) {
+		struct usfstl_ctx *destroyer = g_usfstl_destroy_caller;
+
+		g_usfstl_destroy_caller = NULL;
+		usfstl_end_self(destroyer);
+		// doesn't return
+	}
+
+	if (g_usfstl_destroy_ctx) {
+		// free the ctx data we came from if it asked for it
+		usfstl_free_ctx(g_usfstl_destroy_ctx);
+		g_usfstl_destroy_ctx = NULL;
+	}
+}
+
+static void _usfstl_context_fn(struct usfstl_ctx *ctx)
+{
+	char dummy;
+
+	// set current ctx and stack start when we start running
+	_usfstl_complete_ctx_switch(ctx, NULL);
+
+	usfstl_set_stack_start(&dummy);
+	ctx->common.fn(ctx, ctx->common.data);
+
+	usfstl_end_self(g_usfstl_main_ctx);
+}
+
+struct usfstl_ctx *
+usfstl_ctx_create_sized(const char *name, size_t stack_size,
+			void (*fn)(struct usfstl_ctx *ctx, void *data),
+			void (*free)(struct usfstl_ctx *ctx, void *data),
+			void *data)
+{
+	struct usfstl_ctx *ctx = calloc(1, sizeof(*ctx));
+	struct usfstl_ctx_asm_frame *frame;
+	uintptr_t top;
+
+	// when creating the first ctx, save the main ctx
+	if (!g_usfstl_main_ctx) {
+		USFSTL_ASSERT(!g_usfstl_current_ctx,
+			      "unexpectedly have current context w/o main context");
+		g_usfstl_main_ctx = usfstl_current_ctx();
+	}
+
+	usfstl_ctx_common_init(ctx, name, fn, free, data);
+
+	ctx->stack = usfstl_ctx_stack_alloc(&stack_size);
+	ctx->stack_size = stack_size;
+	ctx->asan.bottom = ctx->stack;
+	ctx->asan.size = stack_size;
+
+	// build the frame that switching to the ctx will pop
+	top = ((uintptr_t)ctx->stack + stack_size) & ~(uintptr_t)15;
+	frame = (void *)(USFSTL_CTX_ASM_FRAME_END(top) - sizeof(*frame));
+	__asm__ __volatile__("stmxcsr %0" : "=m" (frame->mxcsr));
+	__asm__ __volatile__("fnstcw %0" : "=m" (frame->fpucw));
+	frame->regs[0] = (uintptr_t)_usfstl_context_fn;
+	frame->regs[1] = (uintptr_t)ctx;
+	frame->ret = usfstl_ctx_asm_start;
+	ctx->sp = frame;
+
+	return ctx;
+}
+
+static struct usfstl_ctx *usfstl_create_main_ctx(void)
+{
+	struct usfstl_ctx *ctx = calloc(1, sizeof(*ctx));
+
+	ctx->common.name = "main";
+
+	return ctx;
+}
+
+struct usfstl_ctx *usfstl_current_ctx(void)
+{
+	if (!g_usfstl_current_ctx) {
+		if (!g_usfstl_main_ctx) {
+			g_usfstl_main_ctx = usfstl_create_main_ctx();
+			sigprocmask(SIG_BLOCK, NULL, &g_usfstl_main_sigmask);
+		}
+		g_usfstl_current_ctx = g_usfstl_main_ctx;
+	}
+
+	return g_usfstl_current_ctx;
+}
+
+bool usfstl_ctx_is_main(void)
+{
+	return !g_usfstl_current_ctx || g_usfstl_main_ctx == g_usfstl_current_ctx;
+}
+
+struct usfstl_ctx *usfstl_main_ctx(void)
+{
+	return g_usfstl_main_ctx;
+}
+
+void usfstl_ctx_abort_test(void)
+{
+	// if we're in the main ctx, finish aborting directly
+	if (usfstl_ctx_is_main())
+		usfstl_complete_abort();
+	// otherwise, switch to the main ctx and finish there, with the
+	// signal mask it had (we may be aborting from a signal handler)
+	sigprocmask(SIG_SETMASK, &g_usfstl_main_sigmask, NULL);
+	usfstl_switch_ctx(g_usfstl_main_ctx);
+}
+
+void usfstl_end_ctx(struct usfstl_ctx *ctx)
+{
+	USFSTL_ASSERT_CMP(ctx, !=, g_usfstl_current_ctx,
+			  CTX_ASSERT_STR, CTX_ASSERT_VAL);
+
+	/* switch to the ctx to use usfstl_end_self() for ASAN */
+	g_usfstl_destroy_caller = usfstl_current_ctx();
+	usfstl_switch_ctx(ctx);
+}
+
+static void _usfstl_switch_ctx(struct usfstl_ctx *ctx, bool terminate)
+{
+	struct usfstl_ctx *prev = usfstl_current_ctx();
+	void *prev_stack = NULL, **prev_stack_ptr = &prev_stack;
+
+	if (terminate) {
+		g_usfstl_destroy_ctx = prev;
+		prev_stack_ptr = NULL;
+	}
+
+	__sanitizer_start_switch_fiber(prev_stack_ptr,
+				       ctx->asan.bottom,
+				       ctx->asan.size);
+
+	usfstl_ctx_asm_switch(&prev->sp, &ctx->sp);
+
+	// restore current ctx pointer and stack start before continuing to run
+	_usfstl_complete_ctx_switch(prev, prev_stack);
+
+	// if g_usfstl_test_aborted is set we're the main ctx asked to abort
+	if (g_usfstl_test_aborted)
+		usfstl_complete_abort();
+}
+
+void usfstl_end_self(struct usfstl_ctx *next)
+{
+	_usfstl_switch_ctx(next, true);
+}
+
+void usfstl_switch_ctx(struct usfstl_ctx *ctx)
+{
+	_usfstl_switch_ctx(ctx, false);
+}
+
+void usfstl_ctx_free_main(void)
+{
+	free(g_usfstl_main_ctx);
+
+	g_usfstl_main_ctx = NULL;
+	g_usfstl_destroy_ctx = NULL;
+	g_usfstl_current_ctx = NULL;
+	g_usfstl_destroy_caller = NULL;
+}
@@ -66,6 +66,16 @@ void usfstl_set_stack_start(void *p)
 	usfstl_current_ctx_common()->stack_start = p;
 }
 
+struct usfstl_ctx *usfstl_ctx_create(const char *name,
+				     void (*fn)(struct usfstl_ctx *ctx,
+						void *data),
+				     void (*free)(struct usfstl_ctx *ctx,
+						  void *data),
+				     void *data)
+{
+	return usfstl_ctx_create_sized(name, 0, fn, free, data);
+}
+
 const char *usfstl_ctx_get_name(struct usfstl_ctx *ctx)
 {
 	struct usfstl_ctx_common *common = (void *)ctx;
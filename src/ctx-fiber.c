@@ -68,10 +68,10 @@ static VOID __stdcall _usfstl_context_fn(LPVOID arg)
 }
 
 struct usfstl_ctx *
-usfstl_ctx_create(const char *name,
-		  void (*fn)(struct usfstl_ctx *ctx, void *data),
-		  void (*free)(struct usfstl_ctx *ctx, void *data),
-		  void *data)
+usfstl_ctx_create_sized(const char *name, size_t stack_size,
+			void (*fn)(struct usfstl_ctx *ctx, void *data),
+			void (*free)(struct usfstl_ctx *ctx, void *data),
+			void *data)
 {
 	struct usfstl_ctx *ctx = calloc(1, sizeof(*ctx));
 
@@ -81,7 +81,8 @@ usfstl_ctx_create(const char *name,
 		g_usfstl_main_ctx = usfstl_current_ctx();
 	}
 
-	ctx->fiber = CreateFiber(1024 * 128, _usfstl_context_fn, ctx);
+	ctx->fiber = CreateFiber(stack_size ?: USFSTL_CTX_DEFAULT_STACK_SIZE,
+				 _usfstl_context_fn, ctx);
 	assert(ctx->fiber);
 	usfstl_ctx_common_init(ctx, name, fn, free, data);
 
@@ -7,6 +7,7 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <errno.h>
+#include <limits.h>
 #include <usfstl/ctx.h>
 #include <usfstl/test.h>
 #include "internal.h"
@@ -50,12 +51,13 @@ static void *_usfstl_thread_fn(void *_ctx)
 }
 
 struct usfstl_ctx *
-usfstl_ctx_create(const char *name,
-		  void (*fn)(struct usfstl_ctx *ctx, void *data),
-		  void (*free)(struct usfstl_ctx *ctx, void *data),
-		  void *data)
+usfstl_ctx_create_sized(const char *name, size_t stack_size,
+			void (*fn)(struct usfstl_ctx *ctx, void *data),
+			void (*free)(struct usfstl_ctx *ctx, void *data),
+			void *data)
 {
 	struct usfstl_ctx *ctx = calloc(1, sizeof(*ctx));
+	pthread_attr_t attr;
 
 	// save main ctx on creating any new ones
 	if (!g_usfstl_main_ctx) {
@@ -67,8 +69,16 @@ usfstl_ctx_create(const char *name,
 	USFSTL_ASSERT(sem_init(&ctx->sem, 0, 0) == 0,
 		      "sem_init() failed, errno = %d", errno);
 
-	USFSTL_ASSERT_EQ(pthread_create(&ctx->thread, NULL, _usfstl_thread_fn, ctx),
+	USFSTL_ASSERT_EQ(pthread_attr_init(&attr), 0, "%d");
+	if (stack_size) {
+		if (stack_size < (size_t)PTHREAD_STACK_MIN)
+			stack_size = PTHREAD_STACK_MIN;
+		USFSTL_ASSERT_EQ(pthread_attr_setstacksize(&attr, stack_size),
+				 0, "%d");
+	}
+	USFSTL_ASSERT_EQ(pthread_create(&ctx->thread, &attr, _usfstl_thread_fn, ctx),
 			 0, "%d");
+	pthread_attr_destroy(&attr);
 
 	pthread_setname_np(ctx->thread, name);
 
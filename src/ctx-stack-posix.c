@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Stack allocation for the context backends that switch stacks themselves.
+ *
+ * Stacks are mapped with a guard page below them, so overflowing one crashes
+ * instead of silently corrupting other memory, and the kernel only commits
+ * the pages that are actually used. A freed stack isn't unmapped but kept in
+ * a pool, and reused for the next context created with the same size, also
+ * in later tests, so creating contexts in every test stays cheap. The pool
+ * thus never holds more stacks than were in use at the same time.
+ */
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sanitizer/asan_interface.h>
+#include <usfstl/test.h>
+#include "internal.h"
+
+/* kept at the top of a free stack */
+struct usfstl_ctx_stack {
+	struct usfstl_ctx_stack *next;
+	size_t size;
+};
+
+static struct usfstl_ctx_stack *USFSTL_NORESTORE_VAR(g_usfstl_ctx_stack_pool);
+
+void *usfstl_ctx_stack_alloc(size_t *size)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	struct usfstl_ctx_stack *entry, **pprev;
+	uint8_t *map;
+
+	if (!*size)
+		*size = USFSTL_CTX_DEFAULT_STACK_SIZE;
+	*size = (*size + page_size - 1) & ~(page_size - 1);
+
+	for (pprev = &g_usfstl_ctx_stack_pool, entry = *pprev;
+	     entry;
+	     pprev = &entry->next, entry = entry->next) {
+		if (entry->size != *size)
+			continue;
+
+		*pprev = entry->next;
+		return (uint8_t *)entry + sizeof(*entry) - *size;
+	}
+
+	map = mmap(NULL, *size + page_size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+		   -1, 0);
+	USFSTL_ASSERT(map != MAP_FAILED,
+		      "failed to map %zu bytes of stack, errno %d", *size, errno);
+	USFSTL_ASSERT_EQ(mprotect(map, page_size, PROT_NONE), 0, "%d");
+
+	return map + page_size;
+}
+
+void usfstl_ctx_stack_free(void *stack, size_t size)
+{
+	struct usfstl_ctx_stack *entry;
+
+	/*
+	 * The context using the stack may have been ended in the middle
+	 * of a function, leaving its frames poisoned.
+	 */
+	ASAN_UNPOISON_MEMORY_REGION(stack, size);
+
+	entry = (void *)((uint8_t *)stack + size - sizeof(*entry));
+	entry->size = size;
+	entry->next = g_usfstl_ctx_stack_pool;
+	g_usfstl_ctx_stack_pool = entry;
+}
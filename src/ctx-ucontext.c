@@ -48,7 +48,8 @@ struct usfstl_ctx {
 
 void usfstl_free_ctx_specific(struct usfstl_ctx *ctx)
 {
-	free(ctx->ctx.uc_stack.ss_sp);
+	usfstl_ctx_stack_free(ctx->ctx.uc_stack.ss_sp,
+			      ctx->ctx.uc_stack.ss_size);
 	free(ctx);
 }
 
@@ -89,10 +90,10 @@ static void _usfstl_context_fn(struct usfstl_ctx *ctx)
 }
 
 struct usfstl_ctx *
-usfstl_ctx_create(const char *name,
-		  void (*fn)(struct usfstl_ctx *ctx, void *data),
-		  void (*free)(struct usfstl_ctx *ctx, void *data),
-		  void *data)
+usfstl_ctx_create_sized(const char *name, size_t stack_size,
+			void (*fn)(struct usfstl_ctx *ctx, void *data),
+			void (*free)(struct usfstl_ctx *ctx, void *data),
+			void *data)
 {
 	struct usfstl_ctx *ctx = calloc(1, sizeof(*ctx));
 
@@ -107,9 +108,8 @@ usfstl_ctx_create(const char *name,
 
 	usfstl_ctx_common_init(ctx, name, fn, free, data);
 
-	ctx->ctx.uc_stack.ss_size = 1024 * 128;
-	ctx->ctx.uc_stack.ss_sp = calloc(1, ctx->ctx.uc_stack.ss_size);
-	USFSTL_ASSERT(ctx->ctx.uc_stack.ss_sp);
+	ctx->ctx.uc_stack.ss_sp = usfstl_ctx_stack_alloc(&stack_size);
+	ctx->ctx.uc_stack.ss_size = stack_size;
 	ctx->asan.bottom = ctx->ctx.uc_stack.ss_sp;
 	ctx->asan.size = ctx->ctx.uc_stack.ss_size;
 
@@ -88,6 +88,7 @@ void usfstl_watchdog_stop(void);
 void usfstl_save_globals(const char *program);
 void usfstl_restore_globals(void);
 void usfstl_free_globals(void);
+void usfstl_restore_exclude(const void *ptr, size_t size);
 
 /* test selection */
 extern bool g_usfstl_skip_known_failing;
@@ -115,6 +116,11 @@ void usfstl_ctx_free_main(void);
 
 void usfstl_ctx_abort_test(void);
 
+#define USFSTL_CTX_DEFAULT_STACK_SIZE	(1024 * 128)
+/* pooled stacks with guard page, for backends switching stacks themselves */
+void *usfstl_ctx_stack_alloc(size_t *size);
+void usfstl_ctx_stack_free(void *stack, size_t size);
+
 #define CTX_ASSERT_STR		"%p (%s)"
 #define CTX_ASSERT_VAL(c)	(c), (c) ? usfstl_ctx_get_name(c) : "?"
 
@@ -139,6 +145,7 @@ struct read_vector {
 #define USFSTL_MAX_RPC_STACK	20
 extern struct usfstl_rpc_connection *g_usfstl_rpc_stack[USFSTL_MAX_RPC_STACK];
 extern unsigned int g_usfstl_rpc_stack_num;
+void usfstl_rpc_abort_oneway_calls(void);
 
 void rpc_write(usfstl_fd_t fd, const void *buf, size_t bufsize);
 void rpc_read(usfstl_fd_t fd, void *buf, size_t nbyte);
@@ -147,6 +154,23 @@ void rpc_readv(usfstl_fd_t fd, unsigned int n, const struct read_vector *vectors
 
 void usfstl_rpc_del_connection_raw(struct usfstl_rpc_connection *conn);
 
+void rpc_shm_connect(struct usfstl_rpc_connection *conn);
+void rpc_shm_accept(struct usfstl_rpc_connection *conn);
+void rpc_shm_free(struct usfstl_rpc_connection *conn);
+bool rpc_shm_pending(struct usfstl_rpc_connection *conn);
+void rpc_shm_wait_msg(struct usfstl_rpc_connection *conn);
+void rpc_shm_read(struct usfstl_rpc_connection *conn, void *buf, size_t len);
+void rpc_shm_readv(struct usfstl_rpc_connection *conn, unsigned int n,
+		   const struct read_vector *vectors);
+void rpc_shm_writev(struct usfstl_rpc_connection *conn, unsigned int n,
+		    const struct write_vector *vectors);
+void *rpc_shm_bulk_alloc(struct usfstl_rpc_connection *conn, uint32_t size,
+			 uint32_t *offset);
+uint32_t rpc_shm_bulk_mark(struct usfstl_rpc_connection *conn);
+void rpc_shm_bulk_release(struct usfstl_rpc_connection *conn, uint32_t mark);
+void *rpc_shm_bulk_peer(struct usfstl_rpc_connection *conn, uint32_t offset,
+			uint32_t size);
+
 /* multi-process testing */
 extern struct usfstl_multi_participant *__start_usfstl_rpcp[];
 extern struct usfstl_multi_participant *__stop_usfstl_rpcp[];
@@ -166,17 +190,19 @@ void usfstl_multi_start_test_controller(void);
 void usfstl_multi_start_test_participant(void);
 void usfstl_multi_end_test(enum usfstl_testcase_status status);
 void usfstl_multi_end_test_controller(enum usfstl_testcase_status status);
-void usfstl_multi_end_test_participant(void);
 
 void usfstl_multi_controller_init(void);
 void
 usfstl_multi_controller_update_sync_time(struct usfstl_multi_participant *update);
 void usfstl_multi_controller_print_participants(int indent);
+struct usfstl_multi_participant *
+usfstl_multi_controller_parallel_participant(struct usfstl_rpc_connection *conn);
 int usfstl_multi_participant_run(void);
 
 extern struct usfstl_rpc_connection *g_usfstl_multi_ctrl_conn;
 extern bool g_usfstl_multi_test_participant;
 extern bool g_usfstl_multi_test_controller;
+extern int g_usfstl_multi_rpc_shm, g_usfstl_multi_rpc_shm_bulk;
 
 static inline bool usfstl_is_multi_controller(void)
 {
@@ -194,17 +220,41 @@ extern struct usfstl_shared_mem_section *__stop_usfstl_shms[];
 
 extern struct usfstl_sched_req_and_wait_msg *g_usfstl_sched_req_and_wait_msg;
 extern bool g_usfstl_shared_mem_dirty;
+extern uint32_t g_usfstl_shared_mem_parent_gen;
 
 #define for_each_shared_mem_section(s, i)				\
 	for (i = 0; &__start_usfstl_shms[i] < __stop_usfstl_shms; i++)	\
 		if ((s = __start_usfstl_shms[i]))
 
 struct usfstl_shared_mem_msg;
-unsigned int usfstl_shared_mem_get_msg_size(bool is_participant_outdated);
+unsigned int usfstl_shared_mem_get_msg_size(uint32_t *seen_gen,
+					    bool is_participant_outdated,
+					    bool to_parent);
 void usfstl_shared_mem_handle_msg(const struct usfstl_shared_mem_msg *msg,
-				  unsigned int msg_size, bool do_not_mark_dirty);
+				  unsigned int msg_size, uint32_t *sender_gen,
+				  bool from_parent, bool parallel);
+struct usfstl_shared_mem_ids_msg;
+void usfstl_shared_mem_init_participant(struct usfstl_multi_participant *p);
+void usfstl_shared_mem_handle_ids(const struct usfstl_shared_mem_ids_msg *msg,
+				  unsigned int msg_size);
 void usfstl_shared_mem_update_local_view(void);
 void usfstl_shared_mem_prepare_msg(void);
+void usfstl_shared_mem_start_parallel(void);
+void usfstl_shared_mem_end_parallel(void);
+bool usfstl_shared_mem_any_mapped(void);
+
+/* shared memory sections mapped between participants */
+extern bool g_usfstl_multi_shared_mem_map;
+struct usfstl_shared_mem_map_msg;
+void usfstl_shared_mem_map_init(void);
+void usfstl_shared_mem_handle_map(const struct usfstl_shared_mem_map_msg *msg,
+				  unsigned int msg_size);
+uint32_t usfstl_shared_mem_map_pid(void);
+int usfstl_shared_mem_map_create(const char *name, void *addr,
+				 unsigned int size);
+int usfstl_shared_mem_map_open(uint32_t pid, int fd, void *addr,
+			       unsigned int size);
+void usfstl_shared_mem_map_close(int fd);
 
 extern char *g_usfstl_assert_coverage_file;
 void usfstl_log_reached_asserts(void);
@@ -47,25 +47,37 @@ void usfstl_loop_unregister(struct usfstl_loop_entry *entry)
 
 void usfstl_loop_wait_and_handle(void)
 {
-	struct usfstl_loop_entry *tmp;
+	struct usfstl_loop_entry *tmp, *pending = NULL;
+	struct timeval timeout = {};
 	fd_set rd_set;
-	unsigned int max = 0, num;
+	unsigned int max = 0, num, nfds = 0;
 
 	FD_ZERO(&rd_set);
 
 	usfstl_loop_for_each_entry(tmp) {
+		if (tmp->pending && tmp->pending(tmp)) {
+			pending = tmp;
+			break;
+		}
+
 		FD_SET(tmp->fd, &rd_set);
 		if ((unsigned int)tmp->fd > max)
 			max = tmp->fd;
+		nfds++;
 	}
 
-	num = select(max + 1, &rd_set, NULL, NULL, NULL);
-	assert(num > 0);
+	// with something pending, only check if any higher priority fd is ready
+	if (!pending) {
+		num = select(max + 1, &rd_set, NULL, NULL, NULL);
+		assert(num > 0);
+	} else if (nfds && select(max + 1, &rd_set, NULL, NULL, &timeout) <= 0) {
+		FD_ZERO(&rd_set);
+	}
 
 	usfstl_loop_for_each_entry(tmp) {
 		void *data = g_usfstl_loop_pre_handler_fn_data;
 
-		if (!FD_ISSET(tmp->fd, &rd_set))
+		if (tmp != pending && !FD_ISSET(tmp->fd, &rd_set))
 			continue;
 
 		if (g_usfstl_loop_pre_handler_fn)
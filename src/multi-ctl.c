@@ -31,8 +31,25 @@ static bool g_usfstl_debug_subprocesses;
 USFSTL_OPT_FLAG("multi-debug-subprocs", 0, g_usfstl_debug_subprocesses,
 		"Break into a debugger once all sub-processes are started");
 
+int g_usfstl_multi_rpc_shm, g_usfstl_multi_rpc_shm_bulk;
+USFSTL_OPT_INT("multi-rpc-shm", 0, "size", g_usfstl_multi_rpc_shm,
+	       "Exchange RPC data with started participants through shared memory rings of this size");
+USFSTL_OPT_INT("multi-rpc-shm-bulk", 0, "size", g_usfstl_multi_rpc_shm_bulk,
+	       "With --multi-rpc-shm, pass large RPC data in place through a shared area of this size");
+
+bool USFSTL_NORESTORE_VAR(g_usfstl_multi_shared_mem_map);
+USFSTL_OPT_FLAG("multi-shared-mem-map", 0, g_usfstl_multi_shared_mem_map,
+		"Map the full pages of shared memory sections shared with all participants instead of copying them");
+
 bool USFSTL_NORESTORE_VAR(g_usfstl_multi_ctrl_disable_sync);
 
+static bool g_usfstl_multi_sequential;
+USFSTL_OPT_FLAG("multi-sequential", 0, g_usfstl_multi_sequential,
+		"Run only one participant at a time, even if they declared a lookahead");
+
+// indicates that participants are running in parallel
+static bool g_usfstl_multi_parallel;
+
 /* variables for controller */
 // make the section exist even in non-multi builds
 static const struct usfstl_multi_participant * const usfstl_multi_participant_NULL
@@ -45,21 +62,28 @@ struct usfstl_multi_participant g_usfstl_multi_local_participant = {
 static struct usfstl_multi_participant *g_usfstl_multi_running_participant =
 	&g_usfstl_multi_local_participant;
 
-static void usfstl_multi_ctl_start_participant(struct usfstl_multi_participant *p)
+static void usfstl_multi_ctl_run_participant(struct usfstl_multi_participant *p)
 {
 	int nargs = 0;
 
 	if (p->pre_connected)
-		goto setup;
+		return;
 
 	while (p->args && p->args[nargs])
 		nargs++;
 
 	usfstl_run_participant(p, nargs);
-setup:
+	p->conn->shm_size = g_usfstl_multi_rpc_shm;
+	p->conn->shm_bulk_size = g_usfstl_multi_rpc_shm_bulk;
+}
+
+static void usfstl_multi_ctl_start_participant(struct usfstl_multi_participant *p)
+{
 	p->conn->data = p;
 	p->conn->name = p->name;
 	usfstl_multi_add_rpc_connection(p->conn);
+
+	usfstl_shared_mem_init_participant(p);
 }
 
 void usfstl_multi_controller_print_participants(int indent)
@@ -81,6 +105,14 @@ void usfstl_multi_controller_init(void)
 
 	g_usfstl_multi_test_controller = true;
 
+	if (g_usfstl_multi_shared_mem_map)
+		usfstl_shared_mem_map_init();
+
+	// Run all the participants first so they start up in parallel,
+	// connecting to each then only waits for the slowest one.
+	for_each_participant(p, i)
+		usfstl_multi_ctl_run_participant(p);
+
 	for_each_participant(p, i)
 		usfstl_multi_ctl_start_participant(p);
 
@@ -108,6 +140,10 @@ usfstl_multi_controller_update_sync_time(struct usfstl_multi_participant *update
 	if (g_usfstl_multi_ctrl_disable_sync)
 		return;
 
+	// participants running in parallel all have the same sync time
+	if (g_usfstl_multi_parallel)
+		return;
+
 	sync = usfstl_sched_get_sync_time(&g_usfstl_multi_sched);
 
 	if (!update)
@@ -147,31 +183,63 @@ void usfstl_multi_start_test_controller(void)
 	msg.hdr.flow_test = g_usfstl_current_test->flow_test;
 	msg.hdr.max_cpu_time_ms = g_usfstl_current_test->max_cpu_time_ms;
 
-	for_each_participant(p, i) {
+	// The test start is a one-way call, so all participants set up the
+	// test (including restoring their state) in parallel before we wait
+	// for them; it's pipelined behind the previous test's end if they're
+	// still busy with that.
+	for_each_participant(p, i)
 		multi_rpc_test_start_conn(p->conn, &msg.hdr,
 					  sizeof(msg.hdr) + strlen(msg.name));
+
+	for_each_participant(p, i)
 		usfstl_multi_ctl_wait(p);
-	}
 
 	g_usfstl_multi_sched.next_time_changed =
 		usfstl_multi_ctrl_next_time_changed;
 }
 
+static void usfstl_multi_ctl_parallel_done(void)
+{
+	struct usfstl_multi_participant *p;
+	int i;
+
+	for_each_participant(p, i)
+		p->flags &= ~USFSTL_MULTI_PARTICIPANT_PARALLEL;
+	g_usfstl_multi_parallel = false;
+}
+
 void usfstl_multi_end_test_controller(enum usfstl_testcase_status status)
 {
 	struct usfstl_multi_participant *p;
 	int i;
 
+	// If the test ended while participants were running in parallel,
+	// those still running must first get to a point where they wait,
+	// otherwise they'd end the test with their RPC call outstanding.
+	for_each_participant(p, i) {
+		if (p == g_usfstl_test_fail_initiator ||
+		    !(p->flags & USFSTL_MULTI_PARTICIPANT_PARALLEL))
+			continue;
+		usfstl_multi_ctl_wait(p);
+	}
+
+	// the test end is also a one-way call, send it right away so the
+	// participants end the test while we do the same
 	for_each_participant(p, i) {
 		if (p == g_usfstl_test_fail_initiator)
 			continue;
 		multi_rpc_test_end_conn(p->conn, status);
 	}
+	usfstl_rpc_flush();
 
 	if (g_usfstl_test_fail_initiator) {
 		usfstl_rpc_send_void_response(g_usfstl_test_fail_initiator->conn);
 		g_usfstl_test_fail_initiator = NULL;
 	}
+
+	// only now, so the messages above carried their own time
+	if (g_usfstl_multi_parallel)
+		usfstl_multi_ctl_parallel_done();
 }
 
 void usfstl_multi_finish(void)
@@ -180,16 +248,171 @@ void usfstl_multi_finish(void)
 	int i;
 
 	for_each_participant(p, i) {
-		usfstl_rpc_del_connection_raw(p->conn);
+		// the connection (and its shared memory, if any) is still
+		// needed for the exit call, but remove it before the next
+		// one so we don't see the participant going away
 		multi_rpc_exit_conn(p->conn, 0);
+		usfstl_rpc_del_connection_raw(p->conn);
 	}
 }
 
+static void usfstl_multi_controller_sched_callback(struct usfstl_job *job);
+
+static struct usfstl_multi_participant *
+usfstl_multi_ctl_job_participant(struct usfstl_job *job)
+{
+	if (job->callback != usfstl_multi_controller_sched_callback)
+		return NULL;
+	return job->data;
+}
+
+struct usfstl_multi_participant *
+usfstl_multi_controller_parallel_participant(struct usfstl_rpc_connection *conn)
+{
+	struct usfstl_multi_participant *p;
+	int i;
+
+	if (!g_usfstl_multi_parallel)
+		return NULL;
+
+	for_each_participant(p, i) {
+		if (p->conn == conn &&
+		    p->flags & USFSTL_MULTI_PARTICIPANT_PARALLEL)
+			return p;
+	}
+
+	return NULL;
+}
+
+/*
+ * Nothing that happens at or after the horizon can affect anyone before it:
+ * it's the earliest time at which any pending job plus the lookahead of its
+ * participant (zero if none, e.g. for our own tasks) could have an effect.
+ */
+static uint64_t usfstl_multi_ctl_horizon(struct usfstl_multi_participant *p)
+{
+	struct usfstl_scheduler *sched = &g_usfstl_multi_sched;
+	uint64_t time = usfstl_sched_current_time(sched);
+	uint64_t horizon = time + p->lookahead;
+	struct usfstl_job *job;
+
+	// and we can't run past what our own controller (if any) allows
+	if (sched->next_external_sync_set &&
+	    usfstl_time_cmp(sched->next_external_sync, <, horizon) &&
+	    usfstl_time_cmp(sched->next_external_sync, >=, time))
+		horizon = sched->next_external_sync;
+
+	usfstl_for_each_list_item(job, &sched->joblist, entry) {
+		struct usfstl_multi_participant *q;
+		uint64_t end;
+
+		// jobs are sorted, the remaining ones can't be earlier
+		if (!usfstl_time_cmp(job->start, <, horizon))
+			break;
+
+		q = usfstl_multi_ctl_job_participant(job);
+		end = job->start + (q ? q->lookahead : 0);
+		if (usfstl_time_cmp(end, <, horizon))
+			horizon = end;
+	}
+
+	return horizon;
+}
+
+static void usfstl_multi_ctl_continue(struct usfstl_multi_participant *p)
+{
+	unsigned int shared_mem_size;
+
+	p->flags &= ~USFSTL_MULTI_PARTICIPANT_WAITING;
+
+	// send the updated view of the shared memory (include only what
+	// changed since the participant last saw it)
+	shared_mem_size = usfstl_shared_mem_get_msg_size(&p->shared_mem_gen,
+							 p->flags &
+							 USFSTL_MULTI_PARTICIPANT_SHARED_MEM_OUTDATED,
+							 false);
+	// before the call, since participants already running in parallel
+	// may send changes (making this one outdated again) while it's made
+	p->flags &= ~USFSTL_MULTI_PARTICIPANT_SHARED_MEM_OUTDATED;
+	multi_rpc_sched_cont_conn(p->conn, &g_usfstl_sched_req_and_wait_msg->shared_mem,
+				  shared_mem_size);
+}
+
+static void usfstl_multi_ctl_start_parallel(struct usfstl_multi_participant *p,
+					    uint64_t time, uint64_t horizon)
+{
+	p->flags |= USFSTL_MULTI_PARTICIPANT_PARALLEL;
+	// RPC with it now carries its own time rather than ours
+	p->parallel_time = time;
+
+	multi_rpc_sched_set_sync_conn(p->conn, horizon);
+	p->sync_set = 1;
+	p->sync = horizon;
+
+	usfstl_multi_ctl_continue(p);
+}
+
+/*
+ * Run the participant along with all others that have jobs before the
+ * horizon, in parallel; return false (having done nothing) if there's
+ * no other participant to run.
+ */
+static bool usfstl_multi_ctl_run_parallel(struct usfstl_multi_participant *p)
+{
+	struct usfstl_scheduler *sched = &g_usfstl_multi_sched;
+	uint64_t horizon = usfstl_multi_ctl_horizon(p);
+	struct usfstl_multi_participant *q;
+	struct usfstl_job *job, *next;
+	int i;
+
+	job = usfstl_sched_next_pending(sched, NULL);
+	if (!job || !usfstl_time_cmp(job->start, <, horizon))
+		return false;
+
+	g_usfstl_multi_parallel = true;
+
+	// save the local view of the shared memory before waiting, all of
+	// the participants start out from that
+	usfstl_shared_mem_prepare_msg();
+	usfstl_shared_mem_start_parallel();
+
+	usfstl_multi_ctl_start_parallel(p, usfstl_sched_current_time(sched),
+					horizon);
+
+	// a job owned by anything other than a participant with a lookahead
+	// can't start before the horizon, see usfstl_multi_ctl_horizon()
+	usfstl_for_each_list_item_safe(job, next, &sched->joblist, entry) {
+		if (!usfstl_time_cmp(job->start, <, horizon))
+			break;
+
+		q = usfstl_multi_ctl_job_participant(job);
+		usfstl_sched_del_job(job);
+		usfstl_multi_ctl_start_parallel(q, job->start, horizon);
+	}
+
+	for_each_participant(q, i) {
+		if (q->flags & USFSTL_MULTI_PARTICIPANT_PARALLEL)
+			usfstl_multi_ctl_wait(q);
+	}
+
+	// still parallel if this fails, so the test end carries their time
+	usfstl_shared_mem_end_parallel();
+	usfstl_multi_ctl_parallel_done();
+
+	// refresh the local view of the shared memory before continuing
+	usfstl_shared_mem_update_local_view();
+
+	return true;
+}
+
 static void usfstl_multi_controller_sched_callback(struct usfstl_job *job)
 {
 	struct usfstl_multi_participant *p = job->data;
 
-	p->flags &= ~USFSTL_MULTI_PARTICIPANT_WAITING;
+	if (p->lookahead && !g_usfstl_multi_sequential &&
+	    !usfstl_shared_mem_any_mapped() &&
+	    usfstl_multi_ctl_run_parallel(p))
+		return;
 
 	// We're letting this participant run, so update its idea
 	// of how long it's allowed to run.
@@ -198,13 +421,7 @@ static void usfstl_multi_controller_sched_callback(struct usfstl_job *job)
 	// save the local view of the shared memory before waiting
 	usfstl_shared_mem_prepare_msg();
 
-	// send the updated view of the shared memory (include the buffer
-	// only if it has changed)
-	multi_rpc_sched_cont_conn(p->conn, &g_usfstl_sched_req_and_wait_msg->shared_mem,
-				  usfstl_shared_mem_get_msg_size(
-					p->flags &
-					USFSTL_MULTI_PARTICIPANT_SHARED_MEM_OUTDATED));
-	p->flags &= ~USFSTL_MULTI_PARTICIPANT_SHARED_MEM_OUTDATED;
+	usfstl_multi_ctl_continue(p);
 
 	usfstl_multi_ctl_wait(p);
 
@@ -236,7 +453,8 @@ USFSTL_RPC_METHOD_VAR(uint32_t /* dummy */,
 {
 	struct usfstl_multi_participant *p = conn->data;
 
-	usfstl_shared_mem_handle_msg(in, insize, false);
+	usfstl_shared_mem_handle_msg(in, insize, &p->shared_mem_gen, false,
+				     p->flags & USFSTL_MULTI_PARTICIPANT_PARALLEL);
 	usfstl_shared_mem_update_local_view();
 
 	// set the flag after handling the shared mem msg, so the handler
@@ -258,11 +476,16 @@ USFSTL_RPC_METHOD_VAR(uint32_t /* dummy */,
 
 USFSTL_RPC_VOID_METHOD(multi_rpc_test_failed, uint32_t /* status */)
 {
-	if (g_usfstl_test_aborted)
+	struct usfstl_multi_participant *p = conn->data;
+
+	if (g_usfstl_test_aborted) {
+		// it's done now, in case it was running in parallel
+		p->flags |= USFSTL_MULTI_PARTICIPANT_WAITING;
 		return;
+	}
 
 	g_usfstl_failure_reason = in;
 	g_usfstl_test_aborted = true;
-	g_usfstl_test_fail_initiator = conn->data;
+	g_usfstl_test_fail_initiator = p;
 	usfstl_ctx_abort_test();
 }
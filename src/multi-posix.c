@@ -6,8 +6,12 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <usfstl/multi.h>
+#include <usfstl/sharedmem.h>
 #include "internal.h"
 
 /* participant side */
@@ -47,29 +51,49 @@ void usfstl_run_participant(struct usfstl_multi_participant *p, int nargs)
 	p->conn->conn.fd = fds[0];
 
 	if ((pid = fork()) == 0) {
-		const char *_args[nargs + 6];
-		char buf[100], namebuf[20 + strlen(p->name)];
+		const char *_args[nargs + 8];
+		char buf[100], shmbuf[40], shmbulkbuf[40];
+		char namebuf[21 + strlen(g_usfstl_multi_local_participant.name) +
+			     strlen(p->name)];
 		char ctlnamebuf[19 + strlen(g_usfstl_multi_local_participant.name)];
-		int i;
+		int i, n = 0;
+
+		_args[n++] = p->binary;
+
+		/*
+		 * The participant may be a (sub-)controller itself, so pass
+		 * on the RPC transport options for it to use with its own
+		 * participants; any given in its args override these.
+		 */
+		if (g_usfstl_multi_rpc_shm) {
+			sprintf(shmbuf, "--multi-rpc-shm=%d", g_usfstl_multi_rpc_shm);
+			_args[n++] = shmbuf;
+		}
+		if (g_usfstl_multi_rpc_shm_bulk) {
+			sprintf(shmbulkbuf, "--multi-rpc-shm-bulk=%d",
+				g_usfstl_multi_rpc_shm_bulk);
+			_args[n++] = shmbulkbuf;
+		}
 
-		_args[0] = p->binary;
 		for (i = 0; i < nargs; i++)
-			_args[i + 1] = p->args[i];
+			_args[n++] = p->args[i];
 
 		close(fds[0]);
 		sprintf(buf, "--control=fd:%d", fds[1]);
-		_args[nargs + 1] = buf;
-		sprintf(namebuf, "--multi-ptc-name=%s", p->name);
-		_args[nargs + 2] = namebuf;
+		_args[n++] = buf;
+		// name nested participants by their path from the top
+		if (usfstl_is_multi_participant())
+			sprintf(namebuf, "--multi-ptc-name=%s/%s",
+				g_usfstl_multi_local_participant.name, p->name);
+		else
+			sprintf(namebuf, "--multi-ptc-name=%s", p->name);
+		_args[n++] = namebuf;
 		sprintf(ctlnamebuf, "--multi-ptc-ctl=%s",
 			g_usfstl_multi_local_participant.name);
-		_args[nargs + 3] = ctlnamebuf;
-		if (g_usfstl_sched_disable_skip_external_request) {
-			_args[nargs + 4] = "--sched-disable-skip-external-request";
-			_args[nargs + 5] = NULL;
-		} else {
-			_args[nargs + 4] = NULL;
-		}
+		_args[n++] = ctlnamebuf;
+		if (g_usfstl_sched_disable_skip_external_request)
+			_args[n++] = "--sched-disable-skip-external-request";
+		_args[n] = NULL;
 		execv(p->binary, (char * const *)_args);
 		assert(0);
 	}
@@ -77,3 +101,63 @@ void usfstl_run_participant(struct usfstl_multi_participant *p, int nargs)
 	p->pid = pid;
 	close(fds[1]);
 }
+
+/* shared memory sections mapped between participants */
+uint32_t usfstl_shared_mem_map_pid(void)
+{
+	return getpid();
+}
+
+static void usfstl_shared_mem_map_fixed(int fd, void *addr, unsigned int size)
+{
+	void *ret;
+
+	USFSTL_ASSERT_EQ(sysconf(_SC_PAGESIZE),
+			 (long)USFSTL_SHARED_MEM_PAGE_SIZE, "%ld");
+
+	ret = mmap(addr, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_FIXED, fd, 0);
+	USFSTL_ASSERT(ret == addr, "failed to map shared memory at %p", addr);
+}
+
+int usfstl_shared_mem_map_create(const char *name, void *addr,
+				 unsigned int size)
+{
+	int fd = memfd_create(name, MFD_CLOEXEC);
+	ssize_t written;
+	int ret;
+
+	USFSTL_ASSERT(fd >= 0, "failed to create memfd for section '%s'", name);
+
+	ret = ftruncate(fd, size);
+	USFSTL_ASSERT_EQ(ret, 0, "%d");
+
+	// carry over the current contents
+	written = pwrite(fd, addr, size, 0);
+	USFSTL_ASSERT_EQ(written, (ssize_t)size, "%zd");
+
+	usfstl_shared_mem_map_fixed(fd, addr, size);
+
+	return fd;
+}
+
+int usfstl_shared_mem_map_open(uint32_t pid, int fd, void *addr,
+			       unsigned int size)
+{
+	char path[40];
+	int ret;
+
+	// we're on the same host, so just open it through the sender's fd
+	sprintf(path, "/proc/%u/fd/%d", pid, fd);
+	ret = open(path, O_RDWR | O_CLOEXEC);
+	USFSTL_ASSERT(ret >= 0, "failed to open %s", path);
+
+	usfstl_shared_mem_map_fixed(ret, addr, size);
+
+	return ret;
+}
+
+void usfstl_shared_mem_map_close(int fd)
+{
+	close(fd);
+}
@@ -21,7 +21,6 @@
 // variables for participant
 struct usfstl_test USFSTL_NORESTORE_VAR(g_usfstl_multi_controlled_test);
 static bool g_usfstl_multi_test_sched_continue;
-static bool USFSTL_NORESTORE_VAR(g_usfstl_ptc_must_send_test_end_response);
 static bool g_usfstl_multi_ptc_remote_abort;
 static struct {
 	// time value of a sent/pending sched request
@@ -81,16 +80,21 @@ usfstl_multi_sched_ext_req(struct usfstl_scheduler *sched, uint64_t at)
 
 static void usfstl_multi_sched_ext_wait_participant(struct usfstl_scheduler *sched)
 {
+	unsigned int shared_mem_size;
+
 	g_usfstl_multi_test_sched_continue = false;
 
 	// save the local view of the shared memory before waiting
 	usfstl_shared_mem_prepare_msg();
 
-	// send the updated view of the shared memory (include the buffer
-	// only if it has changed)
+	// send the updated view of the shared memory (include only what
+	// changed since the controller last saw it)
+	shared_mem_size = usfstl_shared_mem_get_msg_size(&g_usfstl_shared_mem_parent_gen,
+							 g_usfstl_shared_mem_dirty,
+							 true);
 	if (g_usfstl_multi_sched_req.pending) {
 		// optimization: also send the pending sched request in a combined message
-		uint32_t msg_size = usfstl_shared_mem_get_msg_size(g_usfstl_shared_mem_dirty) +
+		uint32_t msg_size = shared_mem_size +
 				    offsetof(typeof(*g_usfstl_sched_req_and_wait_msg), shared_mem);
 
 		g_usfstl_multi_sched_req.pending = false;
@@ -101,8 +105,7 @@ static void usfstl_multi_sched_ext_wait_participant(struct usfstl_scheduler *sch
 	} else {
 		multi_rpc_sched_wait_conn(g_usfstl_multi_ctrl_conn,
 					  &g_usfstl_sched_req_and_wait_msg->shared_mem,
-					  usfstl_shared_mem_get_msg_size(
-						g_usfstl_shared_mem_dirty));
+					  shared_mem_size);
 	}
 	g_usfstl_multi_sched_req.time_valid = false;
 	g_usfstl_shared_mem_dirty = false;
@@ -122,14 +125,6 @@ void usfstl_multi_start_test_participant(void)
 		usfstl_multi_sched_ext_wait_participant;
 }
 
-void usfstl_multi_end_test_participant(void)
-{
-	if (g_usfstl_ptc_must_send_test_end_response) {
-		g_usfstl_ptc_must_send_test_end_response = false;
-		usfstl_rpc_send_void_response(g_usfstl_multi_ctrl_conn);
-	}
-}
-
 int usfstl_multi_participant_run(void)
 {
 	usfstl_multi_add_rpc_connection(g_usfstl_multi_ctrl_conn);
@@ -182,9 +177,7 @@ int usfstl_multi_participant_run(void)
 #define USFSTL_RPC_IMPLEMENTATION
 #include <usfstl/rpc.h>
 
-USFSTL_RPC_METHOD_VAR(uint32_t /* dummy */,
-		      multi_rpc_test_start,
-		      struct usfstl_multi_run)
+USFSTL_RPC_ONEWAY_METHOD_VAR(multi_rpc_test_start, struct usfstl_multi_run)
 {
 	struct usfstl_test *test = &g_usfstl_multi_controlled_test;
 	char *name;
@@ -216,11 +209,9 @@ USFSTL_RPC_METHOD_VAR(uint32_t /* dummy */,
 	// we pass them to usfstl_execute_test() later
 	g_usfstl_current_test_num = in->test_num;
 	g_usfstl_current_case_num = in->case_num;
-
-	return 0;
 }
 
-USFSTL_RPC_VOID_METHOD(multi_rpc_test_end, uint32_t /* status */)
+USFSTL_RPC_ONEWAY_METHOD(multi_rpc_test_end, uint32_t /* status */)
 {
 	if (!g_usfstl_current_test)
 		return;
@@ -236,7 +227,6 @@ USFSTL_RPC_VOID_METHOD(multi_rpc_test_end, uint32_t /* status */)
 	 * for scheduling, which just causes trouble with time.
 	 */
 	g_usfstl_test_aborted = true;
-	g_usfstl_ptc_must_send_test_end_response = true;
 	usfstl_ctx_abort_test();
 }
 
@@ -251,7 +241,8 @@ USFSTL_RPC_METHOD_VAR(uint32_t /* dummy */,
 		      multi_rpc_sched_cont,
 		      struct usfstl_shared_mem_msg)
 {
-	usfstl_shared_mem_handle_msg(in, insize, true);
+	usfstl_shared_mem_handle_msg(in, insize, &g_usfstl_shared_mem_parent_gen,
+				     true, false);
 
 	g_usfstl_multi_test_sched_continue = true;
 
@@ -268,3 +259,21 @@ USFSTL_RPC_VOID_METHOD(usfstl_multi_rpc_print_participants, int /* indent */)
 {
 	usfstl_multi_controller_print_participants(in);
 }
+
+USFSTL_RPC_METHOD_VAR(uint32_t /* dummy */,
+		      multi_rpc_shared_mem_ids,
+		      struct usfstl_shared_mem_ids_msg)
+{
+	usfstl_shared_mem_handle_ids(in, insize);
+
+	return 0;
+}
+
+USFSTL_RPC_METHOD_VAR(uint32_t /* dummy */,
+		      multi_rpc_shared_mem_map,
+		      struct usfstl_shared_mem_map_msg)
+{
+	usfstl_shared_mem_handle_map(in, insize);
+
+	return 0;
+}
@@ -22,8 +22,9 @@ struct usfstl_multi_run {
 } __attribute__((packed));
 
 struct usfstl_shared_mem_msg_section {
-	usfstl_shared_mem_section_name_t name;
-	uint32_t size;	/* buffer size */
+	uint32_t id;		/* section ID, see struct usfstl_shared_mem_id */
+	uint32_t offset;	/* offset of the buffer in the section */
+	uint32_t size;		/* buffer size */
 	char buf[0];
 } __attribute__((packed));
 
@@ -35,6 +36,31 @@ struct usfstl_sched_req_and_wait_msg {
 	uint64_t time;
 	struct usfstl_shared_mem_msg shared_mem;
 } __attribute__((packed));
+
+/*
+ * Sections are identified by the controller's ID in messages to and from
+ * it, the IDs are sent to each participant when it's started.
+ */
+struct usfstl_shared_mem_id {
+	usfstl_shared_mem_section_name_t name;
+	uint32_t id;
+	uint32_t size;	/* section size */
+} __attribute__((packed));
+
+struct usfstl_shared_mem_ids_msg {
+	struct usfstl_shared_mem_id sections[0];
+} __attribute__((packed));
+
+struct usfstl_shared_mem_map_section {
+	uint32_t id;
+	uint32_t fd;	/* memfd in the sender process */
+	uint32_t size;	/* mapped size, from the start of the section */
+} __attribute__((packed));
+
+struct usfstl_shared_mem_map_msg {
+	uint32_t pid;
+	struct usfstl_shared_mem_map_section sections[0];
+} __attribute__((packed));
 #endif // __USFSTL_MULTI_RPC_H
 
 // declare functions outside ifdefs, needed for code generation
@@ -42,16 +68,20 @@ struct usfstl_sched_req_and_wait_msg {
 // they're just prototypes)
 
 /* controller -> participant */
-USFSTL_RPC_METHOD_VAR(uint32_t /* dummy */,
-		      multi_rpc_test_start,
-		      struct usfstl_multi_run);
-USFSTL_RPC_VOID_METHOD(multi_rpc_test_end, uint32_t /* status */);
+USFSTL_RPC_ONEWAY_METHOD_VAR(multi_rpc_test_start, struct usfstl_multi_run);
+USFSTL_RPC_ONEWAY_METHOD(multi_rpc_test_end, uint32_t /* status */);
 USFSTL_RPC_VOID_METHOD(multi_rpc_exit, uint32_t /* dummy */);
 USFSTL_RPC_METHOD_VAR(uint32_t /* dummy */,
 		      multi_rpc_sched_cont,
 		      struct usfstl_shared_mem_msg);
 USFSTL_RPC_VOID_METHOD(multi_rpc_sched_set_sync, uint64_t /* time */);
 USFSTL_RPC_VOID_METHOD(usfstl_multi_rpc_print_participants, int /* indent */);
+USFSTL_RPC_METHOD_VAR(uint32_t /* dummy */,
+		      multi_rpc_shared_mem_ids,
+		      struct usfstl_shared_mem_ids_msg);
+USFSTL_RPC_METHOD_VAR(uint32_t /* dummy */,
+		      multi_rpc_shared_mem_map,
+		      struct usfstl_shared_mem_map_msg);
 
 /* participant -> controller */
 USFSTL_RPC_VOID_METHOD(multi_rpc_sched_request, uint64_t /* time */);
@@ -22,6 +22,15 @@
 
 #define SECTION_SIZE(s) ((unsigned)(s->p_stop - s->p_start))
 
+/*
+ * Changes are tracked (and sent) in blocks of this size, each block
+ * of our copy of a section records the generation it last changed in.
+ */
+#define USFSTL_SHARED_MEM_BLOCK_SIZE	256
+#define SECTION_BLOCKS(s) \
+	((SECTION_SIZE(s) + USFSTL_SHARED_MEM_BLOCK_SIZE - 1) / \
+	 USFSTL_SHARED_MEM_BLOCK_SIZE)
+
 #define for_each_msg_section(s, msg_end, msg, msg_size)			\
 	for (s = &msg->sections[0], msg_end = (char *)msg + msg_size;	\
 	     s->buf <= msg_end && s->buf + s->size <= msg_end;		\
@@ -38,142 +47,395 @@ static struct usfstl_sched_req_and_wait_msg g_usfstl_sched_default_req_and_wait_
 // time to the shared memory buffers
 struct usfstl_sched_req_and_wait_msg *g_usfstl_sched_req_and_wait_msg =
 	&g_usfstl_sched_default_req_and_wait_msg;
-// This is the size of the shared memory part in the sched request and wait message,
-// used for receiving/sending from/to a remote participant, or the controller.
-// It stores our notion of the remote participant's view of the shared memory
-static unsigned int g_usfstl_shared_mem_msg_size;
+// This is the allocated size of the shared memory part in the sched request
+// and wait message, it's filled with the changes a participant hasn't seen
+// before sending it to that participant (or the controller)
+static unsigned int g_usfstl_shared_mem_msg_alloc;
+
+/**
+ * struct usfstl_shared_mem_copy - our notion of a shared memory section
+ * @buf: the last known contents of the section, i.e. what was last sent
+ *	or received
+ * @gen: generation in which each block last changed
+ * @last_gen: latest generation in which any block changed, so that
+ *	unchanged sections can be skipped without looking at their blocks
+ * @base: contents of each block before the first change merged from a
+ *	participant running in parallel, i.e. what all of them started from;
+ *	allocated on first use
+ * @base_run: parallel run in which each block of @base was saved
+ */
+struct usfstl_shared_mem_copy {
+	char *buf;
+	uint32_t *gen;
+	uint32_t last_gen;
+	char *base;
+	uint32_t *base_run;
+};
+
+// indexed like the sections, allocated on first use in each test
+static struct usfstl_shared_mem_copy *g_usfstl_shared_mem_copies;
+// incremented for each set of changes
+static uint32_t g_usfstl_shared_mem_gen;
+// incremented each time participants are started in parallel
+static uint32_t g_usfstl_shared_mem_parallel_run;
+// a byte changed by more than one of them, reported when they're done
+// (failing while handling the message would leave the sender hanging)
+static struct usfstl_shared_mem_section *g_usfstl_shared_mem_conflict;
+static unsigned int g_usfstl_shared_mem_conflict_offset;
 
 // indicates that the local view of the shared mem has changed since last sent
 // to our parent controller (if any)
 bool g_usfstl_shared_mem_dirty;
+// and the generation our parent controller (if any) has seen
+uint32_t g_usfstl_shared_mem_parent_gen;
+
+/**
+ * struct usfstl_shared_mem_mapping - shared mapping of a section
+ * @fd: the memfd the section is mapped from
+ * @size: size of the mapping (from the start of the section), the
+ *	rest of the section (if any) is still synced through messages
+ * @from_controller: the memfd came from our controller, which then
+ *	also resets the contents for each test (rather than us)
+ */
+struct usfstl_shared_mem_mapping {
+	int fd;
+	unsigned int size;
+	bool from_controller;
+};
+
+// indexed like the sections, if any are mapped
+static struct usfstl_shared_mem_mapping *
+USFSTL_NORESTORE_VAR(g_usfstl_shared_mem_mappings);
 
-// return the size of the shared memory message to send to a participant / to
-// the controller
-unsigned int usfstl_shared_mem_get_msg_size(bool is_participant_outdated)
+/*
+ * Sections are identified by ID rather than by name in messages, so
+ * they can be looked up directly. The IDs are our section indices in
+ * messages to and from our participants, and our controller's section
+ * indices in messages to and from it; those are given to us once when
+ * we're started, and the names (and sizes) are only matched up then.
+ */
+#define USFSTL_SHARED_MEM_NO_ID	0xffffffff
+
+// controller's ID for each of our sections (or USFSTL_SHARED_MEM_NO_ID)
+static uint32_t *USFSTL_NORESTORE_VAR(g_usfstl_shared_mem_parent_ids);
+// our section for each of the controller's IDs (or -1)
+static int *USFSTL_NORESTORE_VAR(g_usfstl_shared_mem_parent_sections);
+static uint32_t USFSTL_NORESTORE_VAR(g_usfstl_shared_mem_n_parent_ids);
+
+// ID of our section for a message to our controller or participants
+static uint32_t usfstl_shared_mem_id(int i, bool to_parent)
 {
-	// include the buffer only if the participant is outdated
-	return is_participant_outdated ? g_usfstl_shared_mem_msg_size : 0;
+	if (!to_parent)
+		return i;
+
+	USFSTL_ASSERT(g_usfstl_shared_mem_parent_ids,
+		      "no shared memory section IDs from controller");
+	return g_usfstl_shared_mem_parent_ids[i];
 }
 
-// try to find a given section inside the shared memory message
-static struct usfstl_shared_mem_msg_section *usfstl_shared_mem_find_msg_section(
-	const usfstl_shared_mem_section_name_t name, unsigned int buf_size)
+// our section for an ID in a message from our controller or participants
+static int usfstl_shared_mem_section_idx(uint32_t id, bool from_parent)
 {
-	struct usfstl_shared_mem_msg *msg = &g_usfstl_sched_req_and_wait_msg->shared_mem;
-	char *msg_end;
-	struct usfstl_shared_mem_msg_section *s;
-
-	for_each_msg_section(s, msg_end, msg,
-			     g_usfstl_shared_mem_msg_size) {
-		if (strncmp(s->name, name, sizeof(s->name)) == 0) {
-			USFSTL_ASSERT_EQ(s->size, buf_size, "%u");
-			return s;
-		}
+	int i = id;
+
+	if (from_parent) {
+		USFSTL_ASSERT(id < g_usfstl_shared_mem_n_parent_ids,
+			      "bad shared memory section ID %u from controller",
+			      id);
+		i = g_usfstl_shared_mem_parent_sections[id];
+		if (i < 0)
+			return -1;
+	}
+
+	USFSTL_ASSERT(i < __stop_usfstl_shms - __start_usfstl_shms &&
+		      __start_usfstl_shms[i],
+		      "bad shared memory section ID %u", id);
+	return i;
+}
+
+// size of the section part that's mapped and thus not synced by messages
+static unsigned int usfstl_shared_mem_mapped(int i)
+{
+	return g_usfstl_shared_mem_mappings ?
+		g_usfstl_shared_mem_mappings[i].size : 0;
+}
+
+static struct usfstl_shared_mem_copy *usfstl_shared_mem_get_copies(void)
+{
+	struct usfstl_shared_mem_section *s;
+	int i;
+
+	if (g_usfstl_shared_mem_copies)
+		return g_usfstl_shared_mem_copies;
+
+	g_usfstl_shared_mem_copies =
+		usfstl_calloc(__stop_usfstl_shms - __start_usfstl_shms,
+			      sizeof(*g_usfstl_shared_mem_copies));
+	USFSTL_ASSERT(g_usfstl_shared_mem_copies);
+
+	for_each_shared_mem_section(s, i) {
+		struct usfstl_shared_mem_copy *copy = &g_usfstl_shared_mem_copies[i];
+		unsigned int buf_size = SECTION_SIZE(s);
+		unsigned int mapped = usfstl_shared_mem_mapped(i);
+
+		if (!buf_size)
+			continue;
+
+		copy->buf = usfstl_calloc(1, buf_size);
+		copy->gen = usfstl_calloc(SECTION_BLOCKS(s), sizeof(*copy->gen));
+		USFSTL_ASSERT(copy->buf && copy->gen);
+
+		// verify that the section is initially zeroed and consider it unchanged
+		// (the mapped part may already have been written by others)
+		USFSTL_ASSERT(memcmp(copy->buf + mapped, s->p_start + mapped,
+				     buf_size - mapped) == 0,
+			"section '%s' initially not zeroed", s->name);
 	}
 
-	return NULL;
+	return g_usfstl_shared_mem_copies;
 }
 
-// add a section to the shared memory message - it must not already exist
+// add a (partial) section to the shared memory message at the given offset
 static struct usfstl_shared_mem_msg_section *usfstl_shared_mem_add_msg_section(
-	const usfstl_shared_mem_section_name_t name, unsigned int buf_size)
+	unsigned int msg_size, uint32_t id, unsigned int offset,
+	unsigned int buf_size)
 {
 	unsigned int new_size;
 	unsigned int new_size_req_and_wait;
 	struct usfstl_shared_mem_msg_section *section;
 
-	new_size = g_usfstl_shared_mem_msg_size + sizeof(*section) + buf_size;
-	new_size_req_and_wait = new_size + offsetof(typeof(*g_usfstl_sched_req_and_wait_msg), shared_mem);
-	if (g_usfstl_sched_req_and_wait_msg == &g_usfstl_sched_default_req_and_wait_msg)
-		g_usfstl_sched_req_and_wait_msg = NULL;
-	g_usfstl_sched_req_and_wait_msg = usfstl_realloc(g_usfstl_sched_req_and_wait_msg,
-							 new_size_req_and_wait);
-	USFSTL_ASSERT(g_usfstl_sched_req_and_wait_msg);
+	new_size = msg_size + sizeof(*section) + buf_size;
+	if (new_size > g_usfstl_shared_mem_msg_alloc) {
+		new_size_req_and_wait = new_size + offsetof(typeof(*g_usfstl_sched_req_and_wait_msg), shared_mem);
+		if (g_usfstl_sched_req_and_wait_msg == &g_usfstl_sched_default_req_and_wait_msg)
+			g_usfstl_sched_req_and_wait_msg = NULL;
+		g_usfstl_sched_req_and_wait_msg = usfstl_realloc(g_usfstl_sched_req_and_wait_msg,
+								 new_size_req_and_wait);
+		USFSTL_ASSERT(g_usfstl_sched_req_and_wait_msg);
+		g_usfstl_shared_mem_msg_alloc = new_size;
+	}
 
 	section = (void *)((char *)g_usfstl_sched_req_and_wait_msg->shared_mem.sections +
-			   g_usfstl_shared_mem_msg_size);
-	memcpy(section->name, name, sizeof(section->name));
+			   msg_size);
+	section->id = id;
+	section->offset = offset;
 	section->size = buf_size;
-	g_usfstl_shared_mem_msg_size = new_size;
 	return section;
 }
 
-// merge a local section into the shared memory message
-// return whether the message has changed (so it needs to be sent)
+// fill the shared memory message with everything that changed after the
+// generation *seen_gen, and update that to the current generation;
+// return the size of the message to send to a participant / to the controller
+unsigned int usfstl_shared_mem_get_msg_size(uint32_t *seen_gen,
+					    bool is_participant_outdated,
+					    bool to_parent)
+{
+	struct usfstl_shared_mem_copy *copies = usfstl_shared_mem_get_copies();
+	unsigned int msg_size = 0;
+	struct usfstl_shared_mem_section *s;
+	int i;
+
+	// include the buffer only if the participant is outdated
+	if (!is_participant_outdated) {
+		*seen_gen = g_usfstl_shared_mem_gen;
+		return 0;
+	}
+
+	for_each_shared_mem_section(s, i) {
+		struct usfstl_shared_mem_copy *copy = &copies[i];
+		unsigned int blocks = SECTION_BLOCKS(s);
+		unsigned int b = usfstl_shared_mem_mapped(i) /
+				 USFSTL_SHARED_MEM_BLOCK_SIZE;
+		uint32_t id;
+
+		if (copy->last_gen <= *seen_gen)
+			continue;
+
+		id = usfstl_shared_mem_id(i, to_parent);
+		if (id == USFSTL_SHARED_MEM_NO_ID)
+			continue;
+
+		while (b < blocks) {
+			struct usfstl_shared_mem_msg_section *section;
+			unsigned int start, end;
+
+			if (copy->gen[b] <= *seen_gen) {
+				b++;
+				continue;
+			}
+
+			// send consecutive changed blocks as one range
+			for (start = b; b < blocks && copy->gen[b] > *seen_gen; b++)
+				;
+
+			start *= USFSTL_SHARED_MEM_BLOCK_SIZE;
+			end = b * USFSTL_SHARED_MEM_BLOCK_SIZE;
+			if (end > SECTION_SIZE(s))
+				end = SECTION_SIZE(s);
+
+			section = usfstl_shared_mem_add_msg_section(msg_size, id,
+								    start,
+								    end - start);
+			memcpy(section->buf, copy->buf + start, end - start);
+			msg_size += sizeof(*section) + end - start;
+		}
+	}
+
+	*seen_gen = g_usfstl_shared_mem_gen;
+	return msg_size;
+}
+
+// merge a local section into our copy, marking the changed blocks
+// return whether anything has changed (so it needs to be sent)
 static bool usfstl_shared_mem_merge_local_section(
-	struct usfstl_shared_mem_section *s)
+	struct usfstl_shared_mem_section *s,
+	struct usfstl_shared_mem_copy *copy, unsigned int mapped, uint32_t gen)
 {
-	const void *buf = s->p_start;
 	unsigned int buf_size = SECTION_SIZE(s);
-	struct usfstl_shared_mem_msg_section *section;
+	unsigned int offset;
+	bool modified = false;
 
-	// try to find the section in the existing space
-	section = usfstl_shared_mem_find_msg_section(s->name, buf_size);
+	for (offset = mapped; offset < buf_size;
+	     offset += USFSTL_SHARED_MEM_BLOCK_SIZE) {
+		unsigned int len = buf_size - offset;
 
-	// if not found, create it
-	if (!section)
-	{
-		section = usfstl_shared_mem_add_msg_section(s->name, buf_size);
-		// verify that the section is initially zeroed and consider it unchanged
-		memset(section->buf, 0, buf_size);
-		USFSTL_ASSERT(memcmp(section->buf, buf, buf_size) == 0,
-			"section '%s' initially not zeroed", s->name);
-		return false;
+		if (len > USFSTL_SHARED_MEM_BLOCK_SIZE)
+			len = USFSTL_SHARED_MEM_BLOCK_SIZE;
+
+		if (memcmp(copy->buf + offset, s->p_start + offset, len) == 0)
+			continue;
+
+		memcpy(copy->buf + offset, s->p_start + offset, len);
+		copy->gen[offset / USFSTL_SHARED_MEM_BLOCK_SIZE] = gen;
+		modified = true;
 	}
-	// else, compare it to know whether it changed
-	else if (memcmp(section->buf, buf, buf_size) == 0)
-		return false;
 
-	memcpy(section->buf, buf, buf_size);
-	return true;
+	if (modified)
+		copy->last_gen = gen;
+
+	return modified;
 }
 
-// merge a remote section into the shared memory message
-static bool usfstl_shared_mem_merge_remote_section(
-	const usfstl_shared_mem_section_name_t name,
-	const void *buf,
-	unsigned int buf_size)
+// merge a block from a participant running in parallel into our copy:
+// it contains the bytes it didn't write as they were when it started, so
+// take only those that differ from that, rather than overwriting what
+// other parallel participants changed in the same block
+static bool usfstl_shared_mem_merge_parallel(struct usfstl_shared_mem_section *s,
+					     struct usfstl_shared_mem_copy *copy,
+					     unsigned int offset,
+					     unsigned int len, const char *buf)
 {
-	bool relevant = false;
-	int i;
-	struct usfstl_shared_mem_section *s;
-	struct usfstl_shared_mem_msg_section *section;
+	unsigned int b = offset / USFSTL_SHARED_MEM_BLOCK_SIZE;
+	bool modified = false;
+	unsigned int j;
 
-	// try to find the section in the existing space
-	for_each_shared_mem_section(s, i) {
-		if (strncmp(s->name, name,
-				sizeof(s->name)) == 0) {
-			USFSTL_ASSERT_EQ(SECTION_SIZE(s),
-						buf_size, "%u");
-			relevant = true;
-			break;
+	if (!copy->base) {
+		copy->base = usfstl_calloc(1, SECTION_SIZE(s));
+		copy->base_run = usfstl_calloc(SECTION_BLOCKS(s),
+					       sizeof(*copy->base_run));
+		USFSTL_ASSERT(copy->base && copy->base_run);
+	}
+
+	// the first change to the block in this run, save what it was before
+	if (copy->base_run[b] != g_usfstl_shared_mem_parallel_run) {
+		unsigned int start = b * USFSTL_SHARED_MEM_BLOCK_SIZE;
+		unsigned int size = SECTION_SIZE(s) - start;
+
+		if (size > USFSTL_SHARED_MEM_BLOCK_SIZE)
+			size = USFSTL_SHARED_MEM_BLOCK_SIZE;
+		memcpy(copy->base + start, copy->buf + start, size);
+		copy->base_run[b] = g_usfstl_shared_mem_parallel_run;
+	}
+
+	for (j = 0; j < len; j++) {
+		char *cur = copy->buf + offset + j;
+		char base = copy->base[offset + j];
+
+		if (buf[j] == base || buf[j] == *cur)
+			continue;
+
+		if (*cur != base && !g_usfstl_shared_mem_conflict) {
+			g_usfstl_shared_mem_conflict = s;
+			g_usfstl_shared_mem_conflict_offset = offset + j;
 		}
+		*cur = buf[j];
+		modified = true;
 	}
 
-	if (relevant) {
-		section = usfstl_shared_mem_find_msg_section(name, buf_size);
+	return modified;
+}
+
+// merge a remote (partial) section into our copy, marking the blocks
+// that actually changed; return whether any did
+static bool usfstl_shared_mem_merge_remote_section(
+	const struct usfstl_shared_mem_msg_section *section,
+	struct usfstl_shared_mem_copy *copies, uint32_t gen, bool from_parent,
+	bool parallel)
+{
+	struct usfstl_shared_mem_copy *copy;
+	struct usfstl_shared_mem_section *s;
+	unsigned int offset, end;
+	bool modified = false;
+	int i;
+
+	i = usfstl_shared_mem_section_idx(section->id, from_parent);
+	if (i < 0)
+		return false;
 
-		if (!section)
-			section = usfstl_shared_mem_add_msg_section(name, buf_size);
-		memcpy(section->buf, buf, buf_size);
+	s = __start_usfstl_shms[i];
+	USFSTL_ASSERT(section->offset <= SECTION_SIZE(s) &&
+		      section->size <= SECTION_SIZE(s) - section->offset,
+		      "bad range in section '%s'", s->name);
+	USFSTL_ASSERT(section->offset >= usfstl_shared_mem_mapped(i),
+		      "data for mapped part of section '%s'", s->name);
+
+	copy = &copies[i];
+	end = section->offset + section->size;
+
+	for (offset = section->offset; offset < end; ) {
+		unsigned int next = (offset / USFSTL_SHARED_MEM_BLOCK_SIZE + 1) *
+				    USFSTL_SHARED_MEM_BLOCK_SIZE;
+		const char *buf = section->buf + offset - section->offset;
+
+		if (next > end)
+			next = end;
+
+		if (parallel) {
+			if (usfstl_shared_mem_merge_parallel(s, copy, offset,
+							     next - offset, buf)) {
+				copy->gen[offset / USFSTL_SHARED_MEM_BLOCK_SIZE] = gen;
+				modified = true;
+			}
+		} else if (memcmp(copy->buf + offset, buf, next - offset)) {
+			memcpy(copy->buf + offset, buf, next - offset);
+			copy->gen[offset / USFSTL_SHARED_MEM_BLOCK_SIZE] = gen;
+			modified = true;
+		}
+
+		offset = next;
 	}
 
-	return relevant;
+	if (modified)
+		copy->last_gen = gen;
+
+	return modified;
 }
 
-// merge an incoming message into the shared memory message
+// merge an incoming message into our copy
 static bool usfstl_shared_mem_merge_msg(
-	const struct usfstl_shared_mem_msg *msg, unsigned int msg_size)
+	const struct usfstl_shared_mem_msg *msg, unsigned int msg_size,
+	uint32_t gen, bool from_parent, bool parallel)
 {
+	struct usfstl_shared_mem_copy *copies = usfstl_shared_mem_get_copies();
 	bool relevant_merge = false;
 	const char *msg_end;
 	const struct usfstl_shared_mem_msg_section *section;
 
 	for_each_msg_section(section, msg_end, msg, msg_size)
 		relevant_merge |=
-			usfstl_shared_mem_merge_remote_section(section->name,
-							       section->buf,
-							       section->size);
+			usfstl_shared_mem_merge_remote_section(section, copies,
+							       gen, from_parent,
+							       parallel);
 	USFSTL_ASSERT_EQ((char *)section, msg_end, "%p");
 
 	return relevant_merge;
@@ -182,9 +444,11 @@ static bool usfstl_shared_mem_merge_msg(
 // upon an incoming message, update our notion of the remote participant's
 // shared memory
 void usfstl_shared_mem_handle_msg(const struct usfstl_shared_mem_msg *msg,
-				  unsigned int msg_size, bool do_not_mark_dirty)
+				  unsigned int msg_size, uint32_t *sender_gen,
+				  bool from_parent, bool parallel)
 {
 	struct usfstl_multi_participant *p;
+	uint32_t gen = g_usfstl_shared_mem_gen;
 	int i;
 
 	// ignore messages after test completion, as usfstl_alloc memory was freed
@@ -197,21 +461,31 @@ void usfstl_shared_mem_handle_msg(const struct usfstl_shared_mem_msg *msg,
 
 	// the controller keeps the state of each participant
 	for_each_participant(p, i) {
-		// all waiting participants are now outdated
-		if (p->flags & USFSTL_MULTI_PARTICIPANT_WAITING)
+		// all waiting participants are now outdated, as are those
+		// running in parallel with the sender
+		if (p->flags & (USFSTL_MULTI_PARTICIPANT_WAITING |
+				USFSTL_MULTI_PARTICIPANT_PARALLEL))
 			p->flags |= USFSTL_MULTI_PARTICIPANT_SHARED_MEM_OUTDATED;
 	}
 
 	// mark the shared memory message for sending to our parent controller
-	if (!do_not_mark_dirty)
+	// (unless it came from there)
+	if (!from_parent)
 		g_usfstl_shared_mem_dirty = true;
 
 	// mark the local view as outdated until we really need to refresh it
 	// from the buffer
 
-	if (usfstl_shared_mem_merge_msg(msg, msg_size))
+	if (usfstl_shared_mem_merge_msg(msg, msg_size, gen + 1, from_parent,
+					parallel)) {
+		g_usfstl_shared_mem_gen = gen + 1;
 		g_usfstl_multi_local_participant.flags |=
 			USFSTL_MULTI_PARTICIPANT_SHARED_MEM_OUTDATED;
+
+		// no need to send the sender its own changes back
+		if (*sender_gen == gen)
+			*sender_gen = g_usfstl_shared_mem_gen;
+	}
 }
 
 // refresh the local view of the shared memory from the updated remote version
@@ -219,45 +493,67 @@ void usfstl_shared_mem_update_local_view(void)
 {
 	if (g_usfstl_multi_local_participant.flags &
 	    USFSTL_MULTI_PARTICIPANT_SHARED_MEM_OUTDATED) {
-		struct usfstl_shared_mem_msg *msg = &g_usfstl_sched_req_and_wait_msg->shared_mem;
-		char *msg_end;
-		struct usfstl_shared_mem_msg_section *section;
+		struct usfstl_shared_mem_copy *copies = usfstl_shared_mem_get_copies();
+		uint32_t seen_gen = g_usfstl_multi_local_participant.shared_mem_gen;
 		struct usfstl_shared_mem_section *s;
 		int i;
 
 		g_usfstl_multi_local_participant.flags &=
 			~USFSTL_MULTI_PARTICIPANT_SHARED_MEM_OUTDATED;
 
-		for_each_msg_section(section, msg_end, msg,
-				     g_usfstl_shared_mem_msg_size) {
-			for_each_shared_mem_section(s, i) {
-				if (strncmp(s->name, section->name,
-				    sizeof(s->name)) == 0) {
-					USFSTL_ASSERT_EQ(SECTION_SIZE(s),
-							 section->size, "%u");
-					memcpy(s->p_start, section->buf,
-					       section->size);
-					break;
-				}
+		for_each_shared_mem_section(s, i) {
+			struct usfstl_shared_mem_copy *copy = &copies[i];
+			unsigned int buf_size = SECTION_SIZE(s);
+			unsigned int b, offset, len;
+
+			if (copy->last_gen <= seen_gen)
+				continue;
+
+			for (b = usfstl_shared_mem_mapped(i) /
+				 USFSTL_SHARED_MEM_BLOCK_SIZE;
+			     b < SECTION_BLOCKS(s); b++) {
+				if (copy->gen[b] <= seen_gen)
+					continue;
+
+				offset = b * USFSTL_SHARED_MEM_BLOCK_SIZE;
+				len = buf_size - offset;
+				if (len > USFSTL_SHARED_MEM_BLOCK_SIZE)
+					len = USFSTL_SHARED_MEM_BLOCK_SIZE;
+				memcpy(s->p_start + offset, copy->buf + offset,
+				       len);
 			}
 		}
+
+		g_usfstl_multi_local_participant.shared_mem_gen =
+			g_usfstl_shared_mem_gen;
 	}
 }
 
-// update the shared memory message according to the local view of the shared
-// memory
+// update our copy of the shared memory according to the local view of the
+// shared memory
 static bool usfstl_shared_mem_update_msg(void)
 {
+	struct usfstl_shared_mem_copy *copies = usfstl_shared_mem_get_copies();
+	uint32_t gen = g_usfstl_shared_mem_gen + 1;
 	bool modified = false;
 	struct usfstl_shared_mem_section *s;
 	int i;
 
 	for_each_shared_mem_section(s, i)
-		modified |= usfstl_shared_mem_merge_local_section(s);
+		modified |= usfstl_shared_mem_merge_local_section(s, &copies[i],
+								  usfstl_shared_mem_mapped(i),
+								  gen);
+
+	if (modified) {
+		g_usfstl_shared_mem_gen = gen;
+		// the local view obviously has its own changes
+		g_usfstl_multi_local_participant.shared_mem_gen = gen;
+	}
+
 	return modified;
 }
 
-// save the local view of the shared memory into the shared memory message
+// save the local view of the shared memory into our copy
 void usfstl_shared_mem_prepare_msg(void)
 {
 	USFSTL_ASSERT(!(g_usfstl_multi_local_participant.flags &
@@ -275,3 +571,226 @@ void usfstl_shared_mem_prepare_msg(void)
 		g_usfstl_shared_mem_dirty = true;
 	}
 }
+
+// participants are about to be started in parallel from the current copy
+void usfstl_shared_mem_start_parallel(void)
+{
+	g_usfstl_shared_mem_parallel_run++;
+}
+
+// all participants that were running in parallel have stopped
+void usfstl_shared_mem_end_parallel(void)
+{
+	USFSTL_ASSERT(!g_usfstl_shared_mem_conflict,
+		      "participants running in parallel changed offset %u of section '%s'",
+		      g_usfstl_shared_mem_conflict_offset,
+		      g_usfstl_shared_mem_conflict->name);
+}
+
+/*
+ * Participants see each other's writes to mapped memory immediately, so
+ * they can't run in parallel (deterministically) while anything is mapped.
+ */
+bool usfstl_shared_mem_any_mapped(void)
+{
+	struct usfstl_shared_mem_section *s;
+	int i;
+
+	for_each_shared_mem_section(s, i) {
+		if (usfstl_shared_mem_mapped(i))
+			return true;
+	}
+
+	return false;
+}
+
+// map the full pages of all sections from new memfds, as the top controller
+void usfstl_shared_mem_map_init(void)
+{
+	struct usfstl_shared_mem_section *s;
+	int i;
+
+	if (g_usfstl_shared_mem_mappings)
+		return;
+
+	g_usfstl_shared_mem_mappings =
+		calloc(__stop_usfstl_shms - __start_usfstl_shms,
+		       sizeof(*g_usfstl_shared_mem_mappings));
+	USFSTL_ASSERT(g_usfstl_shared_mem_mappings);
+
+	for_each_shared_mem_section(s, i) {
+		struct usfstl_shared_mem_mapping *mapping =
+			&g_usfstl_shared_mem_mappings[i];
+
+		mapping->size = SECTION_SIZE(s) & ~(USFSTL_SHARED_MEM_PAGE_SIZE - 1);
+		if (!mapping->size)
+			continue;
+
+		mapping->fd = usfstl_shared_mem_map_create(s->name, s->p_start,
+							   mapping->size);
+	}
+}
+
+// tell a (newly started) participant to map the sections we have mapped
+static void usfstl_shared_mem_map_participant(struct usfstl_multi_participant *p)
+{
+	struct usfstl_shared_mem_map_msg *msg;
+	struct usfstl_shared_mem_section *s;
+	unsigned int n = 0;
+	int i;
+
+	if (!g_usfstl_shared_mem_mappings)
+		return;
+
+	msg = calloc(1, sizeof(*msg) +
+			(__stop_usfstl_shms - __start_usfstl_shms) *
+			sizeof(msg->sections[0]));
+	USFSTL_ASSERT(msg);
+	msg->pid = usfstl_shared_mem_map_pid();
+
+	for_each_shared_mem_section(s, i) {
+		struct usfstl_shared_mem_mapping *mapping =
+			&g_usfstl_shared_mem_mappings[i];
+
+		if (!mapping->size)
+			continue;
+
+		msg->sections[n].id = i;
+		msg->sections[n].fd = mapping->fd;
+		msg->sections[n].size = mapping->size;
+		n++;
+	}
+
+	if (n)
+		multi_rpc_shared_mem_map_conn(p->conn, msg,
+					      sizeof(*msg) +
+					      n * sizeof(msg->sections[0]));
+	free(msg);
+}
+
+// map the sections as told by our controller
+void usfstl_shared_mem_handle_map(const struct usfstl_shared_mem_map_msg *msg,
+				  unsigned int msg_size)
+{
+	const struct usfstl_shared_mem_map_section *section;
+	struct usfstl_multi_participant *p;
+	struct usfstl_shared_mem_section *s;
+	int i;
+
+	if (!g_usfstl_shared_mem_mappings) {
+		g_usfstl_shared_mem_mappings =
+			calloc(__stop_usfstl_shms - __start_usfstl_shms,
+			       sizeof(*g_usfstl_shared_mem_mappings));
+		USFSTL_ASSERT(g_usfstl_shared_mem_mappings);
+	}
+
+	for (section = msg->sections;
+	     (const char *)(section + 1) <= (const char *)msg + msg_size;
+	     section++) {
+		struct usfstl_shared_mem_mapping *mapping;
+
+		i = usfstl_shared_mem_section_idx(section->id, true);
+		if (i < 0)
+			continue;
+
+		s = __start_usfstl_shms[i];
+		mapping = &g_usfstl_shared_mem_mappings[i];
+		USFSTL_ASSERT_EQ(SECTION_SIZE(s) & ~(USFSTL_SHARED_MEM_PAGE_SIZE - 1),
+				 section->size, "%u");
+		USFSTL_ASSERT(((uintptr_t)s->p_start &
+			       (USFSTL_SHARED_MEM_PAGE_SIZE - 1)) == 0,
+			      "section '%s' isn't page aligned", s->name);
+
+		// this replaces any mapping we had (as a controller) before
+		if (mapping->size)
+			usfstl_shared_mem_map_close(mapping->fd);
+		if (!mapping->from_controller)
+			usfstl_restore_exclude(s->p_start, section->size);
+
+		mapping->fd = usfstl_shared_mem_map_open(msg->pid, section->fd,
+							 s->p_start,
+							 section->size);
+		mapping->size = section->size;
+		mapping->from_controller = true;
+	}
+
+	// and pass them on if we're a controller ourselves
+	for_each_participant(p, i)
+		usfstl_shared_mem_map_participant(p);
+}
+
+// give a (newly started) participant the IDs of our sections, and
+// tell it to map the sections we have mapped
+void usfstl_shared_mem_init_participant(struct usfstl_multi_participant *p)
+{
+	struct usfstl_shared_mem_ids_msg *msg;
+	struct usfstl_shared_mem_section *s;
+	unsigned int n = 0;
+	int i;
+
+	msg = calloc(1, sizeof(*msg) +
+			(__stop_usfstl_shms - __start_usfstl_shms) *
+			sizeof(msg->sections[0]));
+	USFSTL_ASSERT(msg);
+
+	for_each_shared_mem_section(s, i) {
+		memcpy(msg->sections[n].name, s->name, sizeof(s->name));
+		msg->sections[n].id = i;
+		msg->sections[n].size = SECTION_SIZE(s);
+		n++;
+	}
+
+	multi_rpc_shared_mem_ids_conn(p->conn, msg,
+				      sizeof(*msg) + n * sizeof(msg->sections[0]));
+	free(msg);
+
+	usfstl_shared_mem_map_participant(p);
+}
+
+// match our sections with the IDs our controller uses for them
+void usfstl_shared_mem_handle_ids(const struct usfstl_shared_mem_ids_msg *msg,
+				  unsigned int msg_size)
+{
+	unsigned int n = msg_size / sizeof(msg->sections[0]);
+	struct usfstl_shared_mem_section *s;
+	uint32_t max_id = 0;
+	unsigned int j;
+	int i;
+
+	free(g_usfstl_shared_mem_parent_ids);
+	free(g_usfstl_shared_mem_parent_sections);
+
+	for (j = 0; j < n; j++) {
+		USFSTL_ASSERT(msg->sections[j].id != USFSTL_SHARED_MEM_NO_ID);
+		if (msg->sections[j].id >= max_id)
+			max_id = msg->sections[j].id + 1;
+	}
+
+	g_usfstl_shared_mem_n_parent_ids = max_id;
+	g_usfstl_shared_mem_parent_sections =
+		malloc((max_id ?: 1) * sizeof(*g_usfstl_shared_mem_parent_sections));
+	g_usfstl_shared_mem_parent_ids =
+		malloc((__stop_usfstl_shms - __start_usfstl_shms) *
+		       sizeof(*g_usfstl_shared_mem_parent_ids));
+	USFSTL_ASSERT(g_usfstl_shared_mem_parent_sections &&
+		      g_usfstl_shared_mem_parent_ids);
+
+	for (j = 0; j < max_id; j++)
+		g_usfstl_shared_mem_parent_sections[j] = -1;
+	for (i = 0; &__start_usfstl_shms[i] < __stop_usfstl_shms; i++)
+		g_usfstl_shared_mem_parent_ids[i] = USFSTL_SHARED_MEM_NO_ID;
+
+	for (j = 0; j < n; j++) {
+		const struct usfstl_shared_mem_id *id = &msg->sections[j];
+
+		for_each_shared_mem_section(s, i) {
+			if (strncmp(s->name, id->name, sizeof(s->name)))
+				continue;
+
+			USFSTL_ASSERT_EQ(SECTION_SIZE(s), id->size, "%u");
+			g_usfstl_shared_mem_parent_ids[i] = id->id;
+			g_usfstl_shared_mem_parent_sections[id->id] = i;
+			break;
+		}
+	}
+}
@@ -66,7 +66,8 @@ void usfstl_run_participant(struct usfstl_multi_participant *p, int nargs)
 	PROCESS_INFORMATION pi = {};
 	char cmdline[1000] = {};
 	char tcpopt[100] = {};
-	char namebuf[20 + strlen(p->name)];
+	char namebuf[21 + strlen(g_usfstl_multi_local_participant.name) +
+		     strlen(p->name)];
 	char ctlnamebuf[20 + strlen(g_usfstl_multi_local_participant.name)];
 	SOCKET s;
 	int i;
@@ -101,7 +102,12 @@ void usfstl_run_participant(struct usfstl_multi_participant *p, int nargs)
 	}
 
 	sprintf(tcpopt, "--control=tcp:%d", (unsigned int)g_usfstl_multi_server_port);
-	sprintf(namebuf, "--multi-ptc-name=%s", p->name);
+	// name nested participants by their path from the top
+	if (usfstl_is_multi_participant())
+		sprintf(namebuf, "--multi-ptc-name=%s/%s",
+			g_usfstl_multi_local_participant.name, p->name);
+	else
+		sprintf(namebuf, "--multi-ptc-name=%s", p->name);
 	sprintf(ctlnamebuf, "--multi-ptc-ctl=%s", g_usfstl_multi_local_participant.name);
 	assert(strlen(cmdline) + strlen(tcpopt) + strlen(namebuf) +
 	       strlen(ctlnamebuf) + 4 < sizeof(cmdline));
@@ -136,3 +142,27 @@ void usfstl_run_participant(struct usfstl_multi_participant *p, int nargs)
 	p->pid = pi.dwProcessId;
 	p->conn->conn.fd = s;
 }
+
+/* shared memory sections mapped between participants */
+uint32_t usfstl_shared_mem_map_pid(void)
+{
+	return GetCurrentProcessId();
+}
+
+int usfstl_shared_mem_map_create(const char *name, void *addr,
+				 unsigned int size)
+{
+	USFSTL_ASSERT(0, "shared memory mapping is not supported on Windows");
+	return -1;
+}
+
+int usfstl_shared_mem_map_open(uint32_t pid, int fd, void *addr,
+			       unsigned int size)
+{
+	USFSTL_ASSERT(0, "shared memory mapping is not supported on Windows");
+	return -1;
+}
+
+void usfstl_shared_mem_map_close(int fd)
+{
+}
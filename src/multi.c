@@ -40,9 +40,17 @@ void usfstl_multi_init(void)
 static void usfstl_multi_extra_transmit(struct usfstl_rpc_connection *conn,
 					void *data)
 {
+	struct usfstl_multi_participant *p;
 	struct usfstl_scheduler *scheduler;
 	struct usfstl_multi_sync *sync = data;
 
+	// participants running in parallel are each at their own time
+	p = usfstl_multi_controller_parallel_participant(conn);
+	if (p) {
+		sync->time = p->parallel_time;
+		return;
+	}
+
 	scheduler = conn->conn.data ?: g_usfstl_top_scheduler;
 
 	sync->time = usfstl_sched_current_time(scheduler);
@@ -51,12 +59,19 @@ static void usfstl_multi_extra_transmit(struct usfstl_rpc_connection *conn,
 static void usfstl_multi_extra_received(struct usfstl_rpc_connection *conn,
 					const void *data)
 {
+	struct usfstl_multi_participant *p;
 	struct usfstl_scheduler *scheduler;
 	const struct usfstl_multi_sync *sync = data;
 
 	if (!g_usfstl_current_test)
 		return;
 
+	p = usfstl_multi_controller_parallel_participant(conn);
+	if (p) {
+		p->parallel_time = sync->time;
+		return;
+	}
+
 	scheduler = conn->conn.data ?: g_usfstl_top_scheduler;
 
 	if (usfstl_sched_current_time(scheduler) != sync->time)
@@ -101,9 +116,12 @@ void usfstl_multi_start_test(void)
 
 void usfstl_multi_end_test(enum usfstl_testcase_status status)
 {
+	/*
+	 * Participants don't report back when they've ended the test.
+	 * The next test start is queued behind the end on the connection,
+	 * so they can unwind and restore their state for the next test
+	 * in parallel with us (and each other).
+	 */
 	if (usfstl_is_multi_controller())
 		usfstl_multi_end_test_controller(status);
-
-	if (usfstl_is_multi_participant())
-		usfstl_multi_end_test_participant();
 }
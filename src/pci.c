@@ -8,52 +8,392 @@
 #include <linux/virtio_pcidev.h>
 #include <endian.h>
 #include <stdio.h>
+#include <stdlib.h>
 
-void usfstl_vhost_pci_connected(struct usfstl_vhost_user_dev *dev)
+/*
+ * Compiled register table of a BAR, @lookup has an entry for each byte
+ * of the register window, containing the index (plus one, so zero means
+ * no register) of the register covering it.
+ */
+struct usfstl_pci_regmap {
+	const struct usfstl_pci_bar_regs *desc;
+	uint64_t *values;
+	uint16_t *lookup;
+};
+
+static struct usfstl_pci_regmap *
+usfstl_pci_regmap_alloc(const struct usfstl_pci_bar_regs *desc)
 {
-	struct usfstl_pci_device_ops *ops = dev->server->data;
+	struct usfstl_pci_regmap *map;
+	unsigned int i, j;
+
+	USFSTL_ASSERT(desc->n_regs < 0xffff);
+
+	map = calloc(1, sizeof(*map) +
+			desc->n_regs * sizeof(map->values[0]) +
+			desc->size * sizeof(map->lookup[0]));
+	USFSTL_ASSERT(map);
+
+	map->desc = desc;
+	map->values = (void *)(map + 1);
+	map->lookup = (void *)(map->values + desc->n_regs);
+
+	for (i = 0; i < desc->n_regs; i++) {
+		const struct usfstl_pci_reg *reg = &desc->regs[i];
+
+		USFSTL_ASSERT(reg->width == 1 || reg->width == 2 ||
+			      reg->width == 4 || reg->width == 8,
+			      "register 0x%x has invalid width %d",
+			      reg->offset, reg->width);
+		USFSTL_ASSERT(!(reg->offset & (reg->width - 1)),
+			      "register 0x%x is not aligned", reg->offset);
+		USFSTL_ASSERT(reg->offset + reg->width <= desc->size,
+			      "register 0x%x is outside the window", reg->offset);
+
+		for (j = 0; j < reg->width; j++) {
+			USFSTL_ASSERT(!map->lookup[reg->offset + j],
+				      "register 0x%x overlaps register 0x%x",
+				      reg->offset,
+				      desc->regs[map->lookup[reg->offset + j] - 1].offset);
+			map->lookup[reg->offset + j] = i + 1;
+		}
+
+		map->values[i] = reg->reset;
+	}
+
+	return map;
+}
+
+static unsigned int usfstl_pci_regmap_find(struct usfstl_pci_regmap *map,
+					   uint64_t offset, size_t size)
+{
+	const struct usfstl_pci_reg *reg;
+	unsigned int idx;
+
+	if (!map || offset >= map->desc->size)
+		return 0;
+
+	idx = map->lookup[offset];
+	if (!idx)
+		return 0;
+
+	/* only exact accesses are handled, all others go to the device */
+	reg = &map->desc->regs[idx - 1];
+	if (reg->offset != offset || reg->width != size)
+		return 0;
+
+	return idx;
+}
+
+static bool usfstl_pci_regmap_read(struct usfstl_pci_device *pcidev, int bar,
+				   void *buf, uint64_t offset, size_t size)
+{
+	struct usfstl_pci_regmap *map = pcidev->regmap[bar];
+	unsigned int idx = usfstl_pci_regmap_find(map, offset, size);
+	const struct usfstl_pci_reg *reg;
+	uint64_t value;
+
+	if (!idx)
+		return false;
+
+	reg = &map->desc->regs[idx - 1];
+	value = map->values[idx - 1];
+	if (reg->read)
+		value = reg->read(pcidev, reg, value);
+
+	switch (size) {
+	case 1:
+		*(uint8_t *)buf = value;
+		break;
+	case 2:
+		*(uint16_t *)buf = htole16(value);
+		break;
+	case 4:
+		*(uint32_t *)buf = htole32(value);
+		break;
+	case 8:
+		*(uint64_t *)buf = htole64(value);
+		break;
+	}
+
+	return true;
+}
+
+static bool usfstl_pci_regmap_write(struct usfstl_pci_device *pcidev, int bar,
+				    const void *buf, uint64_t offset,
+				    size_t size)
+{
+	struct usfstl_pci_regmap *map = pcidev->regmap[bar];
+	unsigned int idx = usfstl_pci_regmap_find(map, offset, size);
+	const struct usfstl_pci_reg *reg;
+	uint64_t value, old;
+
+	if (!idx)
+		return false;
+
+	switch (size) {
+	case 1:
+		value = *(const uint8_t *)buf;
+		break;
+	case 2:
+		value = le16toh(*(const uint16_t *)buf);
+		break;
+	case 4:
+		value = le32toh(*(const uint32_t *)buf);
+		break;
+	default:
+		value = le64toh(*(const uint64_t *)buf);
+		break;
+	}
+
+	reg = &map->desc->regs[idx - 1];
+	old = map->values[idx - 1];
+	value = (old & ~reg->write_mask) | (value & reg->write_mask);
+	map->values[idx - 1] = value;
+
+	if (reg->write)
+		reg->write(pcidev, reg, old, value);
+
+	return true;
+}
+
+static uint64_t *usfstl_pci_reg_value(struct usfstl_pci_device *pcidev,
+				      int bar, uint32_t offset)
+{
+	struct usfstl_pci_regmap *map;
+	unsigned int idx = 0;
+
+	USFSTL_ASSERT(bar >= 0 && bar < USFSTL_PCI_NUM_BARS);
+	map = pcidev->regmap[bar];
+	if (map && offset < map->desc->size)
+		idx = map->lookup[offset];
+
+	USFSTL_ASSERT(idx && map->desc->regs[idx - 1].offset == offset,
+		      "no register at BAR %d offset 0x%x", bar, offset);
+
+	return &map->values[idx - 1];
+}
+
+uint64_t usfstl_pci_reg_get(struct usfstl_pci_device *pcidev, int bar,
+			    uint32_t offset)
+{
+	return *usfstl_pci_reg_value(pcidev, bar, offset);
+}
+
+void usfstl_pci_reg_set(struct usfstl_pci_device *pcidev, int bar,
+			uint32_t offset, uint64_t value)
+{
+	*usfstl_pci_reg_value(pcidev, bar, offset) = value;
+}
+
+void usfstl_pci_regs_reset(struct usfstl_pci_device *pcidev)
+{
+	unsigned int bar, i;
+
+	for (bar = 0; bar < USFSTL_PCI_NUM_BARS; bar++) {
+		struct usfstl_pci_regmap *map = pcidev->regmap[bar];
+
+		if (!map)
+			continue;
+
+		for (i = 0; i < map->desc->n_regs; i++)
+			map->values[i] = map->desc->regs[i].reset;
+	}
+}
+
+static void _usfstl_pci_send_int(struct usfstl_pci_device *pcidev, int number)
+{
+	struct virtio_pcidev_msg msg = {
+		.op = VIRTIO_PCIDEV_OP_INT,
+		.addr = number,
+	};
+
+	usfstl_vhost_user_dev_notify(pcidev->dev, 1, (void *)&msg, sizeof(msg));
+}
+
+static void _usfstl_pci_send_msi(struct usfstl_pci_device *pcidev,
+				 uint64_t addr, bool msix, uint32_t data)
+{
+	struct {
+		struct virtio_pcidev_msg hdr;
+		uint8_t data[4]; // max size
+	} msg = {
+		.hdr = {
+			.op = VIRTIO_PCIDEV_OP_MSI,
+			.addr = addr,
+			.size = msix ? 4 : 2,
+		},
+	};
+
+	if (msix)
+		*(uint32_t *)msg.data = htole32(data);
+	else
+		*(uint16_t *)msg.data = htole16(data);
+
+	usfstl_vhost_user_dev_notify(pcidev->dev, 1, (void *)&msg, sizeof(msg));
+}
+
+/*
+ * Interrupt moderation state for a single vector, i.e. an INTx line
+ * (@intx != 0) or an MSI address/data combination.
+ */
+struct usfstl_pci_irq_vector {
 	struct usfstl_pci_device *pcidev;
+	int intx;
+	uint64_t addr;
+	uint32_t data;
+	bool msix;
 
-	pcidev = ops->connected();
-	USFSTL_ASSERT(pcidev);
-	dev->data = pcidev;
-	pcidev->dev = dev;
+	bool fired;
+	uint64_t last;
+	unsigned int pending;
+	struct usfstl_job job;
+};
 
-	USFSTL_ASSERT(ops->cfg_space_read ||
-		      ops->cfg_space_read_deferred ||
-		      (pcidev->config_space && pcidev->config_space_size));
-	USFSTL_ASSERT(ops->cfg_space_write ||
-		      ops->cfg_space_write_deferred ||
-		      (pcidev->config_space && pcidev->config_space_mask &&
-		       pcidev->config_space_size));
+static void usfstl_pci_irq_fire(struct usfstl_pci_irq_vector *vec)
+{
+	struct usfstl_pci_device *pcidev = vec->pcidev;
+
+	usfstl_sched_del_job(&vec->job);
+	vec->pending = 0;
+	vec->fired = true;
+	vec->last = usfstl_sched_current_time(pcidev->dev->server->scheduler);
+
+	if (vec->intx)
+		_usfstl_pci_send_int(pcidev, vec->intx);
+	else
+		_usfstl_pci_send_msi(pcidev, vec->addr, vec->msix, vec->data);
 }
 
-void usfstl_vhost_pci_cfg_read(struct usfstl_pci_device_ops *ops,
-			       struct usfstl_pci_device *pcidev,
-			       struct virtio_pcidev_msg *msg,
-			       struct usfstl_vhost_user_buf *buf)
+static void usfstl_pci_irq_job_callback(struct usfstl_job *job)
 {
-	void *out = buf->in_sg[0].iov_base;
+	usfstl_pci_irq_fire(job->data);
+}
 
-	if (!ops->cfg_space_read && !ops->cfg_space_read_deferred) {
-		if (msg->addr + msg->size > pcidev->config_space_size) {
-			memset(out, 0, msg->size);
-			return;
-		}
+static struct usfstl_pci_irq_vector *
+usfstl_pci_irq_vector(struct usfstl_pci_device *pcidev, int intx,
+		      uint64_t addr, bool msix, uint32_t data)
+{
+	struct usfstl_pci_irq_vector *vec, **vectors;
+	unsigned int i;
 
-		memcpy(out, (uint8_t *)pcidev->config_space + msg->addr,
-		       msg->size);
-		usfstl_pci_send_response(pcidev, buf);
-		return;
+	for (i = 0; i < pcidev->n_irq_vectors; i++) {
+		vec = pcidev->irq_vectors[i];
+
+		if (vec->intx == intx && vec->addr == addr &&
+		    vec->msix == msix && vec->data == data)
+			return vec;
 	}
 
-	if (ops->cfg_space_read_deferred) {
-		ops->cfg_space_read_deferred(pcidev, out,
-					     msg->addr, msg->size,
-					     buf);
-		return;
+	vectors = realloc(pcidev->irq_vectors,
+			  sizeof(*vectors) * (pcidev->n_irq_vectors + 1));
+	USFSTL_ASSERT(vectors);
+	pcidev->irq_vectors = vectors;
+
+	vec = calloc(1, sizeof(*vec));
+	USFSTL_ASSERT(vec);
+	vec->pcidev = pcidev;
+	vec->intx = intx;
+	vec->addr = addr;
+	vec->msix = msix;
+	vec->data = data;
+	vec->job.name = "pci-irq-moderation";
+	vec->job.data = vec;
+	vec->job.callback = usfstl_pci_irq_job_callback;
+
+	pcidev->irq_vectors[pcidev->n_irq_vectors++] = vec;
+
+	return vec;
+}
+
+/*
+ * Returns %true if the interrupt was sent or is held back (to be
+ * sent later), %false if it should be sent directly by the caller.
+ */
+static bool usfstl_pci_irq_moderate(struct usfstl_pci_device *pcidev,
+				    int intx, uint64_t addr, bool msix,
+				    uint32_t data)
+{
+	struct usfstl_pci_irq_moderation *mod = &pcidev->irq_moderation;
+	struct usfstl_scheduler *sched = pcidev->dev->server->scheduler;
+	struct usfstl_pci_irq_vector *vec;
+	uint64_t now;
+
+	if (!mod->min_interval || !sched)
+		return false;
+
+	vec = usfstl_pci_irq_vector(pcidev, intx, addr, msix, data);
+	now = usfstl_sched_current_time(sched);
+
+	if (!vec->pending &&
+	    (!vec->fired || now - vec->last >= mod->min_interval)) {
+		usfstl_pci_irq_fire(vec);
+		return true;
 	}
 
+	vec->pending++;
+
+	if (mod->max_count && vec->pending >= mod->max_count) {
+		usfstl_pci_irq_fire(vec);
+		return true;
+	}
+
+	if (!usfstl_job_scheduled(&vec->job)) {
+		vec->job.start = vec->last + mod->min_interval;
+		if (usfstl_time_cmp(vec->job.start, <, now))
+			vec->job.start = now;
+		usfstl_sched_add_job(sched, &vec->job);
+	}
+
+	return true;
+}
+
+static void usfstl_pci_irq_vectors_free(struct usfstl_pci_device *pcidev)
+{
+	unsigned int i;
+
+	for (i = 0; i < pcidev->n_irq_vectors; i++) {
+		usfstl_sched_del_job(&pcidev->irq_vectors[i]->job);
+		free(pcidev->irq_vectors[i]);
+	}
+
+	free(pcidev->irq_vectors);
+	pcidev->irq_vectors = NULL;
+	pcidev->n_irq_vectors = 0;
+}
+
+static void usfstl_vhost_pci_cfg_read_raw(struct usfstl_pci_device_ops *ops,
+					  struct usfstl_pci_device *pcidev,
+					  struct virtio_pcidev_msg *msg,
+					  struct usfstl_vhost_user_buf *buf)
+{
+	void *out = buf->in_sg[0].iov_base;
+
+	if (msg->addr + msg->size > pcidev->config_space_size)
+		memset(out, 0, msg->size);
+	else
+		memcpy(out, (uint8_t *)pcidev->config_space + msg->addr,
+		       msg->size);
+
+	usfstl_pci_send_response(pcidev, buf);
+}
+
+static void usfstl_vhost_pci_cfg_read_deferred(struct usfstl_pci_device_ops *ops,
+					       struct usfstl_pci_device *pcidev,
+					       struct virtio_pcidev_msg *msg,
+					       struct usfstl_vhost_user_buf *buf)
+{
+	ops->cfg_space_read_deferred(pcidev, buf->in_sg[0].iov_base,
+				     msg->addr, msg->size, buf);
+}
+
+static void usfstl_vhost_pci_cfg_read_cb(struct usfstl_pci_device_ops *ops,
+					 struct usfstl_pci_device *pcidev,
+					 struct virtio_pcidev_msg *msg,
+					 struct usfstl_vhost_user_buf *buf)
+{
+	void *out = buf->in_sg[0].iov_base;
+
 	switch (msg->size) {
 	case 1:
 		*(uint8_t *)out = ops->cfg_space_read(pcidev, msg->addr,
@@ -81,36 +421,70 @@ void usfstl_vhost_pci_cfg_read(struct usfstl_pci_device_ops *ops,
 	usfstl_pci_send_response(pcidev, buf);
 }
 
-void usfstl_vhost_pci_cfg_write(struct usfstl_pci_device_ops *ops,
-				struct usfstl_pci_device *pcidev,
-				struct virtio_pcidev_msg *msg,
-				struct usfstl_vhost_user_buf *buf)
+void usfstl_vhost_pci_cfg_read(struct usfstl_pci_device_ops *ops,
+			       struct usfstl_pci_device *pcidev,
+			       struct virtio_pcidev_msg *msg,
+			       struct usfstl_vhost_user_buf *buf)
 {
-	uint64_t value;
+	pcidev->cfg_read(ops, pcidev, msg, buf);
+}
 
-	if (!ops->cfg_space_write && !ops->cfg_space_write_deferred) {
-		const uint8_t *mask = pcidev->config_space_mask;
-		uint8_t *val = pcidev->config_space;
-		uint8_t *data = msg->data;
-		uint32_t i;
+#define CFG_MASKED_WRITE(bits)						\
+	while (size >= sizeof(uint##bits##_t)) {			\
+		uint##bits##_t v, m, d;					\
+									\
+		memcpy(&v, val, sizeof(v));				\
+		memcpy(&m, mask, sizeof(m));				\
+		memcpy(&d, data, sizeof(d));				\
+		v = (v & ~m) | (d & m);					\
+		memcpy(val, &v, sizeof(v));				\
+		val += sizeof(v);					\
+		mask += sizeof(m);					\
+		data += sizeof(d);					\
+		size -= sizeof(v);					\
+	}
 
-		if (msg->addr + msg->size > pcidev->config_space_size)
-			return;
+static void usfstl_vhost_pci_cfg_write_masked(struct usfstl_pci_device_ops *ops,
+					      struct usfstl_pci_device *pcidev,
+					      struct virtio_pcidev_msg *msg,
+					      struct usfstl_vhost_user_buf *buf)
+{
+	const uint8_t *mask = (const uint8_t *)pcidev->config_space_mask +
+			      msg->addr;
+	uint8_t *val = (uint8_t *)pcidev->config_space + msg->addr;
+	const uint8_t *data = msg->data;
+	uint32_t size = msg->size;
 
-		for (i = 0; i < msg->size; i++) {
-			val[msg->addr + i] &= ~mask[msg->addr + i];
-			val[msg->addr + i] |= data[i] & mask[msg->addr + i];
-		}
-		usfstl_pci_send_response(pcidev, buf);
-		return;
+	if (msg->addr + msg->size <= pcidev->config_space_size) {
+		/*
+		 * The byte order doesn't matter here since value, mask
+		 * and data are all in the same (little endian) order,
+		 * so just apply the mask in the largest chunks possible.
+		 */
+		CFG_MASKED_WRITE(64);
+		CFG_MASKED_WRITE(32);
+		CFG_MASKED_WRITE(16);
+		CFG_MASKED_WRITE(8);
 	}
 
-	if (ops->cfg_space_write_deferred) {
-		ops->cfg_space_write_deferred(pcidev, msg->addr,
-					      msg->data, msg->size,
-					      buf);
-		return;
-	}
+	usfstl_pci_send_response(pcidev, buf);
+}
+
+static void usfstl_vhost_pci_cfg_write_deferred(struct usfstl_pci_device_ops *ops,
+						struct usfstl_pci_device *pcidev,
+						struct virtio_pcidev_msg *msg,
+						struct usfstl_vhost_user_buf *buf)
+{
+	ops->cfg_space_write_deferred(pcidev, msg->addr, msg->data,
+				      msg->size, buf);
+}
+
+static void usfstl_vhost_pci_cfg_write_cb(struct usfstl_pci_device_ops *ops,
+					  struct usfstl_pci_device *pcidev,
+					  struct virtio_pcidev_msg *msg,
+					  struct usfstl_vhost_user_buf *buf)
+{
+	uint64_t value;
 
 	switch (msg->size) {
 	case 1:
@@ -134,6 +508,55 @@ void usfstl_vhost_pci_cfg_write(struct usfstl_pci_device_ops *ops,
 	usfstl_pci_send_response(pcidev, buf);
 }
 
+void usfstl_vhost_pci_cfg_write(struct usfstl_pci_device_ops *ops,
+				struct usfstl_pci_device *pcidev,
+				struct virtio_pcidev_msg *msg,
+				struct usfstl_vhost_user_buf *buf)
+{
+	pcidev->cfg_write(ops, pcidev, msg, buf);
+}
+
+void usfstl_vhost_pci_connected(struct usfstl_vhost_user_dev *dev)
+{
+	struct usfstl_pci_device_ops *ops = dev->server->data;
+	struct usfstl_pci_device *pcidev;
+	unsigned int bar;
+
+	pcidev = ops->connected();
+	USFSTL_ASSERT(pcidev);
+	dev->data = pcidev;
+	pcidev->dev = dev;
+
+	for (bar = 0; bar < USFSTL_PCI_NUM_BARS; bar++) {
+		if (pcidev->bar_regs[bar])
+			pcidev->regmap[bar] =
+				usfstl_pci_regmap_alloc(pcidev->bar_regs[bar]);
+	}
+
+	USFSTL_ASSERT(ops->cfg_space_read ||
+		      ops->cfg_space_read_deferred ||
+		      (pcidev->config_space && pcidev->config_space_size));
+	USFSTL_ASSERT(ops->cfg_space_write ||
+		      ops->cfg_space_write_deferred ||
+		      (pcidev->config_space && pcidev->config_space_mask &&
+		       pcidev->config_space_size));
+
+	/* decide once how config space accesses are handled */
+	if (ops->cfg_space_read_deferred)
+		pcidev->cfg_read = usfstl_vhost_pci_cfg_read_deferred;
+	else if (ops->cfg_space_read)
+		pcidev->cfg_read = usfstl_vhost_pci_cfg_read_cb;
+	else
+		pcidev->cfg_read = usfstl_vhost_pci_cfg_read_raw;
+
+	if (ops->cfg_space_write_deferred)
+		pcidev->cfg_write = usfstl_vhost_pci_cfg_write_deferred;
+	else if (ops->cfg_space_write)
+		pcidev->cfg_write = usfstl_vhost_pci_cfg_write_cb;
+	else
+		pcidev->cfg_write = usfstl_vhost_pci_cfg_write_masked;
+}
+
 static void usfstl_vhost_pci_handle(struct usfstl_vhost_user_dev *dev,
 				    struct usfstl_vhost_user_buf *buf,
 				    unsigned int vring)
@@ -157,7 +580,16 @@ static void usfstl_vhost_pci_handle(struct usfstl_vhost_user_dev *dev,
 	case VIRTIO_PCIDEV_OP_MMIO_READ:
 		USFSTL_ASSERT(buf->in_sg[0].iov_len >= msg->size);
 		memset(buf->in_sg[0].iov_base, 0xff, msg->size);
-		USFSTL_ASSERT(ops->mmio_read || ops->mmio_read_deferred);
+		USFSTL_ASSERT(msg->bar < USFSTL_PCI_NUM_BARS);
+		if (usfstl_pci_regmap_read(pcidev, msg->bar,
+					   buf->in_sg[0].iov_base,
+					   msg->addr, msg->size)) {
+			usfstl_pci_send_response(pcidev, buf);
+			break;
+		}
+		USFSTL_ASSERT(ops->mmio_read || ops->mmio_read_deferred,
+			      "unhandled MMIO read at BAR %d offset 0x%" PRIx64,
+			      msg->bar, (uint64_t)msg->addr);
 		if (ops->mmio_read) {
 			ops->mmio_read(pcidev, msg->bar, buf->in_sg[0].iov_base,
 				       msg->addr, msg->size);
@@ -177,7 +609,15 @@ static void usfstl_vhost_pci_handle(struct usfstl_vhost_user_dev *dev,
 			write_buf = buf->out_sg[1].iov_base;
 			USFSTL_ASSERT(buf->out_sg[1].iov_len >= msg->size);
 		}
-		USFSTL_ASSERT(ops->mmio_write || ops->mmio_write_deferred);
+		USFSTL_ASSERT(msg->bar < USFSTL_PCI_NUM_BARS);
+		if (usfstl_pci_regmap_write(pcidev, msg->bar, write_buf,
+					    msg->addr, msg->size)) {
+			usfstl_pci_send_response(pcidev, buf);
+			break;
+		}
+		USFSTL_ASSERT(ops->mmio_write || ops->mmio_write_deferred,
+			      "unhandled MMIO write at BAR %d offset 0x%" PRIx64,
+			      msg->bar, (uint64_t)msg->addr);
 		if (ops->mmio_write) {
 			ops->mmio_write(pcidev, msg->bar, msg->addr,
 					write_buf, msg->size);
@@ -211,8 +651,16 @@ static void usfstl_vhost_pci_handle(struct usfstl_vhost_user_dev *dev,
 void usfstl_vhost_pci_disconnected(struct usfstl_vhost_user_dev *dev)
 {
 	struct usfstl_pci_device_ops *ops = dev->server->data;
+	struct usfstl_pci_device *pcidev = dev->data;
+	unsigned int bar;
 
-	ops->disconnected(dev->data);
+	for (bar = 0; bar < USFSTL_PCI_NUM_BARS; bar++) {
+		free(pcidev->regmap[bar]);
+		pcidev->regmap[bar] = NULL;
+	}
+	usfstl_pci_irq_vectors_free(pcidev);
+
+	ops->disconnected(pcidev);
 }
 
 const struct usfstl_vhost_user_ops usfstl_vhost_user_ops_pci = {
@@ -223,36 +671,21 @@ const struct usfstl_vhost_user_ops usfstl_vhost_user_ops_pci = {
 
 void usfstl_pci_send_int(struct usfstl_pci_device *pcidev, int number)
 {
-	struct virtio_pcidev_msg msg = {
-		.op = VIRTIO_PCIDEV_OP_INT,
-		.addr = number,
-	};
-
 	USFSTL_ASSERT(number >= 1 && number <= 4);
 
-	usfstl_vhost_user_dev_notify(pcidev->dev, 1, (void *)&msg, sizeof(msg));
+	if (usfstl_pci_irq_moderate(pcidev, number, 0, false, 0))
+		return;
+
+	_usfstl_pci_send_int(pcidev, number);
 }
 
 void usfstl_pci_send_msi(struct usfstl_pci_device *pcidev,
 			 uint64_t addr, bool msix, uint32_t data)
 {
-	struct {
-		struct virtio_pcidev_msg hdr;
-		uint8_t data[4]; // max size
-	} msg = {
-		.hdr = {
-			.op = VIRTIO_PCIDEV_OP_MSI,
-			.addr = addr,
-			.size = msix ? 4 : 2,
-		},
-	};
-
-	if (msix)
-		*(uint32_t *)msg.data = htole32(data);
-	else
-		*(uint16_t *)msg.data = htole16(data);
+	if (usfstl_pci_irq_moderate(pcidev, 0, addr, msix, data))
+		return;
 
-	usfstl_vhost_user_dev_notify(pcidev->dev, 1, (void *)&msg, sizeof(msg));
+	_usfstl_pci_send_msi(pcidev, addr, msix, data);
 }
 
 void usfstl_pci_send_pme(struct usfstl_pci_device *pcidev)
@@ -263,3 +696,110 @@ void usfstl_pci_send_pme(struct usfstl_pci_device *pcidev)
 
 	usfstl_vhost_user_dev_notify(pcidev->dev, 1, (void *)&msg, sizeof(msg));
 }
+
+void *usfstl_pci_dma_map(struct usfstl_pci_device *pcidev,
+			 uint64_t physaddr, size_t size)
+{
+	size_t len = size;
+	void *va;
+
+	va = usfstl_vhost_user_to_va_len(pcidev->dev, physaddr, &len);
+	if (!va || len < size)
+		return NULL;
+
+	return va;
+}
+
+unsigned int usfstl_pci_dma_map_sg(struct usfstl_pci_device *pcidev,
+				   const struct usfstl_pci_dma_sg *sg,
+				   unsigned int n_sg,
+				   struct iovec *iov, unsigned int max_iov)
+{
+	unsigned int i, n_iov = 0;
+
+	for (i = 0; i < n_sg; i++) {
+		uint64_t addr = sg[i].addr;
+		size_t rem = sg[i].len;
+
+		while (rem) {
+			size_t len = rem;
+			void *va;
+
+			USFSTL_ASSERT(n_iov < max_iov,
+				      "DMA scatter-gather list needs more than %u entries",
+				      max_iov);
+
+			va = usfstl_vhost_user_to_va_len(pcidev->dev, addr,
+							 &len);
+			USFSTL_ASSERT(va, "cannot translate DMA address %" PRIx64,
+				      addr);
+
+			/* merge with the previous entry if contiguous */
+			if (n_iov &&
+			    (uint8_t *)iov[n_iov - 1].iov_base +
+					iov[n_iov - 1].iov_len == va) {
+				iov[n_iov - 1].iov_len += len;
+			} else {
+				iov[n_iov].iov_base = va;
+				iov[n_iov].iov_len = len;
+				n_iov++;
+			}
+
+			addr += len;
+			rem -= len;
+		}
+	}
+
+	return n_iov;
+}
+
+#define DMA_SG_STACK_IOV	16
+
+static size_t usfstl_pci_dma_sg(struct usfstl_pci_device *pcidev,
+				const struct usfstl_pci_dma_sg *sg,
+				unsigned int n_sg,
+				void *buf, size_t size, bool write)
+{
+	struct iovec iov[DMA_SG_STACK_IOV];
+	size_t done = 0;
+
+	/* translate in chunks so we don't have to allocate */
+	while (n_sg && done < size) {
+		unsigned int n = n_sg, n_iov;
+		size_t ret;
+
+		/* each entry can be split at most into MAX_REGIONS iovecs */
+		if (n > DMA_SG_STACK_IOV / MAX_REGIONS)
+			n = DMA_SG_STACK_IOV / MAX_REGIONS;
+
+		n_iov = usfstl_pci_dma_map_sg(pcidev, sg, n, iov,
+					      DMA_SG_STACK_IOV);
+		if (write)
+			ret = iov_fill(iov, n_iov, (uint8_t *)buf + done,
+				       size - done);
+		else
+			ret = iov_read((uint8_t *)buf + done, size - done,
+				       iov, n_iov);
+		done += ret;
+		sg += n;
+		n_sg -= n;
+	}
+
+	return done;
+}
+
+size_t usfstl_pci_dma_read_sg(struct usfstl_pci_device *pcidev,
+			      void *buf, size_t size,
+			      const struct usfstl_pci_dma_sg *sg,
+			      unsigned int n_sg)
+{
+	return usfstl_pci_dma_sg(pcidev, sg, n_sg, buf, size, false);
+}
+
+size_t usfstl_pci_dma_write_sg(struct usfstl_pci_device *pcidev,
+			       const struct usfstl_pci_dma_sg *sg,
+			       unsigned int n_sg,
+			       const void *buf, size_t size)
+{
+	return usfstl_pci_dma_sg(pcidev, sg, n_sg, (void *)buf, size, true);
+}
@@ -9,6 +9,9 @@
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#ifndef _WIN32
+#include <stdio_ext.h>
+#endif
 #include <usfstl/log.h>
 #include <usfstl/multi.h>
 #include "print-rpc.h"
@@ -211,17 +214,30 @@ static void usfstl_log_flush_if_needed(struct usfstl_logger *logger)
 	fflush(logger->f);
 }
 
+static void usfstl_flush_pending(FILE *f)
+{
+#ifndef _WIN32
+	/*
+	 * This is called for every RPC call/response, so don't even
+	 * take the stream lock if there's nothing buffered.
+	 */
+	if (!__fpending(f))
+		return;
+#endif
+	fflush(f);
+}
+
 void usfstl_flush_all(void)
 {
 	int i;
 
-	fflush(stdout);
-	fflush(stderr);
+	usfstl_flush_pending(stdout);
+	usfstl_flush_pending(stderr);
 
 	for (i = 0; i < g_usfstl_loggers_num; i++) {
 		if (!g_usfstl_loggers[i])
 			continue;
-		fflush(g_usfstl_loggers[i]->f);
+		usfstl_flush_pending(g_usfstl_loggers[i]->f);
 	}
 }
 
@@ -24,6 +24,10 @@ extern char __stop_usfstl_norestore[];
 static struct usfstl_restore_info *USFSTL_NORESTORE_VAR(g_usfstl_restore_info);
 static void *USFSTL_NORESTORE_VAR(g_usfstl_restore_data);
 
+// ranges that are no longer restored, even if they contain globals
+static struct usfstl_restore_info *USFSTL_NORESTORE_VAR(g_usfstl_restore_excluded);
+static unsigned int USFSTL_NORESTORE_VAR(g_usfstl_restore_n_excluded);
+
 static inline bool should_restore(uintptr_t _ptr)
 {
 	char *ptr = (char *)_ptr;
@@ -131,6 +135,32 @@ void *usfstl_save_restore_data(struct usfstl_restore_info *info)
 #endif
 }
 
+#if !defined(USFSTL_FUZZER_AFL_GCC) && !defined(USFSTL_FUZZER_AFL_CLANG_FAST)
+static void usfstl_restore_range(unsigned char *ptr,
+				 const unsigned char *data, uintptr_t size)
+{
+	unsigned int i;
+
+	for (i = 0; i < g_usfstl_restore_n_excluded; i++) {
+		unsigned char *start = (void *)g_usfstl_restore_excluded[i].ptr;
+		unsigned char *end = start + g_usfstl_restore_excluded[i].size;
+
+		if (end <= ptr || start >= ptr + size)
+			continue;
+
+		// restore what's before and after the excluded range
+		if (start > ptr)
+			usfstl_restore_range(ptr, data, start - ptr);
+		if (end < ptr + size)
+			usfstl_restore_range(end, data + (end - ptr),
+					     ptr + size - end);
+		return;
+	}
+
+	memcpy(ptr, data, size);
+}
+#endif
+
 void usfstl_restore_data(struct usfstl_restore_info *info, const void *_data)
 {
 #if defined(USFSTL_FUZZER_AFL_GCC) || defined(USFSTL_FUZZER_AFL_CLANG_FAST)
@@ -140,13 +170,28 @@ void usfstl_restore_data(struct usfstl_restore_info *info, const void *_data)
 	const unsigned char *data = _data;
 
 	while (iter->ptr || iter->size) {
-		memcpy((void *)(uintptr_t)iter->ptr, data, iter->size);
+		usfstl_restore_range((void *)(uintptr_t)iter->ptr, data,
+				     iter->size);
 		data += iter->size;
 		iter++;
 	}
 #endif
 }
 
+void usfstl_restore_exclude(const void *ptr, size_t size)
+{
+	struct usfstl_restore_info *excluded;
+
+	excluded = realloc(g_usfstl_restore_excluded,
+			   (g_usfstl_restore_n_excluded + 1) * sizeof(*excluded));
+	USFSTL_ASSERT(excluded);
+
+	excluded[g_usfstl_restore_n_excluded].ptr = (uintptr_t)ptr;
+	excluded[g_usfstl_restore_n_excluded].size = size;
+	g_usfstl_restore_excluded = excluded;
+	g_usfstl_restore_n_excluded++;
+}
+
 void usfstl_save_globals(const char *program)
 {
 	char globals_file[1000];
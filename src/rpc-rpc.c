@@ -28,6 +28,14 @@ USFSTL_RPC_VAR_METHOD_VAR(struct usfstl_rpc_init, rpc_init,
 	out->extra_len = conn->extra_len;
 }
 
+USFSTL_RPC_VOID_METHOD_P(rpc_shm_init, struct usfstl_rpc_shm_init)
+{
+	// the memory fd follows the response, see usfstl_rpc_handle_one()
+	conn->shm_size = in->ring_size;
+	conn->shm_bulk_size = in->bulk_size;
+	conn->shm_accept = 1;
+}
+
 USFSTL_RPC_VOID_METHOD(rpc_disconnect, uint32_t /* ignored */)
 {
 	conn->broken = 1;
@@ -12,6 +12,11 @@
 struct usfstl_rpc_init {
 	uint32_t extra_len;
 } __attribute__((packed));
+
+struct usfstl_rpc_shm_init {
+	uint32_t ring_size;
+	uint32_t bulk_size;
+} __attribute__((packed));
 #endif // __USFSTL_RPC_RPC_H
 
 // declare functions outside ifdefs, needed for code generation
@@ -21,3 +26,4 @@ struct usfstl_rpc_init {
 USFSTL_RPC_VAR_METHOD_VAR(struct usfstl_rpc_init, rpc_init,
 			  struct usfstl_rpc_init);
 USFSTL_RPC_VOID_METHOD(rpc_disconnect, uint32_t /* ignored */);
+USFSTL_RPC_VOID_METHOD_P(rpc_shm_init, struct usfstl_rpc_shm_init);
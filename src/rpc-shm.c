@@ -0,0 +1,417 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Shared memory transport for RPC connections.
+ *
+ * After the connection is initialized, the side that has shm_size set
+ * asks the peer to switch (see rpc_shm_init in rpc-rpc.c) and then sends
+ * a memfd over the socket that holds one ring for each direction. From
+ * then on all RPC data goes through the rings. The loop checks the ring
+ * before waiting (see rpc_shm_pending()), so a message that's already
+ * there is handled without any system call. Only if the ring was empty
+ * does the reader set a flag in it before waiting for the socket, and
+ * the writer then sends a single "doorbell" byte over the socket to wake
+ * it up; one per wait, not per message.
+ *
+ * If a message doesn't fit into the ring, the writer waits for space
+ * (and the reader for more data) using futexes on the ring indices.
+ *
+ * If shm_bulk_size is also set, the memory additionally holds a bulk
+ * area for each direction. Large arguments and return buffers of calls
+ * are placed there by the caller, only their offset is sent along with
+ * the request and the callee works on the data in place. Calls nest, so
+ * the space is simply allocated and released in stack order.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <usfstl/rpc.h>
+#include "internal.h"
+
+#define USFSTL_RPC_SHM_MIN_RING	4096
+
+struct usfstl_rpc_shm_ring {
+	/* free-running indices, written by the producer/consumer only */
+	uint32_t head, tail;
+	/* set by a side that's waiting in futex on head/tail */
+	uint32_t head_waiters, tail_waiters;
+	/* set by the consumer before it waits for the doorbell */
+	uint32_t sleeping;
+	unsigned char data[] __attribute__((aligned(64)));
+};
+
+struct usfstl_rpc_shm {
+	void *mem;
+	size_t mem_size;
+	uint32_t ring_size;
+	struct usfstl_rpc_shm_ring *tx, *rx;
+	/* we allocate from tx_bulk, the peer from rx_bulk */
+	unsigned char *tx_bulk, *rx_bulk;
+	uint32_t bulk_size, bulk_used;
+	/* we set rx->sleeping and haven't yet seen if the peer rang */
+	bool sleeping;
+};
+
+static bool usfstl_rpc_shm_loop_pending(struct usfstl_loop_entry *entry)
+{
+	struct usfstl_rpc_connection *conn;
+
+	conn = container_of(entry, struct usfstl_rpc_connection, conn);
+
+	return rpc_shm_pending(conn);
+}
+
+static uint32_t usfstl_rpc_shm_ring_size(uint32_t size)
+{
+	uint32_t ring_size = USFSTL_RPC_SHM_MIN_RING;
+
+	while (ring_size < size) {
+		USFSTL_ASSERT(ring_size < 0x80000000);
+		ring_size <<= 1;
+	}
+
+	return ring_size;
+}
+
+static uint32_t usfstl_rpc_shm_bulk_size(uint32_t size)
+{
+	return (size + 63) & ~63;
+}
+
+static size_t usfstl_rpc_shm_mem_size(struct usfstl_rpc_connection *conn)
+{
+	uint32_t ring_size = usfstl_rpc_shm_ring_size(conn->shm_size);
+
+	return 2 * (sizeof(struct usfstl_rpc_shm_ring) + ring_size) +
+	       2 * (size_t)usfstl_rpc_shm_bulk_size(conn->shm_bulk_size);
+}
+
+static void usfstl_rpc_shm_map(struct usfstl_rpc_connection *conn, int fd,
+			       bool initiator)
+{
+	struct usfstl_rpc_shm *shm;
+	struct usfstl_rpc_shm_ring *rings[2];
+	unsigned char *bulk[2];
+
+	shm = calloc(1, sizeof(*shm));
+	USFSTL_ASSERT(shm);
+
+	shm->ring_size = usfstl_rpc_shm_ring_size(conn->shm_size);
+	shm->bulk_size = usfstl_rpc_shm_bulk_size(conn->shm_bulk_size);
+	shm->mem_size = usfstl_rpc_shm_mem_size(conn);
+	shm->mem = mmap(NULL, shm->mem_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	USFSTL_ASSERT(shm->mem != MAP_FAILED);
+	close(fd);
+
+	rings[0] = shm->mem;
+	rings[1] = (void *)(rings[0]->data + shm->ring_size);
+	bulk[0] = rings[1]->data + shm->ring_size;
+	bulk[1] = bulk[0] + shm->bulk_size;
+
+	shm->tx = rings[!initiator];
+	shm->rx = rings[initiator];
+	shm->tx_bulk = bulk[!initiator];
+	shm->rx_bulk = bulk[initiator];
+	conn->shm = shm;
+	conn->conn.pending = usfstl_rpc_shm_loop_pending;
+}
+
+void rpc_shm_connect(struct usfstl_rpc_connection *conn)
+{
+	char dummy = 0;
+	struct iovec iov = {
+		.iov_base = &dummy,
+		.iov_len = sizeof(dummy),
+	};
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control = {};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *cmsg;
+	int fd;
+
+	fd = memfd_create("usfstl-rpc", MFD_CLOEXEC);
+	USFSTL_ASSERT(fd >= 0);
+	USFSTL_ASSERT_EQ(ftruncate(fd, usfstl_rpc_shm_mem_size(conn)), 0, "%d");
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	USFSTL_ASSERT_EQ((int)sendmsg(conn->conn.fd, &msg, 0),
+			 (int)sizeof(dummy), "%d");
+
+	usfstl_rpc_shm_map(conn, fd, true);
+}
+
+void rpc_shm_accept(struct usfstl_rpc_connection *conn)
+{
+	char dummy;
+	struct iovec iov = {
+		.iov_base = &dummy,
+		.iov_len = sizeof(dummy),
+	};
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *cmsg;
+	struct stat st;
+	int fd;
+
+	USFSTL_ASSERT_EQ((int)recvmsg(conn->conn.fd, &msg, MSG_CMSG_CLOEXEC),
+			 (int)sizeof(dummy), "%d");
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	USFSTL_ASSERT(cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+		      cmsg->cmsg_type == SCM_RIGHTS &&
+		      cmsg->cmsg_len == CMSG_LEN(sizeof(int)),
+		      "RPC peer didn't send shared memory fd");
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+	USFSTL_ASSERT_EQ(fstat(fd, &st), 0, "%d");
+	USFSTL_ASSERT_EQ((size_t)st.st_size, usfstl_rpc_shm_mem_size(conn), "%zu");
+
+	usfstl_rpc_shm_map(conn, fd, false);
+}
+
+void rpc_shm_free(struct usfstl_rpc_connection *conn)
+{
+	struct usfstl_rpc_shm *shm = conn->shm;
+
+	if (!shm)
+		return;
+
+	munmap(shm->mem, shm->mem_size);
+	free(shm);
+	conn->shm = NULL;
+	conn->conn.pending = NULL;
+}
+
+static void usfstl_rpc_shm_wait(struct usfstl_rpc_connection *conn,
+				uint32_t *word, uint32_t *waiters,
+				uint32_t seen)
+{
+	struct timespec timeout = { .tv_sec = 1 };
+	struct pollfd pfd = {
+		.fd = conn->conn.fd,
+	};
+
+	__atomic_store_n(waiters, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(word, __ATOMIC_SEQ_CST) != seen)
+		return;
+
+	if (syscall(SYS_futex, word, FUTEX_WAIT, seen, &timeout, NULL, 0) == 0)
+		return;
+
+	// don't wait forever if the peer died
+	USFSTL_ASSERT(poll(&pfd, 1, 0) >= 0);
+	USFSTL_ASSERT(!(pfd.revents & (POLLHUP | POLLERR)),
+		      "RPC peer %s disconnected", conn->name ?: "");
+}
+
+static void usfstl_rpc_shm_wake(uint32_t *word, uint32_t *waiters)
+{
+	if (!__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+		return;
+
+	if (__atomic_exchange_n(waiters, 0, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// ring the doorbell if the reader is (about to start) waiting for it
+static void usfstl_rpc_shm_ring(struct usfstl_rpc_connection *conn)
+{
+	static const char doorbell;
+	struct usfstl_rpc_shm_ring *ring = conn->shm->tx;
+
+	if (!__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST))
+		return;
+
+	// whoever clears the flag is responsible for the byte
+	if (__atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST))
+		rpc_write(conn->conn.fd, &doorbell, sizeof(doorbell));
+}
+
+void rpc_shm_writev(struct usfstl_rpc_connection *conn, unsigned int n,
+		    const struct write_vector *vectors)
+{
+	struct usfstl_rpc_shm *shm = conn->shm;
+	struct usfstl_rpc_shm_ring *ring = shm->tx;
+	uint32_t mask = shm->ring_size - 1;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		const unsigned char *data = vectors[i].data;
+		size_t len = vectors[i].len;
+
+		while (len) {
+			uint32_t head = ring->head;
+			uint32_t tail = __atomic_load_n(&ring->tail,
+							__ATOMIC_SEQ_CST);
+			uint32_t chunk = shm->ring_size - (head - tail);
+
+			if (!chunk) {
+				// let the reader start on what's there
+				usfstl_rpc_shm_ring(conn);
+				usfstl_rpc_shm_wait(conn, &ring->tail,
+						    &ring->tail_waiters, tail);
+				continue;
+			}
+
+			if (chunk > len)
+				chunk = len;
+			if (chunk > shm->ring_size - (head & mask))
+				chunk = shm->ring_size - (head & mask);
+
+			memcpy(ring->data + (head & mask), data, chunk);
+			__atomic_store_n(&ring->head, head + chunk,
+					 __ATOMIC_SEQ_CST);
+			usfstl_rpc_shm_wake(&ring->head, &ring->head_waiters);
+
+			data += chunk;
+			len -= chunk;
+		}
+	}
+
+	usfstl_rpc_shm_ring(conn);
+}
+
+void rpc_shm_read(struct usfstl_rpc_connection *conn, void *buf, size_t len)
+{
+	struct usfstl_rpc_shm *shm = conn->shm;
+	struct usfstl_rpc_shm_ring *ring = shm->rx;
+	uint32_t mask = shm->ring_size - 1;
+	unsigned char *data = buf;
+
+	while (len) {
+		uint32_t tail = ring->tail;
+		uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+		uint32_t chunk = head - tail;
+
+		if (!chunk) {
+			usfstl_rpc_shm_wait(conn, &ring->head,
+					    &ring->head_waiters, head);
+			continue;
+		}
+
+		if (chunk > len)
+			chunk = len;
+		if (chunk > shm->ring_size - (tail & mask))
+			chunk = shm->ring_size - (tail & mask);
+
+		memcpy(data, ring->data + (tail & mask), chunk);
+		__atomic_store_n(&ring->tail, tail + chunk, __ATOMIC_SEQ_CST);
+		usfstl_rpc_shm_wake(&ring->tail, &ring->tail_waiters);
+
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+void rpc_shm_readv(struct usfstl_rpc_connection *conn, unsigned int n,
+		   const struct read_vector *vectors)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		rpc_shm_read(conn, vectors[i].data, vectors[i].len);
+}
+
+// check if a message is there, otherwise ask for the doorbell
+bool rpc_shm_pending(struct usfstl_rpc_connection *conn)
+{
+	struct usfstl_rpc_shm *shm = conn->shm;
+	struct usfstl_rpc_shm_ring *ring = shm->rx;
+
+	if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail)
+		return true;
+
+	if (!shm->sleeping) {
+		shm->sleeping = true;
+		__atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+	}
+
+	// the writer may have added the message before seeing the flag
+	return __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail;
+}
+
+void rpc_shm_wait_msg(struct usfstl_rpc_connection *conn)
+{
+	struct usfstl_rpc_shm *shm = conn->shm;
+	char doorbell;
+
+	if (!shm->sleeping)
+		return;
+
+	// if the writer cleared the flag, it sent (or is sending) the byte
+	shm->sleeping = false;
+	if (!__atomic_exchange_n(&shm->rx->sleeping, 0, __ATOMIC_SEQ_CST))
+		rpc_read(conn->conn.fd, &doorbell, sizeof(doorbell));
+}
+
+void *rpc_shm_bulk_alloc(struct usfstl_rpc_connection *conn, uint32_t size,
+			 uint32_t *offset)
+{
+	struct usfstl_rpc_shm *shm = conn->shm;
+	uint32_t aligned = (size + 7) & ~7;
+
+	if (!shm || shm->bulk_size - shm->bulk_used < aligned)
+		return NULL;
+
+	*offset = shm->bulk_used;
+	shm->bulk_used += aligned;
+
+	return shm->tx_bulk + *offset;
+}
+
+uint32_t rpc_shm_bulk_mark(struct usfstl_rpc_connection *conn)
+{
+	return conn->shm ? conn->shm->bulk_used : 0;
+}
+
+void rpc_shm_bulk_release(struct usfstl_rpc_connection *conn, uint32_t mark)
+{
+	if (conn->shm)
+		conn->shm->bulk_used = mark;
+}
+
+void *rpc_shm_bulk_peer(struct usfstl_rpc_connection *conn, uint32_t offset,
+			uint32_t size)
+{
+	struct usfstl_rpc_shm *shm = conn->shm;
+
+	USFSTL_ASSERT(shm && offset <= shm->bulk_size &&
+		      size <= shm->bulk_size - offset,
+		      "invalid RPC bulk data %u/%u", offset, size);
+
+	return shm->rx_bulk + offset;
+}
@@ -13,6 +13,7 @@
 #include <usfstl/test.h>
 #include <usfstl/rpc.h>
 #include <usfstl/list.h>
+#include <usfstl/uthash.h>
 #include "internal.h"
 #include "rpc-rpc.h"
 #ifdef _WIN32
@@ -32,8 +33,13 @@ struct usfstl_rpc_connection *USFSTL_NORESTORE_VAR(g_usfstl_rpc_default_connecti
 	USFSTL_RPC_LOCAL;
 static struct usfstl_list USFSTL_NORESTORE_VAR(g_usfstl_rpc_connections) =
 	USFSTL_LIST_INIT(g_usfstl_rpc_connections);
+static struct usfstl_list USFSTL_NORESTORE_VAR(g_usfstl_rpc_oneway_pending) =
+	USFSTL_LIST_INIT(g_usfstl_rpc_oneway_pending);
 static uint32_t g_usfstl_rpc_wait_result;
 
+#define USFSTL_RPC_ONEWAY_QUEUE_SIZE	4096
+#define USFSTL_RPC_BATCH_ALIGN(x)	(((x) + 7) & ~7)
+
 // put a dummies into the sections to guarantee they're emitted
 static const struct usfstl_rpc_stub * const dummy __attribute__((section("usfstl_rpc"), used)) =
 	NULL;
@@ -42,6 +48,104 @@ static const unsigned int stub_fill __attribute__((section("usfstl_rpcstub"), us
 extern struct usfstl_rpc_stub *__start_usfstl_rpc[];
 extern struct usfstl_rpc_stub *__stop_usfstl_rpc;
 
+/*
+ * Transport helpers, data goes through the shared memory rings if
+ * they were set up, otherwise through the socket.
+ */
+static void usfstl_rpc_read_tag(struct usfstl_rpc_connection *conn,
+				uint32_t *tag)
+{
+#ifndef _WIN32
+	if (conn->shm) {
+		rpc_shm_wait_msg(conn);
+		rpc_shm_read(conn, tag, sizeof(*tag));
+		return;
+	}
+#endif
+	rpc_read(conn->conn.fd, tag, sizeof(*tag));
+}
+
+static void usfstl_rpc_read(struct usfstl_rpc_connection *conn,
+			    void *buf, size_t len)
+{
+#ifndef _WIN32
+	if (conn->shm) {
+		rpc_shm_read(conn, buf, len);
+		return;
+	}
+#endif
+	rpc_read(conn->conn.fd, buf, len);
+}
+
+static void usfstl_rpc_readv(struct usfstl_rpc_connection *conn,
+			     unsigned int n, const struct read_vector *vectors)
+{
+#ifndef _WIN32
+	if (conn->shm) {
+		rpc_shm_readv(conn, n, vectors);
+		return;
+	}
+#endif
+	rpc_readv(conn->conn.fd, n, vectors);
+}
+
+static void usfstl_rpc_writev(struct usfstl_rpc_connection *conn,
+			      unsigned int n, const struct write_vector *vectors)
+{
+#ifndef _WIN32
+	if (conn->shm) {
+		rpc_shm_writev(conn, n, vectors);
+		return;
+	}
+#endif
+	rpc_writev(conn->conn.fd, n, vectors);
+}
+
+static void usfstl_rpc_flush_conn(struct usfstl_rpc_connection *conn)
+{
+	struct write_vector vector = {
+		.data = conn->oneway_buf,
+		.len = conn->oneway_len,
+	};
+
+	if (!conn->oneway_len)
+		return;
+
+	usfstl_list_item_remove(&conn->oneway_entry);
+	usfstl_rpc_writev(conn, 1, &vector);
+	conn->oneway_len = 0;
+}
+
+void usfstl_rpc_flush(void)
+{
+	while (!usfstl_list_empty(&g_usfstl_rpc_oneway_pending)) {
+		struct usfstl_rpc_connection *conn;
+
+		conn = usfstl_list_first_item(&g_usfstl_rpc_oneway_pending,
+					      struct usfstl_rpc_connection,
+					      oneway_entry);
+		usfstl_rpc_flush_conn(conn);
+	}
+}
+
+/*
+ * Before writing a request to the connection, take its queued one-way
+ * calls to be written along with it. That's only possible if no other
+ * connection has calls queued, since some of those may have been made
+ * before and must go out first; if so, just flush everything in order.
+ */
+static void usfstl_rpc_take_oneway(struct usfstl_rpc_connection *conn)
+{
+	if (conn->oneway_len &&
+	    conn->oneway_entry.prev == &g_usfstl_rpc_oneway_pending.list &&
+	    conn->oneway_entry.next == &g_usfstl_rpc_oneway_pending.list) {
+		usfstl_list_item_remove(&conn->oneway_entry);
+		return;
+	}
+
+	usfstl_rpc_flush();
+}
+
 static void _usfstl_rpc_send_response(struct usfstl_rpc_connection *conn,
 				      int status, const void *ret,
 				      uint32_t retsize)
@@ -57,8 +161,9 @@ static void _usfstl_rpc_send_response(struct usfstl_rpc_connection *conn,
 	};
 
 	usfstl_flush_all();
+	usfstl_rpc_flush();
 
-	rpc_writev(conn->conn.fd, 3, vector);
+	usfstl_rpc_writev(conn, 3, vector);
 
 	g_usfstl_rpc_stack_num--;
 }
@@ -101,10 +206,33 @@ static void usfstl_rpc_make_call(struct usfstl_rpc_connection *conn,
 struct usfstl_rpc_connection *
 USFSTL_NORESTORE_VAR(g_usfstl_rpc_stack[USFSTL_MAX_RPC_STACK]);
 unsigned int USFSTL_NORESTORE_VAR(g_usfstl_rpc_stack_num);
+// whether the call on the stack is one-way, i.e. no response will pop it
+static bool USFSTL_NORESTORE_VAR(g_usfstl_rpc_stack_oneway[USFSTL_MAX_RPC_STACK]);
+
+void usfstl_rpc_abort_oneway_calls(void)
+{
+	unsigned int i, num = 0;
+
+	/*
+	 * A one-way handler that aborted the test never returned to
+	 * usfstl_rpc_handle_call(), so drop its stack entry here. Other
+	 * calls stay, their response may still be sent out-of-band.
+	 */
+	for (i = 0; i < g_usfstl_rpc_stack_num; i++) {
+		if (g_usfstl_rpc_stack_oneway[i])
+			continue;
+		g_usfstl_rpc_stack[num] = g_usfstl_rpc_stack[i];
+		g_usfstl_rpc_stack_oneway[num] = false;
+		num++;
+	}
+	g_usfstl_rpc_stack_num = num;
+}
 
 static void usfstl_rpc_handle_call(struct usfstl_rpc_connection *conn,
 				   struct usfstl_rpc_stub *stub,
-				   uint32_t argsize, uint32_t retsize)
+				   uint32_t argsize, uint32_t retsize,
+				   const void *shared_arg, void *shared_ret,
+				   bool oneway)
 {
 	unsigned char arg[argsize <= USFSTL_MAX_RPC_SIZE_ON_STACK ? argsize : 0]
 		__attribute__((aligned(sizeof(uint64_t))));
@@ -112,21 +240,28 @@ static void usfstl_rpc_handle_call(struct usfstl_rpc_connection *conn,
 		__attribute__((aligned(sizeof(uint64_t))));
 	unsigned char *argbuf = NULL, *retbuf = NULL;
 
-	if (sizeof(arg) < argsize) {
+	if (!shared_arg && sizeof(arg) < argsize) {
 		argbuf = malloc(argsize);
 		USFSTL_ASSERT(argbuf);
 	}
 
-	if (sizeof(ret) < retsize) {
+	if (!shared_ret && sizeof(ret) < retsize) {
 		retbuf = malloc(retsize);
 		USFSTL_ASSERT(retbuf);
 	}
 
-	rpc_read(conn->conn.fd, argbuf ?: arg, argsize);
+	if (!shared_arg)
+		usfstl_rpc_read(conn, argbuf ?: arg, argsize);
 
-	usfstl_rpc_make_call(conn, stub, argbuf ?: arg, argsize, retbuf ?: ret, retsize);
+	usfstl_rpc_make_call(conn, stub, shared_arg ?: argbuf ?: arg, argsize,
+			     shared_ret ?: retbuf ?: ret, retsize);
 
-	_usfstl_rpc_send_response(conn, 0, retbuf ?: ret, retsize);
+	if (oneway)
+		g_usfstl_rpc_stack_num--;
+	else if (shared_ret)
+		_usfstl_rpc_send_response(conn, 0, NULL, 0);
+	else
+		_usfstl_rpc_send_response(conn, 0, retbuf ?: ret, retsize);
 
 	if (argbuf)
 		free(argbuf);
@@ -134,55 +269,111 @@ static void usfstl_rpc_handle_call(struct usfstl_rpc_connection *conn,
 		free(retbuf);
 }
 
-static struct usfstl_rpc_stub *
-usfstl_rpc_find_stub(struct usfstl_rpc_request *hdr)
+static bool usfstl_rpc_stub_matches(struct usfstl_rpc_stub *stub,
+				    struct usfstl_rpc_request *hdr)
 {
 	uint32_t argsize = hdr->argsize & ~USFSTL_VAR_DATA_SIZE;
 	uint32_t retsize = hdr->retsize & ~USFSTL_VAR_DATA_SIZE;
+
+	if ((hdr->argsize & USFSTL_VAR_DATA_SIZE) !=
+			(stub->req.argsize & USFSTL_VAR_DATA_SIZE))
+		return false;
+	if (hdr->argsize & USFSTL_VAR_DATA_SIZE) {
+		if (argsize < (stub->req.argsize & ~USFSTL_VAR_DATA_SIZE))
+			return false;
+	} else {
+		if (argsize != stub->req.argsize)
+			return false;
+	}
+
+	if ((hdr->retsize & USFSTL_VAR_DATA_SIZE) !=
+			(stub->req.retsize & USFSTL_VAR_DATA_SIZE))
+		return false;
+	if (hdr->retsize & USFSTL_VAR_DATA_SIZE) {
+		if (retsize < (stub->req.retsize & ~USFSTL_VAR_DATA_SIZE))
+			return false;
+	} else {
+		if (retsize != stub->req.retsize)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * The stubs are const and live in the linker section, so index them
+ * through a separate array of entries that's built on first lookup.
+ * Stubs sharing a name (e.g. old versions with different sizes) are
+ * chained off the entry that's in the hash table.
+ */
+struct usfstl_rpc_stub_entry {
+	struct usfstl_rpc_stub *stub;
+	struct usfstl_rpc_stub_entry *next;
+	UT_hash_handle hh;
+};
+
+static struct usfstl_rpc_stub_entry *USFSTL_NORESTORE_VAR(g_usfstl_rpc_stubs);
+static bool USFSTL_NORESTORE_VAR(g_usfstl_rpc_stubs_indexed);
+
+static void usfstl_rpc_build_stub_index(void)
+{
+	unsigned int n_stubs = &__stop_usfstl_rpc - __start_usfstl_rpc;
+	struct usfstl_rpc_stub_entry *entries;
 	uint32_t fnidx;
 
-	// Note: if this turns out to be slow, we can optimise it
-	// on the first round into a binary tree or something...
-	// But we'll probably only have a handful of entry points.
-	for (fnidx = 0; &__start_usfstl_rpc[fnidx] < &__stop_usfstl_rpc; fnidx++) {
+	g_usfstl_rpc_stubs_indexed = true;
+
+	entries = calloc(n_stubs, sizeof(*entries));
+	USFSTL_ASSERT(entries);
+
+	for (fnidx = 0; fnidx < n_stubs; fnidx++) {
 		struct usfstl_rpc_stub *stub = __start_usfstl_rpc[fnidx];
+		struct usfstl_rpc_stub_entry *entry = &entries[fnidx];
+		struct usfstl_rpc_stub_entry *prev;
+		size_t len;
 
 		if (!stub)
 			continue;
 
-		if (memcmp(&stub->req.name, hdr->name, sizeof(hdr->name)))
-			continue;
+		len = strnlen(stub->req.name, sizeof(stub->req.name));
+		entry->stub = stub;
 
-		if ((hdr->argsize & USFSTL_VAR_DATA_SIZE) !=
-				(stub->req.argsize & USFSTL_VAR_DATA_SIZE))
+		HASH_FIND(hh, g_usfstl_rpc_stubs, stub->req.name, len, prev);
+		if (prev) {
+			while (prev->next)
+				prev = prev->next;
+			prev->next = entry;
 			continue;
-		if (hdr->argsize & USFSTL_VAR_DATA_SIZE) {
-			if (argsize < (stub->req.argsize & ~USFSTL_VAR_DATA_SIZE))
-				continue;
-		} else {
-			if (argsize != stub->req.argsize)
-				continue;
 		}
 
-		if ((hdr->retsize & USFSTL_VAR_DATA_SIZE) !=
-				(stub->req.retsize & USFSTL_VAR_DATA_SIZE))
-			continue;
-		if (hdr->retsize & USFSTL_VAR_DATA_SIZE) {
-			if (retsize < (stub->req.retsize & ~USFSTL_VAR_DATA_SIZE))
-				continue;
-		} else {
-			if (retsize != stub->req.retsize)
-				continue;
-		}
+		HASH_ADD_KEYPTR(hh, g_usfstl_rpc_stubs, stub->req.name, len,
+				entry);
+	}
+}
+
+static struct usfstl_rpc_stub *
+usfstl_rpc_find_stub(struct usfstl_rpc_request *hdr)
+{
+	struct usfstl_rpc_stub_entry *entry;
+
+	if (!g_usfstl_rpc_stubs_indexed)
+		usfstl_rpc_build_stub_index();
 
-		return stub;
+	HASH_FIND(hh, g_usfstl_rpc_stubs, hdr->name,
+		  strnlen(hdr->name, sizeof(hdr->name)), entry);
+
+	for (; entry; entry = entry->next) {
+		if (usfstl_rpc_stub_matches(entry->stub, hdr))
+			return entry->stub;
 	}
 
 	return NULL;
 }
 
 static void usfstl_rpc_handle_one_call(struct usfstl_rpc_connection *conn,
-				       struct usfstl_rpc_request *hdr)
+				       struct usfstl_rpc_request *hdr,
+				       const void *shared_arg, void *shared_ret,
+				       bool oneway)
 {
 	struct usfstl_rpc_stub *stub;
 	uint32_t argsize = hdr->argsize & ~USFSTL_VAR_DATA_SIZE;
@@ -190,21 +381,107 @@ static void usfstl_rpc_handle_one_call(struct usfstl_rpc_connection *conn,
 
 	USFSTL_ASSERT(g_usfstl_rpc_stack_num < USFSTL_MAX_RPC_STACK);
 	g_usfstl_rpc_stack[g_usfstl_rpc_stack_num] = conn;
+	g_usfstl_rpc_stack_oneway[g_usfstl_rpc_stack_num] = oneway;
 	g_usfstl_rpc_stack_num++;
 
 	stub = usfstl_rpc_find_stub(hdr);
 	if (stub) {
-		usfstl_rpc_handle_call(conn, stub, argsize, retsize);
+		usfstl_rpc_handle_call(conn, stub, argsize, retsize,
+				       shared_arg, shared_ret, oneway);
 		return;
 	}
 
+	// nobody to report the error to
+	USFSTL_ASSERT(!oneway, "usfstl one-way RPC call to %.*s failed",
+		      (int)sizeof(hdr->name), hdr->name);
+
 	_usfstl_rpc_send_response(conn, -ENOENT, NULL, 0);
 }
 
+static void usfstl_rpc_handle_batch(struct usfstl_rpc_connection *conn,
+				    bool swap)
+{
+	struct usfstl_rpc_batch batch;
+	struct usfstl_rpc_batch_response *resp;
+	unsigned char buf[conn->extra_len];
+	struct read_vector vector[] = {
+		{ .data = &batch, .len = sizeof(batch) },
+		{ .data = buf, .len = conn->extra_len },
+	};
+	unsigned char *calls, *pos, *ret;
+	uint32_t i, retlen = 0;
+	int status = 0;
+
+	usfstl_rpc_readv(conn, 2, vector);
+
+	if (swap) {
+		batch.calls = swap32(batch.calls);
+		batch.len = swap32(batch.len);
+	}
+
+	calls = malloc(batch.len);
+	USFSTL_ASSERT(calls);
+	usfstl_rpc_read(conn, calls, batch.len);
+
+	// fix up the headers and check that it all fits
+	for (i = 0, pos = calls; i < batch.calls; i++) {
+		struct usfstl_rpc_request *hdr = (void *)pos;
+
+		USFSTL_ASSERT(pos + sizeof(*hdr) <= calls + batch.len);
+		if (swap) {
+			hdr->retsize = swap32(hdr->retsize);
+			hdr->argsize = swap32(hdr->argsize);
+		}
+		pos += sizeof(*hdr) +
+		       USFSTL_RPC_BATCH_ALIGN(hdr->argsize & ~USFSTL_VAR_DATA_SIZE);
+		USFSTL_ASSERT(pos <= calls + batch.len);
+		retlen += USFSTL_RPC_BATCH_ALIGN(hdr->retsize & ~USFSTL_VAR_DATA_SIZE);
+	}
+
+	resp = calloc(1, sizeof(*resp) + retlen);
+	USFSTL_ASSERT(resp);
+	ret = (void *)(resp + 1);
+
+	if (conn->extra_len)
+		conn->extra_received(conn, buf);
+
+	USFSTL_ASSERT(g_usfstl_rpc_stack_num < USFSTL_MAX_RPC_STACK);
+	g_usfstl_rpc_stack[g_usfstl_rpc_stack_num] = conn;
+	g_usfstl_rpc_stack_oneway[g_usfstl_rpc_stack_num] = false;
+	g_usfstl_rpc_stack_num++;
+
+	for (i = 0, pos = calls; i < batch.calls; i++) {
+		struct usfstl_rpc_request *hdr = (void *)pos;
+		uint32_t argsize = hdr->argsize & ~USFSTL_VAR_DATA_SIZE;
+		uint32_t retsize = hdr->retsize & ~USFSTL_VAR_DATA_SIZE;
+		struct usfstl_rpc_stub *stub;
+
+		stub = usfstl_rpc_find_stub(hdr);
+		if (!stub) {
+			status = -ENOENT;
+			break;
+		}
+
+		usfstl_rpc_make_call(conn, stub, hdr + 1, argsize,
+				     ret + resp->len, retsize);
+
+		pos += sizeof(*hdr) + USFSTL_RPC_BATCH_ALIGN(argsize);
+		resp->len += USFSTL_RPC_BATCH_ALIGN(retsize);
+	}
+	resp->done = i;
+
+	_usfstl_rpc_send_response(conn, status, resp,
+				  sizeof(*resp) + resp->len);
+
+	free(resp);
+	free(calls);
+}
+
 static uint32_t usfstl_rpc_handle_one(struct usfstl_rpc_connection *conn)
 {
 	struct usfstl_rpc_request hdr;
-	bool swap = false;
+	bool swap = false, oneway = false;
+	void *shared_arg = NULL, *shared_ret = NULL;
 	uint32_t tag;
 	unsigned char buf[conn->extra_len];
 	struct read_vector vector[] = {
@@ -212,7 +489,7 @@ static uint32_t usfstl_rpc_handle_one(struct usfstl_rpc_connection *conn)
 		{ .data = buf, .len = conn->extra_len },
 	};
 
-	rpc_read(conn->conn.fd, &tag, sizeof(tag));
+	usfstl_rpc_read_tag(conn, &tag);
 
 	switch (tag) {
 	case USFSTL_RPC_TAG_REQUEST:
@@ -220,6 +497,19 @@ static uint32_t usfstl_rpc_handle_one(struct usfstl_rpc_connection *conn)
 	case __swap32(USFSTL_RPC_TAG_REQUEST):
 		swap = true;
 		break;
+	case USFSTL_RPC_TAG_ONEWAY:
+		oneway = true;
+		break;
+	case __swap32(USFSTL_RPC_TAG_ONEWAY):
+		oneway = true;
+		swap = true;
+		break;
+	case USFSTL_RPC_TAG_BATCH:
+		usfstl_rpc_handle_batch(conn, false);
+		return 0;
+	case __swap32(USFSTL_RPC_TAG_BATCH):
+		usfstl_rpc_handle_batch(conn, true);
+		return 0;
 	case USFSTL_RPC_TAG_RESPONSE:
 	case __swap32(USFSTL_RPC_TAG_RESPONSE):
 		return tag;
@@ -227,17 +517,53 @@ static uint32_t usfstl_rpc_handle_one(struct usfstl_rpc_connection *conn)
 		assert(0);
 	}
 
-	rpc_readv(conn->conn.fd, 2, vector);
+	usfstl_rpc_readv(conn, 2, vector);
 
 	if (swap) {
 		hdr.retsize = swap32(hdr.retsize);
 		hdr.argsize = swap32(hdr.argsize);
 	}
 
+#ifndef _WIN32
+	// offsets of argument/return data in the shared memory follow
+	if ((hdr.argsize | hdr.retsize) & USFSTL_SHARED_DATA) {
+		uint32_t offs[2];
+		unsigned int n = 0;
+
+		usfstl_rpc_read(conn, offs,
+				(!!(hdr.argsize & USFSTL_SHARED_DATA) +
+				 !!(hdr.retsize & USFSTL_SHARED_DATA)) *
+				sizeof(offs[0]));
+
+		if (hdr.argsize & USFSTL_SHARED_DATA) {
+			hdr.argsize &= ~USFSTL_SHARED_DATA;
+			shared_arg = rpc_shm_bulk_peer(conn,
+						       swap ? swap32(offs[n]) : offs[n],
+						       hdr.argsize & ~USFSTL_VAR_DATA_SIZE);
+			n++;
+		}
+
+		if (hdr.retsize & USFSTL_SHARED_DATA) {
+			hdr.retsize &= ~USFSTL_SHARED_DATA;
+			shared_ret = rpc_shm_bulk_peer(conn,
+						       swap ? swap32(offs[n]) : offs[n],
+						       hdr.retsize & ~USFSTL_VAR_DATA_SIZE);
+		}
+	}
+#endif
+
 	if (conn->extra_len)
 		conn->extra_received(conn, buf);
 
-	usfstl_rpc_handle_one_call(conn, &hdr);
+	usfstl_rpc_handle_one_call(conn, &hdr, shared_arg, shared_ret, oneway);
+
+#ifndef _WIN32
+	// the peer sends the shared memory after our rpc_shm_init response
+	if (conn->shm_accept) {
+		conn->shm_accept = 0;
+		rpc_shm_accept(conn);
+	}
+#endif
 	return 0;
 }
 
@@ -249,6 +575,18 @@ static void usfstl_rpc_initialize(struct usfstl_rpc_connection *conn)
 
 	conn->initialized = 1;
 	rpc_init_conn(conn, &init, sizeof(init), &init, sizeof(init));
+
+#ifndef _WIN32
+	if (conn->shm_size && conn != USFSTL_RPC_LOCAL && !conn->shm) {
+		struct usfstl_rpc_shm_init shm_init = {
+			.ring_size = conn->shm_size,
+			.bulk_size = conn->shm_bulk_size,
+		};
+
+		rpc_shm_init_conn(conn, &shm_init);
+		rpc_shm_connect(conn);
+	}
+#endif
 }
 
 static void usfstl_rpc_loop_handler(struct usfstl_loop_entry *entry)
@@ -287,6 +625,23 @@ void usfstl_rpc_del_connection_raw(struct usfstl_rpc_connection *conn)
 {
 	usfstl_loop_unregister(&conn->conn);
 	usfstl_list_item_remove(&conn->entry);
+
+	// the peer is gone (or going), drop anything still queued
+	if (conn->oneway_len)
+		usfstl_list_item_remove(&conn->oneway_entry);
+	free(conn->oneway_buf);
+	conn->oneway_buf = NULL;
+	conn->oneway_len = 0;
+	conn->oneway_size = 0;
+	free(conn->batch_buf);
+	conn->batch_buf = NULL;
+	conn->batch_len = 0;
+	conn->batch_size = 0;
+	conn->batch_calls = 0;
+
+#ifndef _WIN32
+	rpc_shm_free(conn);
+#endif
 }
 
 void usfstl_rpc_del_connection(struct usfstl_rpc_connection *conn)
@@ -310,6 +665,8 @@ static uint32_t usfstl_rpc_wait_and_handle(struct usfstl_rpc_connection *wait)
 		 */
 		g_usfstl_rpc_wait_result = 0;
 
+		usfstl_rpc_flush();
+
 		if (wait) {
 			wait_registered = wait->conn.list.next;
 			if (wait_registered)
@@ -351,6 +708,131 @@ static uint32_t usfstl_wait_for_response(struct usfstl_rpc_connection *conn)
 	return usfstl_rpc_wait_and_handle(conn);
 }
 
+static bool usfstl_rpc_batching(struct usfstl_rpc_connection *conn)
+{
+	// calls made while handling nested calls aren't batched
+	return conn->batch_depth &&
+	       conn->batch_level == g_usfstl_rpc_stack_num;
+}
+
+static void usfstl_rpc_batch_add(struct usfstl_rpc_connection *conn,
+				 const struct usfstl_rpc_request *req,
+				 const void *arg, uint32_t argsize)
+{
+	uint32_t len = sizeof(*req) + USFSTL_RPC_BATCH_ALIGN(argsize);
+	unsigned char *pos;
+
+	if (conn->batch_size - conn->batch_len < len) {
+		conn->batch_size = conn->batch_size * 2 ?:
+				   USFSTL_RPC_ONEWAY_QUEUE_SIZE;
+		if (conn->batch_size < conn->batch_len + len)
+			conn->batch_size = conn->batch_len + len;
+		conn->batch_buf = realloc(conn->batch_buf, conn->batch_size);
+		USFSTL_ASSERT(conn->batch_buf);
+	}
+
+	pos = conn->batch_buf + conn->batch_len;
+	memcpy(pos, req, sizeof(*req));
+	pos += sizeof(*req);
+	memcpy(pos, arg, argsize);
+	memset(pos + argsize, 0, USFSTL_RPC_BATCH_ALIGN(argsize) - argsize);
+
+	conn->batch_len += len;
+	conn->batch_calls++;
+}
+
+static void usfstl_rpc_batch_failed(struct usfstl_rpc_connection *conn,
+				    uint32_t idx, uint32_t error)
+{
+	struct usfstl_rpc_request *hdr = (void *)conn->batch_buf;
+	uint32_t i;
+
+	for (i = 0; i < idx; i++) {
+		uint32_t argsize = hdr->argsize & ~USFSTL_VAR_DATA_SIZE;
+
+		hdr = (void *)((unsigned char *)(hdr + 1) +
+			       USFSTL_RPC_BATCH_ALIGN(argsize));
+	}
+
+	fprintf(stderr, "usfstl RPC call to %.*s failed, errno %d\n",
+		(int)sizeof(hdr->name), hdr->name, error);
+	assert(0);
+}
+
+/*
+ * Send the batched calls and wait for them to complete; only the last
+ * one can have a return value (ret/retsize), any call with a return
+ * value ends up here immediately.
+ */
+static void usfstl_rpc_batch_send(struct usfstl_rpc_connection *conn,
+				  void *ret, uint32_t retsize)
+{
+	struct usfstl_rpc_batch batch = {
+		.calls = conn->batch_calls,
+		.len = conn->batch_len,
+	};
+	struct usfstl_rpc_response resp;
+	struct usfstl_rpc_batch_response batch_resp;
+	uint32_t tag = USFSTL_RPC_TAG_BATCH;
+	unsigned char buf[conn->extra_len];
+	uint64_t pad;
+	struct write_vector vector[] = {
+		{ /* queued one-way calls, filled in below */ },
+		{ .data = &tag, .len = sizeof(tag) },
+		{ .data = &batch, .len = sizeof(batch) },
+		{ .data = buf, .len = conn->extra_len },
+		{ .data = conn->batch_buf, .len = conn->batch_len },
+	};
+	struct read_vector resp_vector[] = {
+		{ .data = &resp, .len = sizeof(resp) },
+		{ .data = &batch_resp, .len = sizeof(batch_resp) },
+	};
+
+	if (!batch.calls)
+		return;
+
+	usfstl_flush_all();
+
+	if (conn->extra_len) {
+		memset(&buf, 0, sizeof(buf));
+		conn->extra_transmit(conn, buf);
+	}
+
+	// write the batch, along with our own queued one-way calls
+	usfstl_rpc_take_oneway(conn);
+	vector[0].data = conn->oneway_buf;
+	vector[0].len = conn->oneway_len;
+	usfstl_rpc_writev(conn, 5, vector);
+	conn->oneway_len = 0;
+
+	tag = usfstl_wait_for_response(conn);
+
+	usfstl_rpc_readv(conn, 2, resp_vector);
+
+	if (tag == swap32(USFSTL_RPC_TAG_RESPONSE)) {
+		resp.error = swap32(resp.error);
+		batch_resp.done = swap32(batch_resp.done);
+		batch_resp.len = swap32(batch_resp.len);
+	}
+
+	USFSTL_ASSERT(batch_resp.done <= batch.calls);
+
+	// read return value, only the last call can have one
+	if (batch_resp.len) {
+		USFSTL_ASSERT(batch_resp.done == batch.calls &&
+			      batch_resp.len == USFSTL_RPC_BATCH_ALIGN(retsize));
+		usfstl_rpc_read(conn, ret, retsize);
+		if (batch_resp.len > retsize)
+			usfstl_rpc_read(conn, &pad, batch_resp.len - retsize);
+	}
+
+	conn->batch_len = 0;
+	conn->batch_calls = 0;
+
+	if (resp.error)
+		usfstl_rpc_batch_failed(conn, batch_resp.done, resp.error);
+}
+
 void usfstl_rpc_call(struct usfstl_rpc_connection *conn, const char *name,
 		     const void *arg, uint32_t argmin, uint32_t argsize,
 		     void *ret, uint32_t retmin, uint32_t retsize)
@@ -363,10 +845,17 @@ void usfstl_rpc_call(struct usfstl_rpc_connection *conn, const char *name,
 	uint32_t tag = USFSTL_RPC_TAG_REQUEST;
 	uint32_t argsize_masked = (argsize & ~USFSTL_VAR_DATA_SIZE) ?: argmin;
 	unsigned char buf[conn->extra_len];
+	uint32_t shared[2];
+#ifndef _WIN32
+	uint32_t n_shared = 0, shared_mark;
+#endif
+	void *shared_ret = NULL;
 	struct write_vector vector[] = {
+		{ /* queued one-way calls, filled in below */ },
 		{ .data = &tag, .len = sizeof(tag) },
 		{ .data = &req, .len = sizeof(req) },
 		{ .data = buf, .len = conn->extra_len },
+		{ .data = shared, .len = 0 },
 		{ .data = arg, .len = argsize_masked },
 	};
 
@@ -399,6 +888,13 @@ void usfstl_rpc_call(struct usfstl_rpc_connection *conn, const char *name,
 		return;
 	}
 
+	if (usfstl_rpc_batching(conn)) {
+		usfstl_rpc_batch_add(conn, &req, arg, argsize_masked);
+		if (retsize)
+			usfstl_rpc_batch_send(conn, ret, retsize);
+		return;
+	}
+
 	usfstl_flush_all();
 
 	if (conn->extra_len) {
@@ -406,13 +902,47 @@ void usfstl_rpc_call(struct usfstl_rpc_connection *conn, const char *name,
 		conn->extra_transmit(conn, buf);
 	}
 
-	// write request
-	rpc_writev(conn->conn.fd, 4, vector);
+#ifndef _WIN32
+	/*
+	 * Pass large data through the bulk area of the shared memory,
+	 * if there's one and it has space; the callee then works on it
+	 * in place and we only send the offset(s).
+	 */
+	shared_mark = rpc_shm_bulk_mark(conn);
+	if (argsize_masked > USFSTL_MAX_RPC_SIZE_ON_STACK) {
+		void *shared_arg = rpc_shm_bulk_alloc(conn, argsize_masked,
+						      &shared[n_shared]);
+
+		if (shared_arg) {
+			memcpy(shared_arg, arg, argsize_masked);
+			req.argsize |= USFSTL_SHARED_DATA;
+			vector[5].len = 0;
+			n_shared++;
+		}
+	}
+
+	if (retsize > USFSTL_MAX_RPC_SIZE_ON_STACK) {
+		shared_ret = rpc_shm_bulk_alloc(conn, retsize,
+						&shared[n_shared]);
+		if (shared_ret) {
+			req.retsize |= USFSTL_SHARED_DATA;
+			n_shared++;
+		}
+	}
+	vector[4].len = n_shared * sizeof(shared[0]);
+#endif
+
+	// write request, along with our own queued one-way calls
+	usfstl_rpc_take_oneway(conn);
+	vector[0].data = conn->oneway_buf;
+	vector[0].len = conn->oneway_len;
+	usfstl_rpc_writev(conn, 6, vector);
+	conn->oneway_len = 0;
 
 	tag = usfstl_wait_for_response(conn);
 
 	// read response status
-	rpc_read(conn->conn.fd, &resp, sizeof(resp));
+	usfstl_rpc_read(conn, &resp, sizeof(resp));
 
 	if (tag == swap32(USFSTL_RPC_TAG_RESPONSE))
 		resp.error = swap32(resp.error);
@@ -424,5 +954,102 @@ void usfstl_rpc_call(struct usfstl_rpc_connection *conn, const char *name,
 	}
 
 	// read return value
-	rpc_read(conn->conn.fd, ret, retsize);
+	if (shared_ret)
+		memcpy(ret, shared_ret, retsize);
+	else
+		usfstl_rpc_read(conn, ret, retsize);
+
+#ifndef _WIN32
+	rpc_shm_bulk_release(conn, shared_mark);
+#endif
+}
+
+void usfstl_rpc_call_oneway(struct usfstl_rpc_connection *conn,
+			    const char *name, const void *arg,
+			    uint32_t argsize)
+{
+	struct usfstl_rpc_request req = {
+		.argsize = argsize,
+	};
+	uint32_t tag = USFSTL_RPC_TAG_ONEWAY;
+	uint32_t argsize_masked = argsize & ~USFSTL_VAR_DATA_SIZE;
+	uint32_t len = sizeof(tag) + sizeof(req) + conn->extra_len +
+		       argsize_masked;
+	unsigned char *pos;
+
+	// a batch is sent as a whole anyway
+	if (conn == USFSTL_RPC_LOCAL || usfstl_rpc_batching(conn)) {
+		usfstl_rpc_call(conn, name, arg, argsize_masked,
+				argsize & USFSTL_VAR_DATA_SIZE ? argsize : 0,
+				NULL, 0, 0);
+		return;
+	}
+
+	if (!conn->initialized)
+		usfstl_rpc_initialize(conn);
+
+	assert(!conn->broken);
+
+	strcpy(req.name, name);
+
+	/*
+	 * Flush everything rather than just this connection when the
+	 * queue is full, so the order across connections is kept.
+	 */
+	if (conn->oneway_size - conn->oneway_len < len) {
+		usfstl_rpc_flush();
+
+		if (conn->oneway_size < len) {
+			conn->oneway_size = len > USFSTL_RPC_ONEWAY_QUEUE_SIZE ?
+					    len : USFSTL_RPC_ONEWAY_QUEUE_SIZE;
+			conn->oneway_buf = realloc(conn->oneway_buf,
+						   conn->oneway_size);
+			USFSTL_ASSERT(conn->oneway_buf);
+		}
+	}
+
+	if (!conn->oneway_len)
+		usfstl_list_append(&g_usfstl_rpc_oneway_pending,
+				   &conn->oneway_entry);
+
+	pos = conn->oneway_buf + conn->oneway_len;
+	memcpy(pos, &tag, sizeof(tag));
+	pos += sizeof(tag);
+	memcpy(pos, &req, sizeof(req));
+	pos += sizeof(req);
+	if (conn->extra_len) {
+		memset(pos, 0, conn->extra_len);
+		conn->extra_transmit(conn, pos);
+		pos += conn->extra_len;
+	}
+	memcpy(pos, arg, argsize_masked);
+
+	conn->oneway_len += len;
+}
+
+void usfstl_rpc_batch_start(struct usfstl_rpc_connection *conn)
+{
+	if (!conn)
+		conn = g_usfstl_rpc_default_connection;
+
+	if (conn == USFSTL_RPC_LOCAL)
+		return;
+
+	if (!conn->batch_depth++)
+		conn->batch_level = g_usfstl_rpc_stack_num;
+}
+
+void usfstl_rpc_batch_end(struct usfstl_rpc_connection *conn)
+{
+	if (!conn)
+		conn = g_usfstl_rpc_default_connection;
+
+	if (conn == USFSTL_RPC_LOCAL)
+		return;
+
+	USFSTL_ASSERT(conn->batch_depth);
+	if (--conn->batch_depth)
+		return;
+
+	usfstl_rpc_batch_send(conn, NULL, 0);
 }
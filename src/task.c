@@ -179,6 +179,23 @@ struct usfstl_task *usfstl_task_main(void)
 	return usfstl_ctx_get_data(ctx);
 }
 
+struct usfstl_task *usfstl_task_create_sized(const char *name, uint8_t group,
+					     size_t stack_size,
+					     void (*fn)(struct usfstl_task *task,
+							void *data),
+					     void (*free)(struct usfstl_task *task,
+							  void *data),
+					     void *data)
+{
+	struct usfstl_task *task = usfstl_task_alloc(fn, free, data);
+
+	task->ctx = usfstl_ctx_create_sized(name, stack_size, usfstl_task_ctx_fn,
+					    usfstl_task_ctx_free, task);
+	task->job.group = group;
+
+	return task;
+}
+
 struct usfstl_task *usfstl_task_create(const char *name, uint8_t group,
 				       void (*fn)(struct usfstl_task *task,
 						  void *data),
@@ -186,13 +203,7 @@ struct usfstl_task *usfstl_task_create(const char *name, uint8_t group,
 						    void *data),
 				       void *data)
 {
-	struct usfstl_task *task = usfstl_task_alloc(fn, free, data);
-
-	task->ctx = usfstl_ctx_create(name, usfstl_task_ctx_fn,
-				      usfstl_task_ctx_free, task);
-	task->job.group = group;
-
-	return task;
+	return usfstl_task_create_sized(name, group, 0, fn, free, data);
 }
 
 struct usfstl_task *usfstl_task_current(void)
@@ -51,6 +51,7 @@ void usfstl_out_of_time(void *rip)
 
 void usfstl_complete_abort(void)
 {
+	usfstl_rpc_abort_oneway_calls();
 	longjmp(g_usfstl_jmp_buf, g_usfstl_failure_reason);
 }
 
@@ -39,7 +39,7 @@ void usfstl_uds_accept_handler(struct usfstl_loop_entry *entry)
 void usfstl_uds_create(const char *path, void (*connected)(int, void *),
 		       void *data)
 {
-	struct usfstl_uds_server *uds = malloc(sizeof(*uds) + strlen(path) + 1);
+	struct usfstl_uds_server *uds = calloc(1, sizeof(*uds) + strlen(path) + 1);
 	struct stat buf;
 	int ret = stat(path, &buf), fd;
 	struct sockaddr_un un = {
@@ -10,8 +10,11 @@
 #include <sys/socket.h>
 #include <sys/mman.h>
 #include <sys/un.h>
+#include <sys/eventfd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
+#include <usfstl/opt.h>
 #include <usfstl/vhost.h>
 #include <linux/virtio_ring.h>
 #include <linux/virtio_config.h>
@@ -20,7 +23,43 @@
 #define MAX_REGIONS 2
 #define SG_STACK_PREALLOC 5
 
+struct usfstl_vhost_user_dev_int;
+
+static bool g_usfstl_vhost_user_stats;
+USFSTL_OPT_FLAG("vhost-user-stats", 0, g_usfstl_vhost_user_stats,
+		"Print per-virtqueue vhost-user statistics on disconnect/exit");
+
+static USFSTL_LIST(g_usfstl_vhost_user_devs);
+static bool g_usfstl_vhost_user_stats_atexit;
+
+/*
+ * Worker for a single virtqueue of a single device, see the
+ * documentation of worker_queues in struct usfstl_vhost_user_server.
+ * Buffers are taken off the ring and returned to it only on the
+ * simulation thread, the worker thread only calls the handle()
+ * method for each buffer of the batch it was given.
+ */
+struct usfstl_vhost_user_worker {
+	struct usfstl_vhost_user_dev_int *dev;
+	unsigned int virtq_idx;
+	pthread_t thread;
+
+	/* protects the fields up to (and including) stop */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int n_bufs, n_handled;
+	bool stop;
+
+	/* simulation thread only */
+	struct usfstl_vhost_user_buf **bufs;
+	unsigned int max_bufs;
+	bool pending;
+	struct usfstl_job job;
+	struct usfstl_loop_entry entry;
+};
+
 struct usfstl_vhost_user_dev_int {
+	struct usfstl_list_entry list;
 	struct usfstl_list fds;
 	struct usfstl_job irq_job;
 
@@ -34,6 +73,12 @@ struct usfstl_vhost_user_dev_int {
 	void *region_vaddr[MAX_REGIONS];
 
 	int req_fd;
+	struct usfstl_loop_entry req_entry;
+	struct usfstl_job ack_job;
+	unsigned int acks_pending;
+
+	/* config space data received from the driver */
+	uint8_t *config_buf;
 
 	struct {
 		struct usfstl_loop_entry entry;
@@ -42,6 +87,9 @@ struct usfstl_vhost_user_dev_int {
 		struct vring virtq;
 		int call_fd;
 		uint16_t last_avail_idx;
+		struct usfstl_vhost_user_worker *worker;
+		uint64_t kick_time;
+		struct usfstl_vhost_user_virtq_stats stats;
 	} virtqs[];
 };
 
@@ -67,6 +115,13 @@ CONV(16)
 CONV(32)
 CONV(64)
 
+static uint64_t usfstl_vhost_user_now(struct usfstl_vhost_user_dev_int *dev)
+{
+	if (!dev->ext.server->scheduler)
+		return 0;
+	return usfstl_sched_current_time(dev->ext.server->scheduler);
+}
+
 static bool usfstl_vhost_user_virtq_empty(struct usfstl_vhost_user_dev_int *dev,
 					  unsigned int virtq_idx)
 {
@@ -86,7 +141,9 @@ usfstl_vhost_user_get_virtq_buf(struct usfstl_vhost_user_dev_int *dev,
 	uint16_t avail_idx = virtio_to_cpu16(dev, virtq->avail->idx);
 	uint16_t idx, desc_idx;
 	struct vring_desc *desc;
+	struct usfstl_vhost_user_virtq_stats *stats;
 	unsigned int n_in = 0, n_out = 0;
+	uint64_t now;
 	bool more;
 
 	if (avail_idx == dev->virtqs[virtq_idx].last_avail_idx)
@@ -111,6 +168,16 @@ usfstl_vhost_user_get_virtq_buf(struct usfstl_vhost_user_dev_int *dev,
 		desc = &virtq->desc[virtio_to_cpu16(dev, desc->next)];
 	} while (more);
 
+	stats = &dev->virtqs[virtq_idx].stats;
+	now = usfstl_vhost_user_now(dev);
+	stats->buffers++;
+	stats->descriptors += n_in + n_out;
+	if (n_in + n_out > stats->max_chain_len)
+		stats->max_chain_len = n_in + n_out;
+	stats->queued_time += now - dev->virtqs[virtq_idx].kick_time;
+	if (now - dev->virtqs[virtq_idx].kick_time > stats->max_queued_time)
+		stats->max_queued_time = now - dev->virtqs[virtq_idx].kick_time;
+
 	if (!buf || n_in > fixed->n_in_sg || n_out > fixed->n_out_sg) {
 		size_t sz = sizeof(*buf);
 		struct iovec *vec;
@@ -131,6 +198,7 @@ usfstl_vhost_user_get_virtq_buf(struct usfstl_vhost_user_dev_int *dev,
 	buf->n_out_sg = 0;
 	buf->idx = desc_idx;
 	buf->virtq_idx = virtq_idx;
+	buf->dequeued = now;
 
 	desc = &virtq->desc[desc_idx];
 	do {
@@ -179,7 +247,9 @@ static int usfstl_vhost_user_read_msg(int fd, struct msghdr *msghdr)
 		.msg_controllen = msghdr->msg_controllen,
 	};
 	struct vhost_user_msg_hdr *hdr;
-	size_t i;
+	struct iovec body_iov[3];
+	struct msghdr body = {};
+	size_t i, rem;
 	size_t maxlen = 0;
 	ssize_t len;
 
@@ -206,17 +276,25 @@ static int usfstl_vhost_user_read_msg(int fd, struct msghdr *msghdr)
 	if (!hdr->size)
 		return 0;
 
-	msghdr->msg_control = NULL;
-	msghdr->msg_controllen = 0;
-	msghdr->msg_iov[0].iov_base += sizeof(*hdr);
-	msghdr->msg_iov[0].iov_len -= sizeof(*hdr);
-	len = recvmsg(fd, msghdr, 0);
-
-	/* restore just in case the user needs it */
-	msghdr->msg_iov[0].iov_base -= sizeof(*hdr);
-	msghdr->msg_iov[0].iov_len += sizeof(*hdr);
-	msghdr->msg_control = hdr2.msg_control;
-	msghdr->msg_controllen = hdr2.msg_controllen;
+	/*
+	 * Receive exactly the message body, the config space may be large
+	 * so wait for all of it rather than returning partial data.
+	 */
+	USFSTL_ASSERT(msghdr->msg_iovlen <=
+		      sizeof(body_iov) / sizeof(body_iov[0]));
+	body.msg_iov = body_iov;
+	for (i = 0, rem = hdr->size; rem; i++) {
+		body_iov[i] = msghdr->msg_iov[i];
+		if (i == 0) {
+			body_iov[i].iov_base += sizeof(*hdr);
+			body_iov[i].iov_len -= sizeof(*hdr);
+		}
+		if (body_iov[i].iov_len > rem)
+			body_iov[i].iov_len = rem;
+		rem -= body_iov[i].iov_len;
+	}
+	body.msg_iovlen = i;
+	len = recvmsg(fd, &body, MSG_WAITALL);
 
 	if (len < 0)
 		return -errno;
@@ -228,6 +306,54 @@ static int usfstl_vhost_user_read_msg(int fd, struct msghdr *msghdr)
 	return 0;
 }
 
+static void usfstl_vhost_user_read_ack(struct usfstl_vhost_user_dev_int *dev,
+				       struct vhost_user_msg *msg)
+{
+	struct iovec msg_iov = {
+		.iov_base = msg,
+		.iov_len = sizeof(*msg),
+	};
+	struct msghdr msghdr = {
+		.msg_iovlen = 1,
+		.msg_iov = &msg_iov,
+	};
+
+	USFSTL_ASSERT_EQ(usfstl_vhost_user_read_msg(dev->req_fd, &msghdr),
+			 0, "%d");
+	USFSTL_ASSERT(msg->hdr.flags & VHOST_USER_MSG_FLAGS_REPLY);
+}
+
+static void usfstl_vhost_user_ack_readable(struct usfstl_loop_entry *entry)
+{
+	struct usfstl_vhost_user_dev_int *dev = entry->data;
+	struct vhost_user_msg msg;
+
+	USFSTL_ASSERT(dev->acks_pending);
+
+	usfstl_vhost_user_read_ack(dev, &msg);
+	USFSTL_ASSERT_EQ(msg.hdr.request,
+			 (uint32_t)VHOST_USER_SLAVE_VRING_CALL, "%u");
+
+	if (--dev->acks_pending)
+		return;
+
+	usfstl_loop_unregister(&dev->req_entry);
+	usfstl_sched_del_job(&dev->ack_job);
+}
+
+static void usfstl_vhost_user_wait_acks(struct usfstl_vhost_user_dev_int *dev)
+{
+	while (dev->acks_pending)
+		usfstl_loop_wait_and_handle();
+}
+
+static void usfstl_vhost_user_ack_job_callback(struct usfstl_job *job)
+{
+	struct usfstl_vhost_user_dev_int *dev = job->data;
+
+	usfstl_vhost_user_wait_acks(dev);
+}
+
 static void usfstl_vhost_user_send_msg(struct usfstl_vhost_user_dev_int *dev,
 				       struct vhost_user_msg *msg)
 {
@@ -236,6 +362,9 @@ static void usfstl_vhost_user_send_msg(struct usfstl_vhost_user_dev_int *dev,
 		   (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK);
 	ssize_t written;
 
+	/* replies come in order, so collect the outstanding ones first */
+	usfstl_vhost_user_wait_acks(dev);
+
 	if (ack)
 		msg->hdr.flags |= VHOST_USER_MSG_FLAGS_NEED_REPLY;
 
@@ -248,14 +377,6 @@ static void usfstl_vhost_user_send_msg(struct usfstl_vhost_user_dev_int *dev,
 			.priority = 0x7fffffff, // max
 			.handler = usfstl_vhost_user_readable_handler,
 		};
-		struct iovec msg_iov = {
-			.iov_base = msg,
-			.iov_len = sizeof(*msg),
-		};
-		struct msghdr msghdr = {
-			.msg_iovlen = 1,
-			.msg_iov = &msg_iov,
-		};
 
 		/*
 		 * Wait for the fd to be readable - we may have to
@@ -265,9 +386,45 @@ static void usfstl_vhost_user_send_msg(struct usfstl_vhost_user_dev_int *dev,
 		usfstl_loop_register(&entry);
 		while (entry.fd != -1)
 			usfstl_loop_wait_and_handle();
-		USFSTL_ASSERT_EQ(usfstl_vhost_user_read_msg(dev->req_fd,
-							    &msghdr),
-				 0, "%d");
+		usfstl_vhost_user_read_ack(dev, msg);
+	}
+}
+
+/*
+ * Send a message whose REPLY_ACK we don't need right away: the ack
+ * is collected by the main loop, and with a scheduler a job at the
+ * current time (with lowest priority) makes sure all outstanding
+ * acks were received before the simulation time can move on. This
+ * keeps the ordering guarantees of the synchronous version, while
+ * not requiring a full round-trip for each message.
+ */
+static void usfstl_vhost_user_send_msg_async(struct usfstl_vhost_user_dev_int *dev,
+					     struct vhost_user_msg *msg)
+{
+	struct usfstl_scheduler *sched = dev->ext.server->scheduler;
+	size_t msgsz = sizeof(msg->hdr) + msg->hdr.size;
+	ssize_t written;
+
+	if (!(dev->ext.protocol_features &
+			(1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK))) {
+		usfstl_vhost_user_send_msg(dev, msg);
+		return;
+	}
+
+	msg->hdr.flags |= VHOST_USER_MSG_FLAGS_NEED_REPLY;
+
+	written = write(dev->req_fd, msg, msgsz);
+	USFSTL_ASSERT_EQ(written, (ssize_t)msgsz, "%zd");
+
+	if (dev->acks_pending++)
+		return;
+
+	dev->req_entry.fd = dev->req_fd;
+	usfstl_loop_register(&dev->req_entry);
+
+	if (sched) {
+		dev->ack_job.start = usfstl_sched_current_time(sched);
+		usfstl_sched_add_job(sched, &dev->ack_job);
 	}
 }
 
@@ -278,8 +435,9 @@ static void usfstl_vhost_user_send_virtq_buf(struct usfstl_vhost_user_dev_int *d
 	struct vring *virtq = &dev->virtqs[virtq_idx].virtq;
 	unsigned int idx, widx;
 	int call_fd = dev->virtqs[virtq_idx].call_fd;
+	struct usfstl_vhost_user_virtq_stats *stats;
 	ssize_t written;
-	uint64_t e = 1;
+	uint64_t e = 1, now;
 
 	if (dev->ext.server->ctrl)
 		usfstl_sched_ctrl_sync_to(dev->ext.server->ctrl);
@@ -296,6 +454,13 @@ static void usfstl_vhost_user_send_virtq_buf(struct usfstl_vhost_user_dev_int *d
 
 	virtq->used->idx = cpu_to_virtio16(dev, widx);
 
+	stats = &dev->virtqs[virtq_idx].stats;
+	now = usfstl_vhost_user_now(dev);
+	stats->notifications++;
+	stats->busy_time += now - buf->dequeued;
+	if (now - buf->dequeued > stats->max_busy_time)
+		stats->max_busy_time = now - buf->dequeued;
+
 	if (call_fd < 0 &&
 	    dev->ext.protocol_features &
 			(1ULL << VHOST_USER_PROTOCOL_F_INBAND_NOTIFICATIONS) &&
@@ -310,7 +475,7 @@ static void usfstl_vhost_user_send_virtq_buf(struct usfstl_vhost_user_dev_int *d
 			},
 		};
 
-		usfstl_vhost_user_send_msg(dev, &msg);
+		usfstl_vhost_user_send_msg_async(dev, &msg);
 		return;
 	}
 
@@ -352,6 +517,222 @@ usfstl_vhost_user_handle_queue(struct usfstl_vhost_user_dev_int *dev,
 	}
 }
 
+static void *usfstl_vhost_user_worker_fn(void *data)
+{
+	struct usfstl_vhost_user_worker *worker = data;
+	struct usfstl_vhost_user_dev_int *dev = worker->dev;
+	struct usfstl_vhost_user_buf *buf;
+	uint64_t e = 1;
+
+	pthread_mutex_lock(&worker->lock);
+	while (1) {
+		while (!worker->stop && worker->n_handled == worker->n_bufs)
+			pthread_cond_wait(&worker->cond, &worker->lock);
+		if (worker->stop)
+			break;
+
+		buf = worker->bufs[worker->n_handled];
+		pthread_mutex_unlock(&worker->lock);
+
+		dev->ext.server->ops->handle(&dev->ext, buf, worker->virtq_idx);
+
+		pthread_mutex_lock(&worker->lock);
+		worker->n_handled++;
+		if (worker->n_handled < worker->n_bufs)
+			continue;
+
+		/* batch done, wake up the simulation thread */
+		pthread_cond_broadcast(&worker->cond);
+		if (worker->entry.fd != -1) {
+			ssize_t written = write(worker->entry.fd, &e, sizeof(e));
+
+			(void)written;
+		}
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return NULL;
+}
+
+static void usfstl_vhost_user_worker_dispatch(struct usfstl_vhost_user_dev_int *dev,
+					      unsigned int virtq_idx)
+{
+	struct usfstl_vhost_user_worker *worker = dev->virtqs[virtq_idx].worker;
+	struct usfstl_scheduler *sched = dev->ext.server->scheduler;
+	struct usfstl_vhost_user_buf *buf;
+	unsigned int n_bufs = 0;
+
+	/* still busy with the previous batch, pick it up on completion */
+	if (worker->n_bufs) {
+		worker->pending = true;
+		return;
+	}
+
+	while ((buf = usfstl_vhost_user_get_virtq_buf(dev, virtq_idx, NULL))) {
+		if (n_bufs == worker->max_bufs) {
+			worker->max_bufs = worker->max_bufs * 2 ?: 16;
+			worker->bufs = realloc(worker->bufs,
+					       worker->max_bufs *
+					       sizeof(worker->bufs[0]));
+			USFSTL_ASSERT(worker->bufs);
+		}
+		worker->bufs[n_bufs++] = buf;
+	}
+
+	if (!n_bufs)
+		return;
+
+	pthread_mutex_lock(&worker->lock);
+	worker->n_handled = 0;
+	worker->n_bufs = n_bufs;
+	pthread_cond_broadcast(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+
+	/*
+	 * With a scheduler, return the buffers at a fixed point in
+	 * simulation time, regardless of how long the worker really
+	 * takes, to keep the simulation deterministic. Otherwise the
+	 * worker signals completion through the eventfd.
+	 */
+	if (!sched)
+		return;
+
+	worker->job.start = usfstl_sched_current_time(sched) +
+			    dev->ext.server->worker_latency;
+	usfstl_sched_add_job(sched, &worker->job);
+}
+
+static void usfstl_vhost_user_worker_complete(struct usfstl_vhost_user_worker *worker)
+{
+	struct usfstl_vhost_user_dev_int *dev = worker->dev;
+	unsigned int i, n_bufs;
+
+	pthread_mutex_lock(&worker->lock);
+	while (worker->n_handled < worker->n_bufs)
+		pthread_cond_wait(&worker->cond, &worker->lock);
+	n_bufs = worker->n_bufs;
+	pthread_mutex_unlock(&worker->lock);
+
+	for (i = 0; i < n_bufs; i++)
+		usfstl_vhost_user_send_response(&dev->ext, worker->bufs[i]);
+
+	pthread_mutex_lock(&worker->lock);
+	worker->n_bufs = 0;
+	worker->n_handled = 0;
+	pthread_mutex_unlock(&worker->lock);
+
+	if (worker->pending) {
+		worker->pending = false;
+		usfstl_vhost_user_worker_dispatch(dev, worker->virtq_idx);
+	}
+}
+
+/*
+ * Finish the batch the worker is handling (if any) before its buffers
+ * become invalid, e.g. because the memory they point to is unmapped.
+ * Buffers it didn't take yet are left for the next time the queue is
+ * handled.
+ */
+static void usfstl_vhost_user_worker_flush(struct usfstl_vhost_user_dev_int *dev,
+					   unsigned int virtq_idx)
+{
+	struct usfstl_vhost_user_worker *worker = dev->virtqs[virtq_idx].worker;
+
+	if (!worker || !worker->n_bufs)
+		return;
+
+	usfstl_sched_del_job(&worker->job);
+	if (worker->pending) {
+		worker->pending = false;
+		dev->virtqs[virtq_idx].triggered = true;
+	}
+	usfstl_vhost_user_worker_complete(worker);
+}
+
+static void usfstl_vhost_user_worker_job_callback(struct usfstl_job *job)
+{
+	usfstl_vhost_user_worker_complete(job->data);
+}
+
+static void usfstl_vhost_user_worker_readable(struct usfstl_loop_entry *entry)
+{
+	struct usfstl_vhost_user_worker *worker = entry->data;
+	uint64_t v;
+
+	USFSTL_ASSERT_EQ((int)read(entry->fd, &v, sizeof(v)),
+			 (int)sizeof(v), "%d");
+
+	if (worker->n_bufs)
+		usfstl_vhost_user_worker_complete(worker);
+}
+
+static void usfstl_vhost_user_worker_start(struct usfstl_vhost_user_dev_int *dev,
+					   unsigned int virtq_idx)
+{
+	struct usfstl_vhost_user_worker *worker = calloc(1, sizeof(*worker));
+
+	USFSTL_ASSERT(worker);
+
+	worker->dev = dev;
+	worker->virtq_idx = virtq_idx;
+	worker->job.name = "vhost-user-worker";
+	worker->job.priority = dev->irq_job.priority;
+	worker->job.data = worker;
+	worker->job.callback = usfstl_vhost_user_worker_job_callback;
+	worker->entry.fd = -1;
+	worker->entry.data = worker;
+	worker->entry.handler = usfstl_vhost_user_worker_readable;
+
+	if (!dev->ext.server->scheduler) {
+		worker->entry.fd = eventfd(0, EFD_CLOEXEC);
+		USFSTL_ASSERT(worker->entry.fd >= 0,
+			      "eventfd() failed (%d)", errno);
+		usfstl_loop_register(&worker->entry);
+	}
+
+	USFSTL_ASSERT_EQ(pthread_mutex_init(&worker->lock, NULL), 0, "%d");
+	USFSTL_ASSERT_EQ(pthread_cond_init(&worker->cond, NULL), 0, "%d");
+	USFSTL_ASSERT_EQ(pthread_create(&worker->thread, NULL,
+					usfstl_vhost_user_worker_fn, worker),
+			 0, "%d");
+	pthread_setname_np(worker->thread, "vhost-worker");
+
+	dev->virtqs[virtq_idx].worker = worker;
+}
+
+static void usfstl_vhost_user_worker_stop(struct usfstl_vhost_user_dev_int *dev,
+					  unsigned int virtq_idx)
+{
+	struct usfstl_vhost_user_worker *worker = dev->virtqs[virtq_idx].worker;
+	unsigned int i;
+
+	if (!worker)
+		return;
+
+	pthread_mutex_lock(&worker->lock);
+	worker->stop = true;
+	pthread_cond_broadcast(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+	pthread_join(worker->thread, NULL);
+
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->lock);
+
+	usfstl_sched_del_job(&worker->job);
+	if (worker->entry.fd != -1) {
+		usfstl_loop_unregister(&worker->entry);
+		close(worker->entry.fd);
+	}
+
+	/* the connection is gone, buffers in flight cannot be returned */
+	for (i = 0; i < worker->n_bufs; i++)
+		usfstl_vhost_user_free_buf(worker->bufs[i]);
+	free(worker->bufs);
+	free(worker);
+
+	dev->virtqs[virtq_idx].worker = NULL;
+}
+
 static void usfstl_vhost_user_job_callback(struct usfstl_job *job)
 {
 	struct usfstl_vhost_user_dev_int *dev = job->data;
@@ -362,7 +743,10 @@ static void usfstl_vhost_user_job_callback(struct usfstl_job *job)
 			continue;
 		dev->virtqs[virtq].triggered = false;
 
-		usfstl_vhost_user_handle_queue(dev, virtq);
+		if (dev->virtqs[virtq].worker)
+			usfstl_vhost_user_worker_dispatch(dev, virtq);
+		else
+			usfstl_vhost_user_handle_queue(dev, virtq);
 	}
 }
 
@@ -389,6 +773,12 @@ static void usfstl_vhost_user_job_callback_oob(struct usfstl_job *job)
 		if (!dev->virtqs[virtq].triggered)
 			continue;
 
+		if (dev->virtqs[virtq].worker) {
+			dev->virtqs[virtq].triggered = false;
+			usfstl_vhost_user_worker_dispatch(dev, virtq);
+			continue;
+		}
+
 		if (handled_one)
 			goto again;
 
@@ -408,6 +798,9 @@ again:
 static void usfstl_vhost_user_virtq_kick(struct usfstl_vhost_user_dev_int *dev,
 					 unsigned int virtq)
 {
+	dev->virtqs[virtq].stats.kicks++;
+	dev->virtqs[virtq].kick_time = usfstl_vhost_user_now(dev);
+
 	if (!(dev->ext.server->input_queues & (1ULL << virtq)))
 		return;
 
@@ -497,14 +890,30 @@ usfstl_vhost_user_update_virtq_kick(struct usfstl_vhost_user_dev_int *dev,
 	}
 }
 
+static void usfstl_vhost_user_dump_all_stats(void)
+{
+	struct usfstl_vhost_user_dev_int *dev;
+
+	usfstl_for_each_list_item(dev, &g_usfstl_vhost_user_devs, list)
+		usfstl_vhost_user_dump_stats(&dev->ext, stdout);
+}
+
 static void usfstl_vhost_user_dev_free(struct usfstl_vhost_user_dev_int *dev)
 {
 	unsigned int virtq;
 
+	if (g_usfstl_vhost_user_stats)
+		usfstl_vhost_user_dump_stats(&dev->ext, stdout);
+	usfstl_list_item_remove(&dev->list);
+
 	usfstl_loop_unregister(&dev->entry);
 	usfstl_sched_del_job(&dev->irq_job);
+	usfstl_sched_del_job(&dev->ack_job);
+	if (dev->acks_pending)
+		usfstl_loop_unregister(&dev->req_entry);
 
 	for (virtq = 0; virtq < dev->ext.server->max_queues; virtq++) {
+		usfstl_vhost_user_worker_stop(dev, virtq);
 		usfstl_vhost_user_update_virtq_kick(dev, virtq, -1);
 		if (dev->virtqs[virtq].call_fd != -1)
 			close(dev->virtqs[virtq].call_fd);
@@ -524,6 +933,7 @@ static void usfstl_vhost_user_dev_free(struct usfstl_vhost_user_dev_int *dev)
 	if (dev->entry.fd != -1)
 		close(dev->entry.fd);
 
+	free(dev->config_buf);
 	free(dev);
 }
 
@@ -546,11 +956,45 @@ static void usfstl_vhost_user_get_msg_fds(struct msghdr *msghdr,
 	}
 }
 
+static void usfstl_vhost_user_check_config(struct usfstl_vhost_user_dev_int *dev,
+					   struct vhost_user_msg *msg,
+					   ssize_t len)
+{
+	size_t config_len = dev->ext.server->config_len;
+
+	USFSTL_ASSERT(len == (int)(sizeof(msg->payload.cfg_space) +
+				   msg->payload.cfg_space.size));
+	USFSTL_ASSERT(dev->ext.server->config && config_len);
+	USFSTL_ASSERT(msg->payload.cfg_space.size <= config_len);
+	USFSTL_ASSERT(msg->payload.cfg_space.offset <=
+		      config_len - msg->payload.cfg_space.size,
+		      "config access at %u (len %u) exceeds config space (%zu)",
+		      msg->payload.cfg_space.offset,
+		      msg->payload.cfg_space.size, config_len);
+}
+
+/*
+ * The start of the config data was received into the (unused) rest of
+ * the message payload, move it to the front of the config buffer so the
+ * written range is contiguous.
+ */
+static void usfstl_vhost_user_gather_config(struct usfstl_vhost_user_dev_int *dev,
+					    struct vhost_user_msg *msg)
+{
+	size_t head = sizeof(msg->payload) - sizeof(msg->payload.cfg_space);
+	size_t size = msg->payload.cfg_space.size;
+
+	if (size > head)
+		memmove(dev->config_buf + head, dev->config_buf, size - head);
+	else
+		head = size;
+	memcpy(dev->config_buf, msg->payload.cfg_space.payload, head);
+}
+
 static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 {
 	struct usfstl_vhost_user_dev_int *dev;
 	struct vhost_user_msg msg;
-	uint8_t data[256]; // limits the config space size ...
 	struct iovec msg_iov[3] = {
 		[0] = {
 			.iov_base = &msg.hdr,
@@ -560,10 +1004,6 @@ static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 			.iov_base = &msg.payload,
 			.iov_len = sizeof(msg.payload),
 		},
-		[2] = {
-			.iov_base = data,
-			.iov_len = sizeof(data),
-		},
 	};
 	uint8_t msg_control[CMSG_SPACE(sizeof(int) * MAX_REGIONS)] = { 0 };
 	struct msghdr msghdr = {
@@ -574,11 +1014,16 @@ static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 	};
 	ssize_t len;
 	size_t reply_len = 0;
+	/* status for NEED_REPLY (REPLY_ACK), non-zero on failure */
+	uint64_t reply_status = 0;
 	unsigned int virtq;
 	int fd;
 
 	dev = container_of(entry, struct usfstl_vhost_user_dev_int, entry);
 
+	msg_iov[2].iov_base = dev->config_buf;
+	msg_iov[2].iov_len = dev->ext.server->config_len;
+
 	if (usfstl_vhost_user_read_msg(entry->fd, &msghdr)) {
 		usfstl_vhost_user_dev_free(dev);
 		return;
@@ -610,6 +1055,8 @@ static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 					     sizeof(msg.payload.mem_regions.regions[0]) *
 						msg.payload.mem_regions.n_regions);
 		USFSTL_ASSERT(msg.payload.mem_regions.n_regions <= MAX_REGIONS);
+		for (virtq = 0; virtq < dev->ext.server->max_queues; virtq++)
+			usfstl_vhost_user_worker_flush(dev, virtq);
 		usfstl_vhost_user_clear_mappings(dev);
 		memcpy(dev->regions, msg.payload.mem_regions.regions,
 		       msg.payload.mem_regions.n_regions *
@@ -622,6 +1069,7 @@ static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 		USFSTL_ASSERT(len == (int)sizeof(msg.payload.vring_state));
 		USFSTL_ASSERT(msg.payload.vring_state.idx <
 			      dev->ext.server->max_queues);
+		usfstl_vhost_user_worker_flush(dev, msg.payload.vring_state.idx);
 		dev->virtqs[msg.payload.vring_state.idx].virtq.num =
 			msg.payload.vring_state.num;
 		break;
@@ -631,6 +1079,7 @@ static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 			      dev->ext.server->max_queues);
 		USFSTL_ASSERT_EQ(msg.payload.vring_addr.flags, (uint32_t)0, "0x%x");
 		USFSTL_ASSERT(!dev->virtqs[msg.payload.vring_addr.idx].enabled);
+		usfstl_vhost_user_worker_flush(dev, msg.payload.vring_addr.idx);
 		dev->virtqs[msg.payload.vring_addr.idx].last_avail_idx = 0;
 		dev->virtqs[msg.payload.vring_addr.idx].virtq.desc =
 			usfstl_vhost_user_to_va(&dev->ext,
@@ -689,6 +1138,7 @@ static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 		USFSTL_ASSERT(len == (int)sizeof(msg.payload.vring_state));
 		USFSTL_ASSERT(msg.payload.vring_state.idx <
 			      dev->ext.server->max_queues);
+		usfstl_vhost_user_worker_flush(dev, msg.payload.vring_state.idx);
 		dev->virtqs[msg.payload.vring_state.idx].enabled =
 			msg.payload.vring_state.num;
 		break;
@@ -698,22 +1148,39 @@ static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 		break;
 	case VHOST_USER_SET_SLAVE_REQ_FD:
 		USFSTL_ASSERT_EQ(len, (ssize_t)0, "%zd");
+		if (dev->acks_pending) {
+			/* acks on the old fd can no longer be received */
+			usfstl_loop_unregister(&dev->req_entry);
+			usfstl_sched_del_job(&dev->ack_job);
+			dev->acks_pending = 0;
+		}
 		if (dev->req_fd != -1)
 			close(dev->req_fd);
 		usfstl_vhost_user_get_msg_fds(&msghdr, &dev->req_fd, 1);
 		USFSTL_ASSERT(dev->req_fd != -1);
 		break;
 	case VHOST_USER_GET_CONFIG:
-		USFSTL_ASSERT(len == (int)(sizeof(msg.payload.cfg_space) +
-					msg.payload.cfg_space.size));
-		USFSTL_ASSERT(dev->ext.server->config && dev->ext.server->config_len);
-		USFSTL_ASSERT(msg.payload.cfg_space.offset == 0);
-		USFSTL_ASSERT(msg.payload.cfg_space.size <= dev->ext.server->config_len);
+		usfstl_vhost_user_check_config(dev, &msg, len);
 		msg.payload.cfg_space.flags = 0;
 		msg_iov[1].iov_len = sizeof(msg.payload.cfg_space);
-		msg_iov[2].iov_base = (void *)dev->ext.server->config;
+		msg_iov[2].iov_base = (uint8_t *)dev->ext.server->config +
+				      msg.payload.cfg_space.offset;
+		msg_iov[2].iov_len = msg.payload.cfg_space.size;
 		reply_len = len;
 		break;
+	case VHOST_USER_SET_CONFIG:
+		usfstl_vhost_user_check_config(dev, &msg, len);
+		/* read-only config space, drop the write */
+		if (!dev->ext.server->ops->set_config) {
+			reply_status = 1;
+			break;
+		}
+		usfstl_vhost_user_gather_config(dev, &msg);
+		dev->ext.server->ops->set_config(&dev->ext,
+						 msg.payload.cfg_space.offset,
+						 dev->config_buf,
+						 msg.payload.cfg_space.size);
+		break;
 	case VHOST_USER_VRING_KICK:
 		USFSTL_ASSERT(len == (int)sizeof(msg.payload.vring_state));
 		USFSTL_ASSERT(msg.payload.vring_state.idx <
@@ -729,7 +1196,7 @@ static void usfstl_vhost_user_handle_msg(struct usfstl_loop_entry *entry)
 		size_t i, tmp;
 
 		if (!reply_len) {
-			msg.payload.u64 = 0;
+			msg.payload.u64 = reply_status;
 			reply_len = sizeof(uint64_t);
 		}
 
@@ -783,6 +1250,11 @@ static void usfstl_vhost_user_connected(int fd, void *data)
 
 	USFSTL_ASSERT(dev);
 
+	if (server->config_len) {
+		dev->config_buf = malloc(server->config_len);
+		USFSTL_ASSERT(dev->config_buf);
+	}
+
 	for (i = 0; i < server->max_queues; i++) {
 		dev->virtqs[i].call_fd = -1;
 		dev->virtqs[i].entry.fd = -1;
@@ -793,6 +1265,9 @@ static void usfstl_vhost_user_connected(int fd, void *data)
 	for (i = 0; i < MAX_REGIONS; i++)
 		dev->region_fds[i] = -1;
 	dev->req_fd = -1;
+	dev->req_entry.data = dev;
+	dev->req_entry.priority = 0x7fffffff; // max
+	dev->req_entry.handler = usfstl_vhost_user_ack_readable;
 
 	dev->ext.server = server;
 	dev->irq_job.data = dev;
@@ -802,8 +1277,23 @@ static void usfstl_vhost_user_connected(int fd, void *data)
 		dev->irq_job.callback = usfstl_vhost_user_job_callback_oob;
 	else
 		dev->irq_job.callback = usfstl_vhost_user_job_callback;
+	dev->ack_job.data = dev;
+	dev->ack_job.name = "vhost-user-ack";
+	dev->ack_job.priority = 0;
+	dev->ack_job.callback = usfstl_vhost_user_ack_job_callback;
 	usfstl_list_init(&dev->fds);
 
+	for (i = 0; i < server->max_queues; i++) {
+		if (server->worker_queues & (1ULL << i))
+			usfstl_vhost_user_worker_start(dev, i);
+	}
+
+	if (g_usfstl_vhost_user_stats && !g_usfstl_vhost_user_stats_atexit) {
+		atexit(usfstl_vhost_user_dump_all_stats);
+		g_usfstl_vhost_user_stats_atexit = true;
+	}
+	usfstl_list_append(&g_usfstl_vhost_user_devs, &dev->list);
+
 	if (server->ops->connected)
 		server->ops->connected(&dev->ext);
 
@@ -817,6 +1307,15 @@ void usfstl_vhost_user_server_start(struct usfstl_vhost_user_server *server)
 {
 	USFSTL_ASSERT(server->ops);
 	USFSTL_ASSERT(server->socket);
+	USFSTL_ASSERT(!(server->worker_queues & ~server->input_queues),
+		      "worker queues 0x%llx must be input queues (0x%llx)",
+		      (unsigned long long)server->worker_queues,
+		      (unsigned long long)server->input_queues);
+	USFSTL_ASSERT(server->max_queues >= 64 ||
+		      !(server->worker_queues >> server->max_queues),
+		      "worker queues 0x%llx beyond max_queues %u",
+		      (unsigned long long)server->worker_queues,
+		      server->max_queues);
 
 	usfstl_uds_create(server->socket, usfstl_vhost_user_connected, server);
 }
@@ -878,6 +1377,95 @@ void usfstl_vhost_user_config_changed(struct usfstl_vhost_user_dev *dev)
 	usfstl_vhost_user_send_msg(idev, &msg);
 }
 
+void usfstl_vhost_user_get_virtq_stats(struct usfstl_vhost_user_dev *extdev,
+					unsigned int virtq_idx,
+					struct usfstl_vhost_user_virtq_stats *stats)
+{
+	struct usfstl_vhost_user_dev_int *dev;
+
+	dev = container_of(extdev, struct usfstl_vhost_user_dev_int, ext);
+
+	USFSTL_ASSERT(virtq_idx < dev->ext.server->max_queues);
+
+	*stats = dev->virtqs[virtq_idx].stats;
+}
+
+void usfstl_vhost_user_reset_virtq_stats(struct usfstl_vhost_user_dev *extdev,
+					  unsigned int virtq_idx)
+{
+	struct usfstl_vhost_user_dev_int *dev;
+
+	dev = container_of(extdev, struct usfstl_vhost_user_dev_int, ext);
+
+	USFSTL_ASSERT(virtq_idx < dev->ext.server->max_queues);
+
+	memset(&dev->virtqs[virtq_idx].stats, 0,
+	       sizeof(dev->virtqs[virtq_idx].stats));
+}
+
+void usfstl_vhost_user_dump_stats(struct usfstl_vhost_user_dev *extdev,
+				  FILE *f)
+{
+	struct usfstl_vhost_user_dev_int *dev;
+	unsigned int virtq;
+
+	dev = container_of(extdev, struct usfstl_vhost_user_dev_int, ext);
+
+	for (virtq = 0; virtq < dev->ext.server->max_queues; virtq++) {
+		struct usfstl_vhost_user_virtq_stats *stats;
+		uint64_t bufs;
+
+		stats = &dev->virtqs[virtq].stats;
+		if (!stats->kicks && !stats->buffers && !stats->notifications)
+			continue;
+
+		/* avoid division by zero for the averages */
+		bufs = stats->buffers ?: 1;
+
+		fprintf(f, "vhost-user %s virtq %u: %" PRIu64 " kicks, %" PRIu64
+			" buffers (%.2f per kick), %" PRIu64 " notifications\n",
+			dev->ext.server->socket, virtq, stats->kicks,
+			stats->buffers,
+			(double)stats->buffers / (stats->kicks ?: 1),
+			stats->notifications);
+		fprintf(f, "  chain length: avg %.2f max %u\n",
+			(double)stats->descriptors / bufs,
+			stats->max_chain_len);
+		if (!dev->ext.server->scheduler)
+			continue;
+		fprintf(f, "  queued time: avg %.2f max %" PRIu64
+			", busy time: avg %.2f max %" PRIu64 "\n",
+			(double)stats->queued_time / bufs,
+			stats->max_queued_time,
+			(double)stats->busy_time / (stats->notifications ?: 1),
+			stats->max_busy_time);
+	}
+}
+
+void *usfstl_vhost_user_to_va_len(struct usfstl_vhost_user_dev *extdev,
+				  uint64_t addr, size_t *len)
+{
+	struct usfstl_vhost_user_dev_int *dev;
+	unsigned int region;
+
+	dev = container_of(extdev, struct usfstl_vhost_user_dev_int, ext);
+
+	for (region = 0; region < dev->n_regions; region++) {
+		uint64_t start = dev->regions[region].user_addr;
+		uint64_t avail;
+
+		if (addr < start || addr >= start + dev->regions[region].size)
+			continue;
+
+		avail = start + dev->regions[region].size - addr;
+		if (*len > avail)
+			*len = avail;
+		return (uint8_t *)dev->region_vaddr[region] + (addr - start);
+	}
+
+	return NULL;
+}
+
 void *usfstl_vhost_user_to_va(struct usfstl_vhost_user_dev *extdev, uint64_t addr)
 {
 	struct usfstl_vhost_user_dev_int *dev;
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Participants with a lookahead running in parallel, all of them writing
+ * their own variables in the same block of a shared memory section. Their
+ * changes must all be merged, none may be overwritten by stale data from
+ * another one. Running many cases also checks that the participants are
+ * correctly reused from one test case to the next.
+ *
+ * They also write a section spanning several pages, so that with the
+ * option --multi-shared-mem-map (where they then run one at a time) it
+ * has pages that are really mapped.
+ *
+ * Configuration A controls the participants (B) directly, configuration N
+ * does the same with two levels: it controls groups (G), each of which is
+ * a controller for its own participants (B again, named "g0/p0" etc.).
+ */
+#include <stdio.h>
+#include <usfstl/test.h>
+#include <usfstl/multi.h>
+#include <usfstl/task.h>
+#include <usfstl/sched.h>
+#include <usfstl/sharedmem.h>
+
+#define GROUPS		2
+#define PARTICIPANTS	3
+#define STEPS		5
+#define LOOKAHEAD	7
+#define CASES		40
+
+USFSTL_SHARED_MEM_SECTION(shm);
+// small enough to all be in one block
+int USFSTL_SHARED_MEM_VAR(slots[GROUPS * PARTICIPANTS][STEPS + 1], shm);
+
+USFSTL_SHARED_MEM_SECTION(pages);
+// each participant has a page of its own (and then some)
+#define PAGE_INTS	1500
+int USFSTL_SHARED_MEM_VAR(page_slots[GROUPS * PARTICIPANTS][PAGE_INTS], pages);
+
+#if defined(CONFIG_A) || defined(CONFIG_N)
+#if defined(CONFIG_A)
+#define N_PARTICIPANTS	PARTICIPANTS
+USFSTL_MULTI_PARTICIPANT(p0, .binary = TEST_BIN_PATH "/B/test", .lookahead = LOOKAHEAD);
+USFSTL_MULTI_PARTICIPANT(p1, .binary = TEST_BIN_PATH "/B/test", .lookahead = LOOKAHEAD);
+USFSTL_MULTI_PARTICIPANT(p2, .binary = TEST_BIN_PATH "/B/test", .lookahead = LOOKAHEAD);
+#else
+#define N_PARTICIPANTS	(GROUPS * PARTICIPANTS)
+// a group can't affect anyone sooner than its participants can
+USFSTL_MULTI_PARTICIPANT(g0, .binary = TEST_BIN_PATH "/G/test", .lookahead = LOOKAHEAD);
+USFSTL_MULTI_PARTICIPANT(g1, .binary = TEST_BIN_PATH "/G/test", .lookahead = LOOKAHEAD);
+#endif
+
+void test_parallel(const struct usfstl_test *test, void *testcase)
+{
+	int i, s;
+
+	// until the participants are all done
+	usfstl_task_sleep(N_PARTICIPANTS + STEPS * LOOKAHEAD);
+
+	for (i = 0; i < N_PARTICIPANTS; i++) {
+		USFSTL_ASSERT_EQ(slots[i][0], STEPS, "%d");
+		for (s = 0; s < STEPS; s++) {
+			USFSTL_ASSERT_EQ(slots[i][s + 1],
+					 i + LOOKAHEAD * (s + 1), "%d");
+			USFSTL_ASSERT_EQ(page_slots[i][PAGE_INTS - 1 - s],
+					 slots[i][s + 1], "%d");
+		}
+	}
+}
+
+static struct usfstl_testcase g_testcase;
+
+static void *test_parallel_case(const struct usfstl_test *test, unsigned int i)
+{
+	return i < CASES ? &g_testcase : NULL;
+}
+USFSTL_UNIT_TEST(test_parallel, NULL, NO_CASES,
+		 .case_generator = test_parallel_case);
+#elif defined(CONFIG_G)
+// a group only controls its participants, it has nothing else to do
+USFSTL_MULTI_PARTICIPANT(p0, .binary = TEST_BIN_PATH "/B/test", .lookahead = LOOKAHEAD);
+USFSTL_MULTI_PARTICIPANT(p1, .binary = TEST_BIN_PATH "/B/test", .lookahead = LOOKAHEAD);
+USFSTL_MULTI_PARTICIPANT(p2, .binary = TEST_BIN_PATH "/B/test", .lookahead = LOOKAHEAD);
+#elif defined(CONFIG_B)
+static void participant_task(struct usfstl_task *task, void *data)
+{
+	const char *name = g_usfstl_multi_local_participant.name;
+	int group = 0, p, idx;
+	int s;
+
+	// the controller names us p0, p1, ..., or g0/p0, ... when nested
+	if (sscanf(name, "g%d/p%d", &group, &p) != 2)
+		USFSTL_ASSERT(sscanf(name, "p%d", &p) == 1,
+			      "participant name '%s'", name);
+	USFSTL_ASSERT(group < GROUPS && p < PARTICIPANTS,
+		      "participant name '%s'", name);
+	idx = group * PARTICIPANTS + p;
+
+	USFSTL_ASSERT_EQ(slots[idx][0], 0, "%d");
+	USFSTL_ASSERT_EQ(page_slots[idx][PAGE_INTS - 1], 0, "%d");
+
+	// offset the participants so they run at different times
+	usfstl_task_sleep(idx);
+	for (s = 0; s < STEPS; s++) {
+		usfstl_task_sleep(LOOKAHEAD);
+		slots[idx][0]++;
+		slots[idx][s + 1] =
+			usfstl_sched_current_time(&g_usfstl_task_scheduler);
+		page_slots[idx][PAGE_INTS - 1 - s] = slots[idx][s + 1];
+	}
+}
+
+static void participant_pre(const struct usfstl_test *test, void *tc,
+			    int test_num, int case_num)
+{
+	usfstl_task_resume(usfstl_task_create("participant", 0,
+					      participant_task, NULL, NULL));
+}
+
+static void participant_init(void)
+{
+	g_usfstl_multi_controlled_test.pre = participant_pre;
+}
+USFSTL_INITIALIZER(participant_init);
+#else
+#error "unknown configuration"
+#endif
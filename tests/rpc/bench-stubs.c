@@ -0,0 +1,13 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "bench.h"
+
+#define USFSTL_RPC_CALLER_STUB
+#include "bench.h"
+#undef USFSTL_RPC_CALLER_STUB
+
+#define USFSTL_RPC_CALLEE_STUB
+#include "bench.h"
@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * RPC latency/throughput benchmark
+ *
+ * Forks a callee and then measures each call individually, reporting
+ * calls per second and latency percentiles for a number of call types:
+ *
+ *	./bench [-n calls] [-x] [-s ring size [-b bulk size]]
+ *
+ * -x adds (simulation time like) extra data to each call, -s and -b
+ * use the shared memory transport (and bulk area) for the connection.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "bench.h"
+
+#define USFSTL_RPC_IMPLEMENTATION
+#include <usfstl/rpc.h>
+
+#define MAX_BUF_SIZE	(1024 * 1024)
+
+static int quit;
+static uint64_t extra_time;
+
+USFSTL_RPC_VOID_METHOD(bench_empty, uint32_t)
+{
+}
+
+USFSTL_RPC_ONEWAY_METHOD(bench_oneway, uint32_t)
+{
+}
+
+USFSTL_RPC_METHOD_P(struct bench_struct, bench_struct, struct bench_struct)
+{
+	return *in;
+}
+
+USFSTL_RPC_METHOD_VAR(uint32_t, bench_var_in, struct bench_buf)
+{
+	return insize;
+}
+
+USFSTL_RPC_VAR_METHOD(struct bench_buf, bench_var_out, uint32_t)
+{
+	out->len = outsize;
+}
+
+USFSTL_RPC_VOID_METHOD(bench_nested, uint32_t)
+{
+	if (in)
+		bench_nested_conn(conn, in - 1);
+}
+
+USFSTL_RPC_VOID_METHOD(bench_quit, uint32_t)
+{
+	quit = 1;
+}
+
+/* we don't use the rest of usfstl here */
+void usfstl_flush_all(void)
+{
+}
+
+void usfstl_abort(const char *fn, unsigned int line, const char *cond,
+		  const char *msg, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "assertion failure in %s:%d: %s\n", fn, line, cond);
+	va_start(ap, msg);
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	abort();
+}
+
+static void extra_transmit(struct usfstl_rpc_connection *conn, void *data)
+{
+	memcpy(data, &extra_time, sizeof(extra_time));
+	extra_time++;
+}
+
+static void extra_received(struct usfstl_rpc_connection *conn, const void *data)
+{
+	memcpy(&extra_time, data, sizeof(extra_time));
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+struct bench {
+	const char *name;
+	void (*fn)(uint32_t size);
+	uint32_t size;
+};
+
+static struct bench_buf *buf;
+
+static void run_empty(uint32_t size)
+{
+	bench_empty(0);
+}
+
+static void run_oneway(uint32_t size)
+{
+	bench_oneway(0);
+}
+
+static void run_struct(uint32_t size)
+{
+	struct bench_struct in = {}, out;
+
+	out = bench_struct(&in);
+	assert(out.data[0] == in.data[0]);
+}
+
+static void run_var_in(uint32_t size)
+{
+	uint32_t ret = bench_var_in(buf, size);
+
+	assert(ret == size);
+}
+
+static void run_var_out(uint32_t size)
+{
+	bench_var_out(size, buf, size);
+	assert(buf->len == size);
+}
+
+static void run_batch(uint32_t size)
+{
+	uint32_t i;
+
+	usfstl_rpc_batch_start(NULL);
+	for (i = 0; i < size; i++)
+		bench_empty(i);
+	usfstl_rpc_batch_end(NULL);
+}
+
+static void run_nested(uint32_t size)
+{
+	bench_nested(size);
+}
+
+static void run_bench(const struct bench *bench, unsigned int n)
+{
+	uint64_t *lat = calloc(n, sizeof(*lat));
+	uint64_t start, total;
+	char name[40];
+	unsigned int i;
+
+	assert(lat);
+
+	if (bench->size)
+		snprintf(name, sizeof(name), "%s %u", bench->name, bench->size);
+	else
+		snprintf(name, sizeof(name), "%s", bench->name);
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		uint64_t t = now_ns();
+
+		bench->fn(bench->size);
+		lat[i] = now_ns() - t;
+	}
+	// make sure queued one-way calls are included
+	usfstl_rpc_flush();
+	total = now_ns() - start;
+
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+
+	printf("%-18s %8u %12.0f %9.2f %9.2f %9.2f %9.2f %10.2f\n",
+	       name, n, n * 1e9 / total,
+	       lat[n / 2] / 1e3, lat[n * 90 / 100] / 1e3,
+	       lat[n * 99 / 100] / 1e3, lat[n * 999 / 1000] / 1e3,
+	       lat[n - 1] / 1e3);
+
+	free(lat);
+}
+
+static const struct bench benches[] = {
+	{ .name = "empty", .fn = run_empty, },
+	{ .name = "oneway", .fn = run_oneway, },
+	{ .name = "struct", .fn = run_struct, },
+	{ .name = "var-in", .fn = run_var_in, .size = 16, },
+	{ .name = "var-in", .fn = run_var_in, .size = 256, },
+	{ .name = "var-in", .fn = run_var_in, .size = 4096, },
+	{ .name = "var-in", .fn = run_var_in, .size = 65536, },
+	{ .name = "var-in", .fn = run_var_in, .size = MAX_BUF_SIZE, },
+	{ .name = "var-out", .fn = run_var_out, .size = 16, },
+	{ .name = "var-out", .fn = run_var_out, .size = 256, },
+	{ .name = "var-out", .fn = run_var_out, .size = 4096, },
+	{ .name = "var-out", .fn = run_var_out, .size = 65536, },
+	{ .name = "var-out", .fn = run_var_out, .size = MAX_BUF_SIZE, },
+	// (rate and latency of the whole batch)
+	{ .name = "batch", .fn = run_batch, .size = 16, },
+	{ .name = "nested", .fn = run_nested, .size = 1, },
+	{ .name = "nested", .fn = run_nested, .size = 4, },
+};
+
+int main(int argc, char **argv)
+{
+	struct usfstl_rpc_connection conn = {
+		.extra_received = extra_received,
+		.extra_transmit = extra_transmit,
+	};
+	unsigned int n = 100000, i;
+	int fds[2], status, c, ret;
+	pid_t pid;
+
+	while ((c = getopt(argc, argv, "n:xs:b:")) != -1) {
+		switch (c) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'x':
+			conn.extra_len = sizeof(extra_time);
+			break;
+		case 's':
+			conn.shm_size = atoi(optarg);
+			break;
+		case 'b':
+			conn.shm_bulk_size = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-n calls] [-x] [-s ring size [-b bulk size]]\n",
+				argv[0]);
+			return 2;
+		}
+	}
+
+	buf = calloc(1, MAX_BUF_SIZE);
+	assert(buf && n);
+
+	ret = socketpair(AF_LOCAL, SOCK_STREAM, 0, fds);
+	assert(ret == 0);
+
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		close(fds[0]);
+		conn.conn.fd = fds[1];
+		// the transport is set up by the caller
+		conn.shm_size = 0;
+		conn.shm_bulk_size = 0;
+		g_usfstl_rpc_default_connection = &conn;
+		usfstl_rpc_add_connection(&conn);
+		while (!quit)
+			usfstl_rpc_handle();
+		return 0;
+	}
+	close(fds[1]);
+
+	conn.conn.fd = fds[0];
+	g_usfstl_rpc_default_connection = &conn;
+	usfstl_rpc_add_connection(&conn);
+
+	printf("%-18s %8s %12s %9s %9s %9s %9s %10s\n",
+	       "call", "n", "calls/s", "p50 us", "p90 us", "p99 us",
+	       "p99.9 us", "max us");
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		unsigned int iter = n;
+
+		// scale down the number of large calls
+		if (benches[i].size > 4096)
+			iter = n / (benches[i].size / 4096);
+		if (iter < 100)
+			iter = 100;
+
+		run_bench(&benches[i], iter);
+	}
+
+	bench_quit(0);
+	ret = waitpid(pid, &status, 0);
+	assert(ret == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	return 0;
+}
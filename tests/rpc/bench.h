@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#if !defined(__BENCH_H) || defined(USFSTL_RPC_CALLEE_STUB) || defined(USFSTL_RPC_CALLER_STUB)
+#define __BENCH_H
+#include <usfstl/rpc.h>
+#include <stdint.h>
+
+#ifndef __BENCH_STRUCT_H
+#define __BENCH_STRUCT_H
+struct bench_struct {
+	uint64_t data[8];
+};
+
+struct bench_buf {
+	uint32_t len;
+	unsigned char data[0];
+} __attribute__((packed));
+#endif // __BENCH_STRUCT_H
+
+USFSTL_RPC_VOID_METHOD(bench_empty, uint32_t);
+USFSTL_RPC_ONEWAY_METHOD(bench_oneway, uint32_t);
+USFSTL_RPC_METHOD_P(struct bench_struct, bench_struct, struct bench_struct);
+USFSTL_RPC_METHOD_VAR(uint32_t, bench_var_in, struct bench_buf);
+USFSTL_RPC_VAR_METHOD(struct bench_buf, bench_var_out, uint32_t);
+USFSTL_RPC_VOID_METHOD(bench_nested, uint32_t);
+USFSTL_RPC_VOID_METHOD(bench_quit, uint32_t);
+
+#endif // __BENCH_H
@@ -17,6 +17,12 @@ void calls(void)
 	}, name = {
 		.message = "Jane Doe",
 	}, ret;
+	// larger than the stack buffers (and the shared memory rings)
+	static struct {
+		struct log hdr;
+		char data[10000];
+	} __attribute__((packed)) big;
+	uint32_t sum = 0, i;
 
 	printf("%d\n", callme1(100));
 	printf("%d\n", callme2(&in));
@@ -32,4 +38,35 @@ void calls(void)
 	printf("%.*s\n", (int)(sizeof(ret) - sizeof(ret.hdr)), ret.hdr.msg);
 	numformatp(&in, &ret.hdr, sizeof(ret));
 	printf("%.*s\n", (int)(sizeof(ret) - sizeof(ret.hdr)), ret.hdr.msg);
+
+	for (i = 0; i < sizeof(big.data); i++) {
+		big.data[i] = i;
+		sum += (unsigned char)big.data[i];
+	}
+	printf("checksum %s\n",
+	       checksum(&big.hdr, sizeof(big)) == sum ? "ok" : "BAD");
+
+	fill(0x5a, &big.hdr, sizeof(big));
+	for (i = 0; i < sizeof(big.data); i++) {
+		if (big.data[i] != 0x5a)
+			break;
+	}
+	printf("fill %s\n", i == sizeof(big.data) ? "ok" : "BAD");
+
+	// these are only sent with the next call
+	notify(1);
+	notify(2);
+	notifyp(&in);
+	notifylog(&name.hdr, sizeof(name.hdr) + 8);
+	printf("%d\n", callme1(3));
+
+	// all of these are executed with a single round trip
+	usfstl_rpc_batch_start(NULL);
+	callme3(1);
+	notify(3);
+	callme4(&in);
+	recurse(1);
+	printf("%d\n", callme1(4));
+	callme3(2);
+	usfstl_rpc_batch_end(NULL);
 }
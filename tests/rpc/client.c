@@ -6,6 +6,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <sys/socket.h>
@@ -41,6 +42,15 @@ int main(int argc, char **argv)
 	int fds[2];
 	int status = 0;
 
+	// exchange data through shared memory rings instead of the socket
+	if (argc > 1 && strcmp(argv[1], "--shm") == 0)
+		conn.shm_size = 4096;
+	// and large data in place through a separate area
+	if (argc > 1 && strcmp(argv[1], "--shm-bulk") == 0) {
+		conn.shm_size = 4096;
+		conn.shm_bulk_size = 65536;
+	}
+
 	// direct call
 	printf("%d\n", callme1_conn(USFSTL_RPC_LOCAL, 100));
 
@@ -58,6 +68,7 @@ int main(int argc, char **argv)
 
 	conn.conn.fd = fds[0];
 	g_usfstl_rpc_default_connection = &conn;
+	usfstl_rpc_add_connection(&conn);
 
 	// and this needs the server connection
 	calls();
@@ -65,6 +76,8 @@ int main(int argc, char **argv)
 	recurse(3);
 
 	quit_conn(&conn, 17);
+	// the server disconnects before exiting
+	usfstl_rpc_handle();
 	assert(waitpid(pid, &status, 0) == pid);
 	assert(WIFEXITED(status));
 	assert(WEXITSTATUS(status) == 17);
@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "rpc.h"
 
 #define USFSTL_RPC_IMPLEMENTATION
@@ -76,7 +77,48 @@ USFSTL_RPC_VAR_METHOD_VAR(struct log, hello, struct log)
 		 (int32_t)(insize - sizeof(*in)), in->msg);
 }
 
+USFSTL_RPC_METHOD_VAR(uint32_t, checksum, struct log)
+{
+	uint32_t sum = 0, i;
+
+	for (i = 0; i < insize - sizeof(*in); i++)
+		sum += (unsigned char)in->msg[i];
+
+	return sum;
+}
+
+USFSTL_RPC_VAR_METHOD(struct log, fill, uint32_t)
+{
+	memset(out->msg, in, outsize - sizeof(*out));
+}
+
+USFSTL_RPC_ONEWAY_METHOD(notify, uint32_t)
+{
+	printf("notify %d (running on %s)\n", in, program_invocation_name + 2);
+}
+
+USFSTL_RPC_ONEWAY_METHOD_P(notifyp, struct foo)
+{
+	printf("notifyp %d (running on %s)\n", in->bar,
+	       program_invocation_name + 2);
+}
+
+USFSTL_RPC_ONEWAY_METHOD_VAR(notifylog, struct log)
+{
+	printf("notifylog '%.*s' (running on %s)\n",
+	       (int32_t)(insize - sizeof(*in)), in->msg,
+	       program_invocation_name + 2);
+}
+
 /* for rpc flushing - we don't use log stuff here */
 void usfstl_flush_all(void)
 {
 }
+
+/* for USFSTL_ASSERT() in the RPC code */
+void usfstl_abort(const char *fn, unsigned int line, const char *cond,
+		  const char *msg, ...)
+{
+	fprintf(stderr, "assertion failure in %s:%d: %s\n", fn, line, cond);
+	abort();
+}
@@ -19,5 +19,10 @@ USFSTL_RPC_METHOD_VAR(int32_t, rpclog, struct log);
 USFSTL_RPC_VAR_METHOD(struct log, numformat, int32_t);
 USFSTL_RPC_VAR_METHOD_P(struct log, numformatp, struct foo);
 USFSTL_RPC_VAR_METHOD_VAR(struct log, hello, struct log);
+USFSTL_RPC_METHOD_VAR(uint32_t, checksum, struct log);
+USFSTL_RPC_VAR_METHOD(struct log, fill, uint32_t);
+USFSTL_RPC_ONEWAY_METHOD(notify, uint32_t);
+USFSTL_RPC_ONEWAY_METHOD_P(notifyp, struct foo);
+USFSTL_RPC_ONEWAY_METHOD_VAR(notifylog, struct log);
 
 #endif // _RPC_H
@@ -0,0 +1,606 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * vhost-user server benchmark
+ *
+ * This runs a trivial echo device on top of the usfstl vhost-user
+ * server, and drives it from a minimal in-process vhost-user front
+ * end (driver). The driver shares a memfd with the device, sets up
+ * a single split virtqueue and keeps a configurable number of buffers
+ * (each an out/in descriptor pair) in flight, reposting completed ones
+ * until the requested number of buffers was transferred.
+ *
+ * The driver side is handled synchronously from the same main loop as
+ * the device, so the numbers reflect the overhead of the vhost-user
+ * server (and the kernel for notifications), not any real device.
+ *
+ * The device also has a small config space. It's read-only unless the
+ * config space writes are benchmarked as well, so the driver checks at
+ * setup that a write to it is rejected.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <usfstl/uds.h>
+#include <usfstl/loop.h>
+#include <usfstl/vhost.h>
+#include <linux/virtio_ring.h>
+#include <linux/virtio_config.h>
+
+struct bench_driver {
+	int fd, slave_fd;
+	int kick_fd, call_fd;
+	bool inband;
+
+	void *mem;
+	size_t mem_size;
+	int memfd;
+
+	struct vring vring;
+	uint16_t avail_idx, last_used_idx;
+
+	unsigned int size, depth;
+	uint8_t *bufs;
+
+	uint64_t kicks, calls, acks;
+};
+
+static uint8_t *echo_buf;
+static struct usfstl_vhost_user_dev *echo_dev;
+
+#define CONFIG_SIZE	64
+#define CONFIG_ROUNDS	10000
+static uint8_t echo_config[CONFIG_SIZE];
+
+void usfstl_abort(const char *fn, unsigned int line,
+		  const char *cond, const char *msg, ...)
+{
+	va_list ap;
+
+	fflush(stdout);
+	fprintf(stderr, "in %s:%d\n", fn, line);
+	fprintf(stderr, "condition %s failed\n", cond);
+	va_start(ap, msg);
+	vfprintf(stderr, msg, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	fflush(stderr);
+	abort();
+}
+
+static void echo_handle(struct usfstl_vhost_user_dev *dev,
+			struct usfstl_vhost_user_buf *buf,
+			unsigned int vring)
+{
+	size_t len;
+
+	len = iov_read(echo_buf, iov_len(buf->out_sg, buf->n_out_sg),
+		       buf->out_sg, buf->n_out_sg);
+	buf->written = iov_fill(buf->in_sg, buf->n_in_sg, echo_buf, len);
+}
+
+static void echo_connected(struct usfstl_vhost_user_dev *dev)
+{
+	echo_dev = dev;
+}
+
+static void echo_set_config(struct usfstl_vhost_user_dev *dev,
+			    unsigned int offset, const void *data,
+			    size_t len)
+{
+	memcpy(echo_config + offset, data, len);
+}
+
+static const struct usfstl_vhost_user_ops echo_ops = {
+	.connected = echo_connected,
+	.handle = echo_handle,
+};
+
+static void drv_send_flags(struct bench_driver *drv, uint32_t request,
+			   uint32_t flags, const void *payload, uint32_t size,
+			   const int *fds, int n_fds)
+{
+	struct vhost_user_msg_hdr hdr = {
+		.request = request,
+		.flags = VHOST_USER_VERSION | flags,
+		.size = size,
+	};
+	uint8_t control[CMSG_SPACE(sizeof(int) * MAX_REGIONS)] = {};
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr), },
+		{ .iov_base = (void *)payload, .iov_len = size, },
+	};
+	struct msghdr msghdr = {
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+	};
+
+	USFSTL_ASSERT(n_fds <= MAX_REGIONS);
+
+	if (n_fds) {
+		struct cmsghdr *cmsg;
+
+		msghdr.msg_control = control;
+		msghdr.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+		cmsg = CMSG_FIRSTHDR(&msghdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+	}
+
+	USFSTL_ASSERT(sendmsg(drv->fd, &msghdr, 0) ==
+		      (ssize_t)(sizeof(hdr) + size));
+
+	/* let the device handle it */
+	usfstl_loop_wait_and_handle();
+}
+
+static void drv_send(struct bench_driver *drv, uint32_t request,
+		     const void *payload, uint32_t size,
+		     const int *fds, int n_fds)
+{
+	drv_send_flags(drv, request, 0, payload, size, fds, n_fds);
+}
+
+static void drv_read_reply(struct bench_driver *drv, uint32_t request,
+			   void *payload, uint32_t size)
+{
+	struct vhost_user_msg_hdr hdr;
+
+	USFSTL_ASSERT(read(drv->fd, &hdr, sizeof(hdr)) == sizeof(hdr));
+	USFSTL_ASSERT(hdr.request == request);
+	USFSTL_ASSERT(hdr.flags & VHOST_USER_MSG_FLAGS_REPLY);
+	USFSTL_ASSERT(hdr.size == size);
+	USFSTL_ASSERT(read(drv->fd, payload, size) == (ssize_t)size);
+}
+
+static uint64_t drv_get_u64(struct bench_driver *drv, uint32_t request)
+{
+	uint64_t val;
+
+	drv_send(drv, request, NULL, 0, NULL, 0);
+	drv_read_reply(drv, request, &val, sizeof(val));
+
+	return val;
+}
+
+/* write to the config space, return the device's (REPLY_ACK) status */
+static uint64_t drv_set_config(struct bench_driver *drv, uint32_t offset,
+			       const void *data, uint32_t size)
+{
+	struct {
+		uint32_t offset, size, flags;
+		uint8_t data[CONFIG_SIZE];
+	} __attribute__((packed)) cfg = {
+		.offset = offset,
+		.size = size,
+		.flags = VHOST_USER_CFG_SPACE_WRITABLE,
+	};
+	uint64_t status;
+
+	USFSTL_ASSERT(size <= sizeof(cfg.data));
+	memcpy(cfg.data, data, size);
+	drv_send_flags(drv, VHOST_USER_SET_CONFIG,
+		       VHOST_USER_MSG_FLAGS_NEED_REPLY, &cfg,
+		       offsetof(typeof(cfg), data) + size, NULL, 0);
+	drv_read_reply(drv, VHOST_USER_SET_CONFIG, &status, sizeof(status));
+
+	return status;
+}
+
+static void drv_get_config(struct bench_driver *drv, uint32_t offset,
+			   void *data, uint32_t size)
+{
+	struct {
+		uint32_t offset, size, flags;
+		uint8_t data[CONFIG_SIZE];
+	} __attribute__((packed)) cfg = {
+		.offset = offset,
+		.size = size,
+	};
+	uint32_t len = offsetof(typeof(cfg), data) + size;
+
+	USFSTL_ASSERT(size <= sizeof(cfg.data));
+	drv_send(drv, VHOST_USER_GET_CONFIG, &cfg, len, NULL, 0);
+	drv_read_reply(drv, VHOST_USER_GET_CONFIG, &cfg, len);
+	USFSTL_ASSERT(cfg.offset == offset && cfg.size == size);
+	memcpy(data, cfg.data, size);
+}
+
+static void drv_send_u64(struct bench_driver *drv, uint32_t request,
+			 uint64_t val, int fd)
+{
+	drv_send(drv, request, &val, sizeof(val), &fd, fd >= 0);
+}
+
+static void drv_send_vring_state(struct bench_driver *drv, uint32_t request,
+				 uint32_t num)
+{
+	struct {
+		uint32_t idx, num;
+	} state = {
+		.num = num,
+	};
+
+	drv_send(drv, request, &state, sizeof(state), NULL, 0);
+}
+
+static void drv_setup_mem(struct bench_driver *drv, unsigned int num)
+{
+	size_t ring_size = vring_size(num, 4096);
+	struct {
+		uint32_t n_regions;
+		uint32_t reserved;
+		struct vhost_user_region regions[1];
+	} mem = {
+		.n_regions = 1,
+	};
+	unsigned int i;
+
+	drv->mem_size = ring_size + (size_t)drv->depth * drv->size * 2;
+	drv->mem_size = (drv->mem_size + 4095) & ~(size_t)4095;
+
+	drv->memfd = memfd_create("vhost-bench", 0);
+	USFSTL_ASSERT(drv->memfd >= 0);
+	USFSTL_ASSERT(ftruncate(drv->memfd, drv->mem_size) == 0);
+	drv->mem = mmap(NULL, drv->mem_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, drv->memfd, 0);
+	USFSTL_ASSERT(drv->mem != MAP_FAILED);
+
+	vring_init(&drv->vring, num, drv->mem, 4096);
+	drv->bufs = (uint8_t *)drv->mem + ring_size;
+
+	/* each buffer is an out/in descriptor pair, 2i -> 2i + 1 */
+	for (i = 0; i < drv->depth; i++) {
+		struct vring_desc *out = &drv->vring.desc[2 * i];
+		struct vring_desc *in = &drv->vring.desc[2 * i + 1];
+		uint8_t *data = drv->bufs + (size_t)i * drv->size * 2;
+
+		memset(data, i, drv->size);
+		out->addr = (uintptr_t)data;
+		out->len = drv->size;
+		out->flags = VRING_DESC_F_NEXT;
+		out->next = 2 * i + 1;
+		in->addr = (uintptr_t)(data + drv->size);
+		in->len = drv->size;
+		in->flags = VRING_DESC_F_WRITE;
+	}
+
+	/* identity mapping, so descriptors can use our addresses */
+	mem.regions[0].guest_phys_addr = (uintptr_t)drv->mem;
+	mem.regions[0].user_addr = (uintptr_t)drv->mem;
+	mem.regions[0].size = drv->mem_size;
+	drv_send(drv, VHOST_USER_SET_MEM_TABLE, &mem, sizeof(mem),
+		 &drv->memfd, 1);
+}
+
+static void drv_setup(struct bench_driver *drv, const char *socket,
+		      unsigned int num)
+{
+	struct {
+		uint32_t idx, flags;
+		uint64_t descriptor;
+		uint64_t used;
+		uint64_t avail;
+		uint64_t log;
+	} addr = {};
+	uint64_t features, protocol_features;
+	int sv[2];
+
+	drv->fd = usfstl_uds_connect_raw(socket);
+	/* accept the connection */
+	usfstl_loop_wait_and_handle();
+
+	features = drv_get_u64(drv, VHOST_USER_GET_FEATURES);
+	USFSTL_ASSERT(features & (1ULL << VIRTIO_F_VERSION_1));
+	drv_send_u64(drv, VHOST_USER_SET_FEATURES, features, -1);
+
+	protocol_features = drv_get_u64(drv, VHOST_USER_GET_PROTOCOL_FEATURES);
+	USFSTL_ASSERT(protocol_features &
+		      (1ULL << VHOST_USER_PROTOCOL_F_CONFIG));
+	protocol_features &= (1ULL << VHOST_USER_PROTOCOL_F_SLAVE_REQ) |
+			     (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) |
+			     (1ULL << VHOST_USER_PROTOCOL_F_CONFIG) |
+			     (1ULL << VHOST_USER_PROTOCOL_F_INBAND_NOTIFICATIONS);
+	drv_send_u64(drv, VHOST_USER_SET_PROTOCOL_FEATURES,
+		     protocol_features, -1);
+
+	USFSTL_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	drv->slave_fd = sv[0];
+	drv_send(drv, VHOST_USER_SET_SLAVE_REQ_FD, NULL, 0, &sv[1], 1);
+	close(sv[1]);
+
+	drv_setup_mem(drv, num);
+
+	drv_send_vring_state(drv, VHOST_USER_SET_VRING_NUM, num);
+	addr.descriptor = (uintptr_t)drv->vring.desc;
+	addr.avail = (uintptr_t)drv->vring.avail;
+	addr.used = (uintptr_t)drv->vring.used;
+	drv_send(drv, VHOST_USER_SET_VRING_ADDR, &addr, sizeof(addr), NULL, 0);
+	drv_send_vring_state(drv, VHOST_USER_SET_VRING_BASE, 0);
+
+	drv->kick_fd = -1;
+	drv->call_fd = -1;
+	if (drv->inband) {
+		drv_send_u64(drv, VHOST_USER_SET_VRING_KICK,
+			     VHOST_USER_U64_NO_FD, -1);
+		drv_send_u64(drv, VHOST_USER_SET_VRING_CALL,
+			     VHOST_USER_U64_NO_FD, -1);
+	} else {
+		drv->kick_fd = eventfd(0, EFD_NONBLOCK);
+		drv->call_fd = eventfd(0, EFD_NONBLOCK);
+		USFSTL_ASSERT(drv->kick_fd >= 0 && drv->call_fd >= 0);
+		drv_send_u64(drv, VHOST_USER_SET_VRING_KICK, 0, drv->kick_fd);
+		drv_send_u64(drv, VHOST_USER_SET_VRING_CALL, 0, drv->call_fd);
+	}
+
+	drv_send_vring_state(drv, VHOST_USER_SET_VRING_ENABLE, 1);
+}
+
+static void drv_kick(struct bench_driver *drv)
+{
+	uint64_t v = 1;
+
+	/* make the avail ring updates visible first */
+	__sync_synchronize();
+	drv->vring.avail->idx = drv->avail_idx;
+	drv->kicks++;
+
+	if (drv->inband) {
+		struct {
+			uint32_t idx, num;
+		} state = {};
+		struct vhost_user_msg_hdr hdr = {
+			.request = VHOST_USER_VRING_KICK,
+			.flags = VHOST_USER_VERSION,
+			.size = sizeof(state),
+		};
+		struct iovec iov[2] = {
+			{ .iov_base = &hdr, .iov_len = sizeof(hdr), },
+			{ .iov_base = &state, .iov_len = sizeof(state), },
+		};
+
+		USFSTL_ASSERT(writev(drv->fd, iov, 2) ==
+			      sizeof(hdr) + sizeof(state));
+		return;
+	}
+
+	USFSTL_ASSERT(write(drv->kick_fd, &v, sizeof(v)) == sizeof(v));
+}
+
+static void drv_collect_calls(struct bench_driver *drv)
+{
+	struct vhost_user_msg msg;
+	uint64_t v;
+
+	if (!drv->inband) {
+		if (read(drv->call_fd, &v, sizeof(v)) == sizeof(v))
+			drv->calls += v;
+		return;
+	}
+
+	while (recv(drv->slave_fd, &msg.hdr, sizeof(msg.hdr),
+		    MSG_DONTWAIT) == sizeof(msg.hdr)) {
+		USFSTL_ASSERT(msg.hdr.request == VHOST_USER_SLAVE_VRING_CALL);
+		USFSTL_ASSERT(read(drv->slave_fd, &msg.payload,
+				   msg.hdr.size) == msg.hdr.size);
+		drv->calls++;
+
+		if (!(msg.hdr.flags & VHOST_USER_MSG_FLAGS_NEED_REPLY))
+			continue;
+
+		msg.hdr.flags &= ~VHOST_USER_MSG_FLAGS_NEED_REPLY;
+		msg.hdr.flags |= VHOST_USER_MSG_FLAGS_REPLY;
+		msg.hdr.size = sizeof(msg.payload.u64);
+		msg.payload.u64 = 0;
+		USFSTL_ASSERT(write(drv->slave_fd, &msg,
+				    sizeof(msg.hdr) + sizeof(msg.payload.u64)) ==
+			      sizeof(msg.hdr) + sizeof(msg.payload.u64));
+		drv->acks++;
+	}
+}
+
+static void drv_post(struct bench_driver *drv, unsigned int head)
+{
+	drv->vring.avail->ring[drv->avail_idx % drv->vring.num] = head;
+	drv->avail_idx++;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-s <buffer size>] [-d <queue depth>] [-n <buffers>] [-i] [-w] [-c]\n"
+		"  -i: use in-band notifications instead of eventfds\n"
+		"  -w: handle the buffers on a worker thread\n"
+		"  -c: make the config space writable and time writing/reading it\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_driver drv = {
+		.size = 1024,
+		.depth = 64,
+	};
+	struct usfstl_vhost_user_ops ops = echo_ops;
+	struct usfstl_vhost_user_server server = {
+		.ops = &ops,
+		.max_queues = 1,
+		.input_queues = 1 << 0,
+		.features = 1ULL << VIRTIO_F_VERSION_1,
+		.config = echo_config,
+		.config_len = sizeof(echo_config),
+	};
+	uint8_t config[CONFIG_SIZE];
+	char socket[64];
+	uint64_t total = 1000000, posted = 0, done = 0;
+	unsigned int num = 1, i;
+	double start, elapsed;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:d:n:iwc")) != -1) {
+		switch (opt) {
+		case 's':
+			drv.size = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			drv.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			total = strtoull(optarg, NULL, 0);
+			break;
+		case 'i':
+			drv.inband = true;
+			break;
+		case 'w':
+			server.worker_queues = 1 << 0;
+			break;
+		case 'c':
+			ops.set_config = echo_set_config;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!drv.size || !drv.depth || drv.depth > 16384 || !total)
+		usage(argv[0]);
+
+	/* two descriptors per buffer, the ring size must be a power of 2 */
+	while (num < 2 * drv.depth)
+		num <<= 1;
+
+	echo_buf = malloc(drv.size);
+	USFSTL_ASSERT(echo_buf);
+
+	if (drv.inband)
+		server.protocol_features =
+			1ULL << VHOST_USER_PROTOCOL_F_INBAND_NOTIFICATIONS;
+
+	snprintf(socket, sizeof(socket), "/tmp/usfstl-vhost-bench-%d",
+		 (int)getpid());
+	server.socket = socket;
+	usfstl_vhost_user_server_start(&server);
+
+	drv_setup(&drv, socket, num);
+
+	for (i = 0; i < CONFIG_SIZE; i++)
+		echo_config[i] = i;
+	if (!ops.set_config) {
+		/* read-only, so this must be rejected and change nothing */
+		memset(config, 0xff, sizeof(config));
+		USFSTL_ASSERT(drv_set_config(&drv, 0, config, sizeof(config)));
+		drv_get_config(&drv, 0, config, sizeof(config));
+		for (i = 0; i < CONFIG_SIZE; i++)
+			USFSTL_ASSERT(config[i] == i);
+	}
+
+	start = now();
+
+	for (i = 0; i < drv.depth && posted < total; i++, posted++)
+		drv_post(&drv, 2 * i);
+	drv_kick(&drv);
+
+	while (done < total) {
+		uint16_t used_idx;
+		bool repost = false;
+
+		usfstl_loop_wait_and_handle();
+		drv_collect_calls(&drv);
+
+		used_idx = drv.vring.used->idx;
+		/* read the used entries after the index */
+		__sync_synchronize();
+
+		while (drv.last_used_idx != used_idx) {
+			struct vring_used_elem *e;
+
+			e = &drv.vring.used->ring[drv.last_used_idx % num];
+			drv.last_used_idx++;
+			USFSTL_ASSERT(e->len == drv.size);
+			done++;
+
+			if (posted < total) {
+				drv_post(&drv, e->id);
+				posted++;
+				repost = true;
+			}
+		}
+
+		if (repost)
+			drv_kick(&drv);
+	}
+
+	elapsed = now() - start;
+
+	/* let the device consume the last acks */
+	drv_collect_calls(&drv);
+
+	printf("buffer size %u, queue depth %u, %s notifications%s\n",
+	       drv.size, drv.depth, drv.inband ? "in-band" : "eventfd",
+	       server.worker_queues ? ", worker thread" : "");
+	printf("%" PRIu64 " buffers in %.3f s\n", done, elapsed);
+	printf("%.0f buffers/s, %.1f MB/s (each direction)\n",
+	       done / elapsed, done * (double)drv.size / elapsed / 1e6);
+	printf("%" PRIu64 " kicks (%.1f buffers/kick), %" PRIu64 " calls",
+	       drv.kicks, (double)done / drv.kicks, drv.calls);
+	if (drv.inband)
+		printf(", %" PRIu64 " acks", drv.acks);
+	printf("\n%.2f us per kick round-trip\n", elapsed * 1e6 / drv.kicks);
+	usfstl_vhost_user_dump_stats(echo_dev, stdout);
+
+	if (ops.set_config) {
+		uint32_t offset;
+
+		start = now();
+		for (i = 0; i < CONFIG_ROUNDS; i++) {
+			/* a full write doesn't fit the message payload */
+			memset(config, i, sizeof(config));
+			USFSTL_ASSERT(!drv_set_config(&drv, 0, config,
+						      sizeof(config)));
+			offset = i % (CONFIG_SIZE - 8);
+			memset(config, 0, 8);
+			drv_get_config(&drv, offset, config, 8);
+			USFSTL_ASSERT(config[0] == (uint8_t)i &&
+				      config[7] == (uint8_t)i);
+		}
+		elapsed = now() - start;
+
+		printf("%u config space writes and reads, %.2f us per write/read pair\n",
+		       CONFIG_ROUNDS, elapsed * 1e6 / CONFIG_ROUNDS);
+	}
+
+	/* verify the echo */
+	for (i = 0; i < drv.depth && i < total; i++) {
+		uint8_t *data = drv.bufs + (size_t)i * drv.size * 2;
+
+		USFSTL_ASSERT(memcmp(data, data + drv.size, drv.size) == 0);
+	}
+
+	close(drv.fd);
+	usfstl_loop_wait_and_handle();
+	usfstl_vhost_user_server_stop(&server);
+
+	return 0;
+}
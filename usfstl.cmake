@@ -67,7 +67,7 @@ macro(usfstl_configure_framework)
 
     set(USFSTL_FRAMEWORK_TARGET "usfstl${USFSTL_POSTFIX}")
 
-    if("${USFSTL_CONTEXT_BACKEND}" STREQUAL "pthread")
+    if("${USFSTL_CONTEXT_BACKEND}" STREQUAL "pthread" OR USFSTL_VHOST_USER)
         string(APPEND USFSTL_LINK_OPT " -pthread")
     endif()
 